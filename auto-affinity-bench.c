@@ -0,0 +1,205 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+/*
+ *  Benchmark auto-affinity available CPU translation.
+ *
+ *  Usage: auto-affinity-bench [NITERS [NCPUS...]]
+ *
+ *  For each simulated node size (default 64, 512 and 4096 CPUs), marks
+ *   every fourth CPU unavailable and translates every available CPU
+ *   index to a CPU id once per iteration, using both the original
+ *   linear walk of the available mask and mask_to_available(). Also
+ *   reports the cost of rebuilding the lookup table, with and without
+ *   smt=off filtering (simulated with two threads per core).
+ *
+ *  The plugin source is included so that the code measured is the
+ *   code built into auto-affinity.so. The spank functions it calls
+ *   are only provided by slurmd and srun, so they are stubbed below.
+ */
+
+#include "auto-affinity.c"
+
+#include <sys/time.h>
+
+int spank_remote (spank_t sp)
+{
+    return (0);
+}
+
+spank_err_t spank_get_item (spank_t sp, spank_item_t item, ...)
+{
+    return (ESPANK_ERROR);
+}
+
+spank_err_t spank_getenv (spank_t sp, const char *var, char *buf, int len)
+{
+    return (ESPANK_ERROR);
+}
+
+static double now (void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/*
+ *  mask_to_available() before the lookup table.
+ */
+static int mask_to_available_walk (int cpu)
+{
+    int i;
+    int j = 0;
+    for (i = 0; i < ncpus; i++) {
+        if (CPU_ISSET_S (i, cpu_setsize, cpus_available) && (cpu == j++))
+            return (i);
+    }
+    return (-1);
+}
+
+static void bench_reset (void)
+{
+    if (cpus_available)
+        CPU_FREE (cpus_available);
+    cpus_available = NULL;
+    if (available_cpu_map)
+        free (available_cpu_map);
+    available_cpu_map = NULL;
+    if (cpu_core_leader)
+        free (cpu_core_leader);
+    cpu_core_leader = NULL;
+    cpu_setsize = 0;
+}
+
+static int bench_setup (int n)
+{
+    int i;
+
+    bench_reset ();
+
+    ncpus = n;
+    if (!(cpus_available = cpu_set_create ()))
+        return (-1);
+
+    for (i = 0; i < ncpus; i++) {
+        if (i % 4 != 3)
+            CPU_SET_S (i, cpu_setsize, cpus_available);
+    }
+
+    return (available_cpu_map_update (cpus_available));
+}
+
+/*
+ *  Simulate smt=off on a node with two threads per core.
+ */
+static int bench_setup_smt_off (void)
+{
+    int i;
+
+    if (!(cpu_core_leader = malloc (ncpus * sizeof (int))))
+        return (-1);
+    for (i = 0; i < ncpus; i++)
+        cpu_core_leader [i] = i & ~1;
+    return (0);
+}
+
+/*
+ *  Return the average time in microseconds to translate all [navail]
+ *   available CPUs with [fn].
+ */
+static double bench_run (int (*fn) (int), int navail, int niters)
+{
+    int i, j;
+    long sum = 0;
+    double t0 = now ();
+
+    for (i = 0; i < niters; i++) {
+        for (j = 0; j < navail; j++)
+            sum += (*fn) (j);
+    }
+
+    if (sum < 0)
+        fprintf (stderr, "Failed to translate available CPUs\n");
+
+    return ((now () - t0) * 1e6 / niters);
+}
+
+/*
+ *  Return the average time in microseconds to rebuild the table.
+ */
+static double bench_update (int niters)
+{
+    int i;
+    double t0 = now ();
+
+    for (i = 0; i < niters; i++)
+        available_cpu_map_update (cpus_available);
+
+    return ((now () - t0) * 1e6 / niters);
+}
+
+int main (int ac, char **av)
+{
+    int default_ncpus [] = { 64, 512, 4096 };
+    int niters = 100;
+    int i, n, navail;
+    double walk, table, update, update_smt;
+
+    if (ac > 1 && (niters = atoi (av[1])) <= 0) {
+        fprintf (stderr, "Usage: %s [NITERS [NCPUS...]]\n", av[0]);
+        exit (1);
+    }
+
+    for (i = 0; i < (ac > 2 ? ac - 2 : 3); i++) {
+        n = (ac > 2) ? atoi (av[i+2]) : default_ncpus [i];
+
+        if (n <= 0 || (navail = bench_setup (n)) <= 0) {
+            fprintf (stderr, "Failed to set up %d CPUs\n", n);
+            exit (1);
+        }
+
+        walk = bench_run (mask_to_available_walk, navail, niters);
+        table = bench_run (mask_to_available, navail, niters);
+        update = bench_update (niters);
+
+        if (bench_setup_smt_off () < 0) {
+            fprintf (stderr, "Out of memory\n");
+            exit (1);
+        }
+        update_smt = bench_update (niters);
+
+        fprintf (stdout, "%5d CPUs (%d available): walk %.2f us, "
+                 "table %.2f us per pass, update %.2f us "
+                 "(smt=off %.2f us)\n",
+                 n, navail, walk, table, update, update_smt);
+    }
+
+    bench_reset ();
+    return (0);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
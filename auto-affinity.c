@@ -28,7 +28,11 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
 
 #define __USE_GNU
 #include <sched.h>
@@ -41,6 +45,7 @@
 
 #include "lib/split.h"
 #include "lib/fd.h"
+#include "lib/strbuf.h"
 
 SPANK_PLUGIN(auto-affinity, 1);
 
@@ -70,6 +75,15 @@ where args... is a comma separated list of one or more of the following\n\
   rev(erse)         Allocate last CPU first instead of starting with CPU0.\n\
   cpus_per_task=N   Allocate [N] CPUs to each task.\n\
   cpt=N             Shorthand for cpus_per_task.\n\
+  smt=first         Allocate all hardware threads of a core before\n\
+                    moving on to the next core.\n\
+  smt=last          Allocate one thread per core on all cores before\n\
+                    using any sibling hyperthreads.\n\
+  smt=off           Never allocate sibling hyperthreads.\n\
+  l3                Keep the CPUs of each task within a single shared L3\n\
+                    cache domain, and distribute tasks round-robin across\n\
+                    domains. Falls back to the default placement if the\n\
+                    tasks do not fit evenly in the L3 domains.\n\
 \n\
 The following options may be used to explicitly list the CPUs for each\n\
 task on a node.\n\
@@ -81,7 +95,8 @@ cpuset(4) manpage in the FORMATS section. Masks may be optionally followed\n\
 by a repeat count (e.g. 0xf0*2 == 0xf0,0xf0)\n\
 \n\
 If one of the cpus= or masks= options is used, it must be the last option\n\
-specified, and any 'reverse' or 'start' option will be ignored\n\
+specified, and any 'reverse' or 'start' option will be ignored. The\n\
+'reverse' and 'start' options are also ignored in l3 mode.\n\
 \n\n";
 
 
@@ -97,15 +112,33 @@ static int enabled = 1;    /* True if enabled by configuration              */
 static int disabled = 0;   /* True if disabled by --auto-affinity=off       */
 static int verbose = 0;
 static int reverse = 0;
+static int l3_mode = 0;    /* Distribute tasks across L3 cache domains      */
 static int startcpu = 0;
 static int requested_cpus_per_task = 0;
 
+/*
+ *  Placement of SMT sibling threads (smt= option)
+ */
+enum smt_mode {
+    SMT_DEFAULT = 0,       /* Order CPUs by package and core only          */
+    SMT_FIRST,             /* Fill all threads of a core before next core  */
+    SMT_LAST,              /* Use sibling threads only after all cores     */
+    SMT_OFF                /* Never use sibling threads                    */
+};
+static enum smt_mode smt_mode = SMT_DEFAULT;
+
+/*
+ *  Path to node topology cache (NULL if disabled)
+ */
+static const char *topology_cache = "/var/run/slurm-auto-affinity.topology";
+
 /*
  *  Variables for explicit user CPU/core mapping.
  */
 static int        nlist_elements = 0;    /* Number of elements in following  */
 static char       *cpus_list = NULL;     /* cstr-style list of CPUs          */
-static cpu_set_t *cpu_mask_list = NULL;  /* array of CPU masks               */
+static cpu_set_t **cpu_mask_list = NULL; /* array of CPU masks               */
+static size_t     cpu_mask_setsize = 0;  /* Size in bytes of above masks     */
 
 static int exclusive_only = 0; /*  Only set affinity if this job has         *
                                 *   exclusive access to this node            */
@@ -115,9 +148,27 @@ static int multiples_only = 0; /*  Only set affinity if ncpus is a multiple  *
 /*
  *  CPU position map (logical to physical CPU/core mapping)
  */
-static cpu_set_t cpus_available;
+static cpu_set_t *cpus_available = NULL;
 static int       ncpus_available;
 static int      *cpu_position_map = NULL;
+static int       npositions = 0;           /* Number of entries in above    */
+
+/*
+ *  L3 cache domains as ranges of the CPU position map (l3 option)
+ */
+static int      *l3_domain_start = NULL;   /* First position in domain N    */
+static int      *l3_domain_size = NULL;    /* Number of positions in above  */
+static int       nl3_domains = 0;
+static int      *available_cpu_map = NULL; /* Nth available CPU to CPU id   */
+static int       navailable_map = 0;       /* Number of entries in above    */
+static int      *cpu_core_leader = NULL;   /* CPU id to lowest id on core   */
+
+/*
+ *  Dynamically sized CPU sets (see CPU_ALLOC(3)). All sets are
+ *   allocated with room for cpu_set_max CPUs, or cpu_setsize bytes.
+ */
+static int       cpu_set_max = 0;
+static size_t    cpu_setsize = 0;
 
 /*****************************************************************************
  *
@@ -126,11 +177,12 @@ static int      *cpu_position_map = NULL;
  ****************************************************************************/
 
 static int parse_user_option (int val, const char *optarg, int remote);
-static char * cpuset_to_cstr (cpu_set_t *mask, char *str);
+static char * cpuset_to_cstr (cpu_set_t *mask);
 static int cstr_count (const char *str);
 static int cstr_to_cpu_id (const char *str, int n);
 static int str_to_cpuset(cpu_set_t *mask, const char* str);
 static int cpu_set_count (cpu_set_t *setp);
+static cpu_set_t * cpu_set_create (void);
 
 
 /*****************************************************************************
@@ -180,6 +232,16 @@ static int parse_option (const char *opt, int remote)
         if ((requested_cpus_per_task = str2int (opt+14)) < 0)
             goto fail;
     }
+    else if (strcmp (opt, "l3") == 0)
+        l3_mode = 1;
+    else if (strcmp (opt, "smt=first") == 0)
+        smt_mode = SMT_FIRST;
+    else if (strcmp (opt, "smt=last") == 0)
+        smt_mode = SMT_LAST;
+    else if (strcmp (opt, "smt=off") == 0)
+        smt_mode = SMT_OFF;
+    else if (strncmp (opt, "smt=", 4) == 0)
+        goto fail;
     else if (strncmp (opt, "start=", 6) == 0) {
         if ((startcpu = str2int (opt+6)) < 0)
             goto fail;
@@ -265,13 +327,18 @@ static int parse_cpu_mask_list (List l)
     List mask_list = cpu_mask_list_expand (l);
 
     nlist_elements = n = list_count (mask_list);
-    cpu_mask_list = malloc (n * sizeof(cpu_set_t));
+    cpu_mask_list = calloc (n, sizeof (cpu_set_t *));
 
     while ((s = list_pop (mask_list))) {
-        if ((rc = str_to_cpuset (&cpu_mask_list[i++], s)) < 0)
+        if (!(cpu_mask_list[i] = cpu_set_create ()))
+            rc = -1;
+        else if ((rc = str_to_cpuset (cpu_mask_list[i], s)) < 0)
             fprintf (stderr, "auto-affinity: Invalide cpu mask '%s'\n", s);
+        i++;
         free (s);
     }
+    cpu_mask_setsize = cpu_setsize;
+    list_destroy (mask_list);
     return rc;
 }
 
@@ -322,6 +389,10 @@ static int parse_argv (int ac, char **av, int remote)
             exclusive_only = 1;
         else if (strcmp (av[i], "multiples_only") == 0)
             multiples_only = 1;
+        else if (strcmp (av[i], "topology_cache=none") == 0)
+            topology_cache = NULL;
+        else if (strncmp (av[i], "topology_cache=", 15) == 0)
+            topology_cache = av[i] + 15;
         else
             return (-1);
     }
@@ -356,8 +427,70 @@ struct cpu_info {
     int id;
     int pkgid;
     int coreid;
+    int threadid;   /* Index of this CPU among its core's SMT siblings */
+    int l3id;       /* Lowest CPU id sharing this CPU's L3 cache, or -1 */
 };
 
+/*
+ *  Read the first CPU listed in the sysfs cpu list file [path], or
+ *   return -1 if the file does not exist or cannot be parsed.
+ */
+static int read_file_first_cpu (const char *path)
+{
+    char buf [1024];
+    FILE *fp;
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return (-1);
+
+    if (fgets (buf, sizeof (buf), fp) == NULL) {
+        fclose (fp);
+        return (-1);
+    }
+    fclose (fp);
+    buf [strcspn (buf, "\n")] = '\0';
+
+    if (cstr_count (buf) <= 0)
+        return (-1);
+
+    return (cstr_to_cpu_id (buf, 0));
+}
+
+/*
+ *  Return the index of CPU [id] in its thread_siblings_list, i.e.
+ *   0 for the first hardware thread of a core, 1 for the second, etc.
+ *   Returns 0 if the sibling list is not available.
+ */
+static int lookup_thread_id (const char *cpudir, int id)
+{
+    char path [4096];
+    char buf [1024];
+    FILE *fp;
+    int i, n;
+
+    snprintf (path, sizeof (path),
+            "%s/cpu%d/topology/thread_siblings_list", cpudir, id);
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return (0);
+
+    if (fgets (buf, sizeof (buf), fp) == NULL) {
+        fclose (fp);
+        return (0);
+    }
+    fclose (fp);
+    buf [strcspn (buf, "\n")] = '\0';
+
+    if ((n = cstr_count (buf)) <= 0)
+        return (0);
+
+    for (i = 0; i < n; i++) {
+        if (cstr_to_cpu_id (buf, i) == id)
+            return (i);
+    }
+    return (0);
+}
+
 static int lookup_cpu_info (struct cpu_info *cpu)
 {
     const char cpudir[] = "/sys/devices/system/cpu";
@@ -377,74 +510,346 @@ static int lookup_cpu_info (struct cpu_info *cpu)
     if (cpu->coreid < 0)
         return (-1);
 
+    cpu->threadid = lookup_thread_id (cpudir, cpu->id);
+
+    snprintf (path, sizeof (path),
+            "%s/cpu%d/cache/index3/shared_cpu_list", cpudir, cpu->id);
+    cpu->l3id = read_file_first_cpu (path);
+
     return (0);
 }
 
+/*
+ *  Read CPU topology for [ncpus] CPUs from sysfs into a newly
+ *   allocated array of struct cpu_info.
+ */
+static struct cpu_info * cpu_info_array_create (int ncpus)
+{
+    int i;
+    struct cpu_info *cpus = malloc (ncpus * sizeof (struct cpu_info));
+
+    if (cpus == NULL)
+        return (NULL);
+
+    for (i = 0; i < ncpus; i++) {
+        cpus[i].id = i;
+        if (lookup_cpu_info (&cpus[i]) < 0) {
+            slurm_error ("auto-affinity: Failed to get info for cpu%d\n", i);
+            free (cpus);
+            return (NULL);
+        }
+    }
+
+    return (cpus);
+}
 
-static void cpu_info_destroy (struct cpu_info *cpu)
+/*
+ *  Order CPUs by physical location. With smt=last or smt=off, the
+ *   first thread of every core sorts before any sibling threads.
+ *   In l3 mode, CPUs in the same L3 domain always sort together.
+ */
+static int cpu_info_cmp (const void *a, const void *b)
 {
-    if (cpu)
-        free (cpu);
+    const struct cpu_info *cpu1 = a;
+    const struct cpu_info *cpu2 = b;
+
+    if (l3_mode) {
+        if (cpu1->pkgid != cpu2->pkgid)
+            return (cpu1->pkgid - cpu2->pkgid);
+        if (cpu1->l3id != cpu2->l3id)
+            return (cpu1->l3id - cpu2->l3id);
+    }
+
+    if ((smt_mode == SMT_LAST || smt_mode == SMT_OFF)
+        && (cpu1->threadid != cpu2->threadid))
+        return (cpu1->threadid - cpu2->threadid);
+
+    if (cpu1->pkgid != cpu2->pkgid)
+        return (cpu1->pkgid - cpu2->pkgid);
+
+    if (cpu1->coreid != cpu2->coreid)
+        return (cpu1->coreid - cpu2->coreid);
+
+    if ((smt_mode == SMT_FIRST) && (cpu1->threadid != cpu2->threadid))
+        return (cpu1->threadid - cpu2->threadid);
+
+    /*
+     *  Without an smt= option, siblings keep their historical
+     *   placement (highest CPU id first).
+     */
+    if (smt_mode == SMT_DEFAULT)
+        return (cpu2->id - cpu1->id);
+
+    return (cpu1->id - cpu2->id);
 }
 
-static struct cpu_info * cpu_info_create (int id)
+/*
+ *  Order CPUs by core, so that all threads of a core are adjacent.
+ */
+static int cpu_core_cmp (const void *a, const void *b)
 {
-    struct cpu_info *cpu = malloc (sizeof (struct cpu_info));
+    const struct cpu_info *cpu1 = a;
+    const struct cpu_info *cpu2 = b;
 
-    if (!cpu)
-        return NULL;
+    if (cpu1->pkgid != cpu2->pkgid)
+        return (cpu1->pkgid - cpu2->pkgid);
+    if (cpu1->coreid != cpu2->coreid)
+        return (cpu1->coreid - cpu2->coreid);
+    return (cpu1->id - cpu2->id);
+}
+
+/*****************************************************************************
+ *
+ *  Node topology cache:
+ *
+ *  Reading the topology of every CPU from sysfs costs two file opens
+ *   per CPU, which adds up on large nodes. Instead, the CPU info array
+ *   is saved to a small binary file the first time it is read (by
+ *   slurmd at startup, or by the first job step to run on the node),
+ *   and is mmap'd read-only thereafter. The cache records the contents
+ *   of /sys/devices/system/cpu/online, so it is rebuilt whenever the
+ *   set of online CPUs changes (e.g. on CPU hotplug).
+ *
+ ****************************************************************************/
+
+#define TOPOLOGY_CACHE_MAGIC   0x61616663 /* "aafc" */
+#define TOPOLOGY_CACHE_VERSION 3
 
-    cpu->id = id;
+struct topology_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ncpus;
+    char     online [1024];
+};
+
+static int read_cpus_online (char *buf, size_t len)
+{
+    const char path[] = "/sys/devices/system/cpu/online";
+    FILE *fp;
+
+    memset (buf, 0, len);
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return (-1);
+
+    if (fgets (buf, len, fp) == NULL) {
+        fclose (fp);
+        return (-1);
+    }
+    fclose (fp);
 
-    if (lookup_cpu_info (cpu) < 0) {
-        slurm_error ("auto-affinity: Failed to get info for cpu%d\n", id);
-        cpu_info_destroy (cpu);
+    return (0);
+}
+
+/*
+ *  Return a copy of the cached CPU info array for [ncpus] CPUs, or NULL
+ *   if the cache does not exist or is stale.
+ */
+static struct cpu_info * topology_cache_load (int ncpus)
+{
+    struct topology_cache_header *hdr;
+    struct cpu_info *cpus = NULL;
+    char online [1024];
+    struct stat st;
+    size_t size;
+    void *p;
+    int fd;
+
+    if (!topology_cache || read_cpus_online (online, sizeof (online)) < 0)
+        return (NULL);
+
+    if ((fd = open (topology_cache, O_RDONLY)) < 0)
+        return (NULL);
+
+    size = sizeof (*hdr) + ncpus * sizeof (struct cpu_info);
+    if (fstat (fd, &st) < 0 || st.st_size != size) {
+        close (fd);
         return (NULL);
     }
-        
-    return (cpu);
+
+    p = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (p == MAP_FAILED)
+        return (NULL);
+
+    hdr = p;
+    if (hdr->magic == TOPOLOGY_CACHE_MAGIC
+        && hdr->version == TOPOLOGY_CACHE_VERSION
+        && hdr->ncpus == ncpus
+        && strncmp (hdr->online, online, sizeof (online)) == 0
+        && (cpus = malloc (ncpus * sizeof (struct cpu_info))))
+        memcpy (cpus, hdr + 1, ncpus * sizeof (struct cpu_info));
+
+    munmap (p, size);
+
+    return (cpus);
 }
 
-static int cpu_info_cmp (struct cpu_info *cpu1, struct cpu_info *cpu2)
+/*
+ *  Atomically replace the topology cache with [ncpus] entries from [cpus].
+ */
+static int topology_cache_store (const struct cpu_info *cpus, int ncpus)
 {
-    if (cpu1->pkgid == cpu2->pkgid)
-        return (cpu1->coreid - cpu2->coreid);
-    else 
-        return (cpu1->pkgid - cpu2->pkgid);
+    struct topology_cache_header hdr;
+    char tmp [4096];
+    int fd;
+    int n;
+
+    if (!topology_cache)
+        return (0);
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.magic = TOPOLOGY_CACHE_MAGIC;
+    hdr.version = TOPOLOGY_CACHE_VERSION;
+    hdr.ncpus = ncpus;
+    if (read_cpus_online (hdr.online, sizeof (hdr.online)) < 0)
+        return (-1);
+
+    n = snprintf (tmp, sizeof (tmp), "%s.%d", topology_cache, getpid ());
+    if ((n < 0) || (n >= sizeof (tmp)))
+        return (-1);
+
+    if ((fd = open (tmp, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0644)) < 0)
+        return (-1);
+
+    if ((fd_write_n (fd, &hdr, sizeof (hdr)) < 0)
+        || (fd_write_n (fd, (void *) cpus, ncpus * sizeof (*cpus)) < 0)) {
+        close (fd);
+        goto fail;
+    }
+
+    if ((close (fd) < 0) || (rename (tmp, topology_cache) < 0))
+        goto fail;
+
+    return (0);
+
+    fail:
+    slurm_error ("auto-affinity: Failed to write %s: %m", topology_cache);
+    unlink (tmp);
+    return (-1);
 }
 
-static int create_cpu_position_map (int ncpus)
+/*
+ *  Get CPU info array for [ncpus] CPUs from the topology cache if
+ *   possible, otherwise read it from sysfs and refresh the cache.
+ */
+static struct cpu_info * get_cpu_info_array (int ncpus)
+{
+    struct cpu_info *cpus;
+
+    if ((cpus = topology_cache_load (ncpus)))
+        return (cpus);
+
+    if ((cpus = cpu_info_array_create (ncpus)))
+        topology_cache_store (cpus, ncpus);
+
+    return (cpus);
+}
+
+/*
+ *  Record the L3 domains of the sorted [cpus] array as ranges of the
+ *   position map. Leaves nl3_domains at 0 if L3 information is missing.
+ */
+static int l3_domains_create (struct cpu_info *cpus, int ncpus)
 {
-    List cpu_info_list;
-    ListIterator iter;
     int i;
-    struct cpu_info *cpu;
+    int pos = 0;
+    int l3id = -1;
 
-    cpu_info_list = list_create ((ListDelF) cpu_info_destroy);
+    if (!(l3_domain_start = malloc (ncpus * sizeof (int)))
+        || !(l3_domain_size = malloc (ncpus * sizeof (int)))) {
+        slurm_error ("auto-affinity: Out of memory");
+        return (-1);
+    }
 
+    nl3_domains = 0;
     for (i = 0; i < ncpus; i++) {
-        if ((cpu = cpu_info_create (i)) == NULL)
+        if ((smt_mode == SMT_OFF) && (cpus[i].threadid > 0))
+            continue;
+        if (cpus[i].l3id < 0) {
+            nl3_domains = 0;
             return (-1);
-        list_push (cpu_info_list, cpu);
+        }
+        if ((nl3_domains == 0) || (cpus[i].l3id != l3id)) {
+            l3id = cpus[i].l3id;
+            l3_domain_start [nl3_domains] = pos;
+            l3_domain_size [nl3_domains] = 0;
+            nl3_domains++;
+        }
+        l3_domain_size [nl3_domains - 1]++;
+        pos++;
+    }
+    return (0);
+}
+
+/*
+ *  Record the lowest CPU id on each CPU's core (smt=off), so that
+ *   sibling threads can also be filtered out of a restricted set of
+ *   available CPUs. Reorders [cpus].
+ */
+static int core_leader_map_create (struct cpu_info *cpus, int ncpus)
+{
+    int i;
+
+    if (!(cpu_core_leader = malloc (ncpus * sizeof (int)))) {
+        slurm_error ("auto-affinity: Out of memory");
+        return (-1);
+    }
+
+    qsort (cpus, ncpus, sizeof (struct cpu_info), cpu_core_cmp);
+
+    for (i = 0; i < ncpus; i++) {
+        int id = cpus[i].id;
+        if ((id < 0) || (id >= ncpus))
+            continue;
+        if ((i > 0)
+            && (cpus[i].pkgid == cpus[i-1].pkgid)
+            && (cpus[i].coreid == cpus[i-1].coreid))
+            cpu_core_leader [id] = cpu_core_leader [cpus[i-1].id];
+        else
+            cpu_core_leader [id] = id;
+    }
+    return (0);
+}
+
+static int create_cpu_position_map (int ncpus)
+{
+    int i;
+    struct cpu_info *cpus;
+
+    if ((cpus = get_cpu_info_array (ncpus)) == NULL)
+        return (-1);
+
+    if ((smt_mode == SMT_OFF) && (core_leader_map_create (cpus, ncpus) < 0)) {
+        free (cpus);
+        return (-1);
     }
 
     /*
-     *  Sort list of CPUs by physical location.
+     *  Sort CPUs by physical location.
      */
-    list_sort (cpu_info_list, (ListCmpF) cpu_info_cmp);
+    qsort (cpus, ncpus, sizeof (struct cpu_info), cpu_info_cmp);
 
     /*
-     *  Build array to map cpu position back to cpu logical id:
+     *  Build array to map cpu position back to cpu logical id.
+     *   With smt=off, only the first thread of each core is used.
      */
-    i = 0;
-    cpu_position_map = malloc (ncpus * sizeof (int));
+    if (!(cpu_position_map = malloc (ncpus * sizeof (int)))) {
+        free (cpus);
+        return (-1);
+    }
 
-    iter = list_iterator_create (cpu_info_list);
+    npositions = 0;
+    for (i = 0; i < ncpus; i++) {
+        if ((smt_mode == SMT_OFF) && (cpus[i].threadid > 0))
+            continue;
+        cpu_position_map[npositions++] = cpus[i].id;
+    }
 
-    while ((cpu = list_next (iter)))
-        cpu_position_map[i++] = cpu->id;
+    if (l3_mode)
+        l3_domains_create (cpus, ncpus);
 
-    list_destroy (cpu_info_list);
+    free (cpus);
 
     return (0);
 }
@@ -454,6 +859,17 @@ static int cpu_position_to_id (int n)
     return cpu_position_map [n];
 }
 
+/*
+ *  Return the number of CPUs that may be allocated to tasks, which is
+ *   fewer than the available CPUs when sibling threads are excluded.
+ */
+static int ncpus_usable (void)
+{
+    if (npositions < ncpus_available)
+        return (npositions);
+    return (ncpus_available);
+}
+
 static int get_nodeid (spank_t sp)
 {
     int nodeid = -1;
@@ -588,9 +1004,6 @@ int slurm_spank_init (spank_t sp, int ac, char **av)
         return (-1);
     }
 
-    if (create_cpu_position_map (ncpus) < 0)
-        return (-1);
-
     if (spank_get_item (sp, S_JOB_LOCAL_TASK_COUNT, &ntasks) != ESPANK_SUCCESS) 
     {
         slurm_error ("Failed to get number of local tasks\n");
@@ -600,6 +1013,34 @@ int slurm_spank_init (spank_t sp, int ac, char **av)
     return (0);
 }
 
+/*
+ *  Prime the topology cache once at slurmd startup so that job steps
+ *   do not need to read CPU topology from sysfs.
+ */
+int slurm_spank_slurmd_init (spank_t sp, int ac, char **av)
+{
+    struct cpu_info *cpus;
+
+    if (parse_argv (ac, av, 1) < 0)
+        return (-1);
+
+    if (!topology_cache)
+        return (0);
+
+    if ((ncpus = (int) sysconf (_SC_NPROCESSORS_ONLN)) < 0) {
+        slurm_error ("Failed to get number of processors: %m\n");
+        return (-1);
+    }
+
+    if ((cpus = cpu_info_array_create (ncpus)) == NULL)
+        return (-1);
+
+    topology_cache_store (cpus, ncpus);
+    free (cpus);
+
+    return (0);
+}
+
 int slurm_spank_exit (spank_t sp, int ac, char **av)
 {
     if (!spank_remote (sp))
@@ -608,11 +1049,31 @@ int slurm_spank_exit (spank_t sp, int ac, char **av)
     if (cpu_position_map != NULL)
         free (cpu_position_map);
 
+    if (available_cpu_map != NULL)
+        free (available_cpu_map);
+
+    if (cpu_core_leader != NULL)
+        free (cpu_core_leader);
+
+    if (l3_domain_start != NULL)
+        free (l3_domain_start);
+
+    if (l3_domain_size != NULL)
+        free (l3_domain_size);
+
     if (cpus_list != NULL)
         free (cpus_list);
 
-    if (cpu_mask_list != NULL)
+    if (cpu_mask_list != NULL) {
+        int i;
+        for (i = 0; i < nlist_elements; i++)
+            if (cpu_mask_list[i])
+                CPU_FREE (cpu_mask_list[i]);
         free (cpu_mask_list);
+    }
+
+    if (cpus_available != NULL)
+        CPU_FREE (cpus_available);
 
     return (0);
 }
@@ -670,7 +1131,7 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
     /*
      *   Don't do anything for overcommit
      */
-    if (ntasks > ncpus_available) {
+    if (ntasks > ncpus_usable ()) {
         if (verbose)
             fprintf (stderr, "auto-affinity: Disabling due to overcommit.\n");
         return (0);
@@ -679,7 +1140,7 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
     /*
      *  If ncpus is a multiple of ntasks then enable auto-affinity.
      */
-    if ((ncpus_available % ntasks) == 0) {
+    if ((ncpus_usable () % ntasks) == 0) {
         enabled = 1;
         return (0);
     }
@@ -688,11 +1149,11 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
      *  If multiples_only is set or ncpus/ntasks == 1,
      *   then do nothing.
      */
-    if (multiples_only || (ncpus_available/ntasks == 1)) {
+    if (multiples_only || (ncpus_usable ()/ntasks == 1)) {
         if (verbose) {
             fprintf (stderr, "auto-affinity: Not adjusting mask. "
                     "(%d tasks not evenly divided among %d CPUs)\n", 
-                    ntasks, ncpus_available);
+                    ntasks, ncpus_usable ());
             fprintf (stderr, "To force, explicity set cpus-per-task\n");
         }
         return (0);
@@ -702,21 +1163,52 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
      *  Now we know ncpus/ntasks > 1.
      *   Set this as the requested CPUs/task  and enable auto-affinity:
      */
-    requested_cpus_per_task = ncpus_available/ntasks;
+    requested_cpus_per_task = ncpus_usable ()/ntasks;
     enabled = 1;
 
     return (0);
 }
 
-static int cpu_set_count (cpu_set_t *setp)
+/*
+ *  Size CPU sets for the number of configured CPUs on this node,
+ *   which may be larger or (much) smaller than CPU_SETSIZE.
+ */
+static void cpu_set_size_init (void)
 {
-    int i;
-    int n = 0;
-    for (i = 0; i < CPU_SETSIZE; i++) {
-        if (CPU_ISSET (i, setp))
-            n++;
+    long n;
+
+    if (cpu_setsize)
+        return;
+
+    if ((n = sysconf (_SC_NPROCESSORS_CONF)) < ncpus)
+        n = ncpus;
+    if (n <= 0)
+        n = CPU_SETSIZE;
+
+    cpu_set_max = (int) n;
+    cpu_setsize = CPU_ALLOC_SIZE (cpu_set_max);
+}
+
+/*
+ *  Return a new, empty CPU set of the current size, or NULL on failure.
+ */
+static cpu_set_t * cpu_set_create (void)
+{
+    cpu_set_t *setp;
+
+    cpu_set_size_init ();
+
+    if (!(setp = CPU_ALLOC (cpu_set_max))) {
+        slurm_error ("auto-affinity: Out of memory");
+        return (NULL);
     }
-    return (n);
+    CPU_ZERO_S (cpu_setsize, setp);
+    return (setp);
+}
+
+static int cpu_set_count (cpu_set_t *setp)
+{
+    return (CPU_COUNT_S (cpu_setsize, setp));
 }
 
 static int get_cpus_per_task ()
@@ -724,7 +1216,7 @@ static int get_cpus_per_task ()
     if (requested_cpus_per_task)
         return (requested_cpus_per_task);
     else
-        return (ncpus_available / ntasks);
+        return (ncpus_usable () / ntasks);
 }
 
 /*
@@ -733,12 +1225,8 @@ static int get_cpus_per_task ()
  */
 static int mask_to_available (int cpu)
 {
-    int i;
-    int j = 0;
-    for (i = 0; i < ncpus; i++) {
-        if (CPU_ISSET (i, &cpus_available) && (cpu == j++))
-            return (i);
-    }
+    if ((cpu >= 0) && (cpu < navailable_map))
+        return (available_cpu_map [cpu]);
     slurm_error ("Yikes! Couldn't convert CPU%d to available CPU!", cpu);
     return (-1);
 }
@@ -746,17 +1234,25 @@ static int mask_to_available (int cpu)
 static int cpu_set_physical_to_logical (cpu_set_t *setp)
 {
     int i;
-    cpu_set_t lcpus = *setp;
+    int n;
+    cpu_set_t *lcpus;
+
+    if (!(lcpus = cpu_set_create ()))
+        return (-1);
+    memcpy (lcpus, setp, cpu_setsize);
 
-    CPU_ZERO (setp);
+    CPU_ZERO_S (cpu_setsize, setp);
 
-    for (i = 0; i < CPU_SETSIZE; i++) {
-        if (CPU_ISSET (i, &lcpus)) {
+    n = cpu_set_count (lcpus);
+    for (i = 0; (n > 0) && (i < npositions); i++) {
+        if (CPU_ISSET_S (i, cpu_setsize, lcpus)) {
             int cpu = cpu_position_to_id (i);
-            CPU_SET (mask_to_available (cpu), setp);
+            CPU_SET_S (mask_to_available (cpu), cpu_setsize, setp);
+            n--;
         }
     }
 
+    CPU_FREE (lcpus);
     return (0);
 }
 
@@ -767,21 +1263,21 @@ static int generate_mask (cpu_set_t *setp, int localid)
     int cpus_per_task = get_cpus_per_task ();
 
     if (cpus_per_task == 1) {
-        int n = cpu_position_to_id (localid + startcpu);
+        int n = cpu_position_to_id ((localid + startcpu) % ncpus_usable ());
         if ((cpu = mask_to_available (n)) < 0) 
             return (-1);
-        CPU_SET (cpu, setp);
+        CPU_SET_S (cpu, cpu_setsize, setp);
         return (0);
     }
 
-    cpu = ((localid * cpus_per_task) + startcpu) % ncpus_available;
+    cpu = ((localid * cpus_per_task) + startcpu) % ncpus_usable ();
 
     while (i++ < cpus_per_task) {
         int bit = mask_to_available (cpu_position_to_id (cpu));
         if (bit < 0) 
             return (-1);
-        CPU_SET (bit, setp);
-        cpu = (cpu + 1) % ncpus_available;
+        CPU_SET_S (bit, cpu_setsize, setp);
+        cpu = (cpu + 1) % ncpus_usable ();
     }
 
     return (0);
@@ -792,56 +1288,168 @@ static int generate_mask_reverse (cpu_set_t *setp, int localid)
     int i = 0;
     int cpu;
     int cpus_per_task = get_cpus_per_task ();
-    int lastcpu = ncpus_available - 1;
+    int lastcpu = ncpus_usable () - 1;
 
     if (cpus_per_task == 1) {
-        cpu = (lastcpu - (localid + startcpu) % ncpus_available);
+        cpu = (lastcpu - (localid + startcpu) % ncpus_usable ());
         if ((cpu = mask_to_available (cpu_position_to_id (cpu))) < 0) 
             return (-1);
-        CPU_SET (cpu, setp);
+        CPU_SET_S (cpu, cpu_setsize, setp);
         return (0);
     }
 
-    cpu = lastcpu - (((localid * cpus_per_task) + startcpu) % ncpus_available);
+    cpu = lastcpu -
+        (((localid * cpus_per_task) + startcpu) % ncpus_usable ());
 
     while (i++ < cpus_per_task) {
         int bit = mask_to_available (cpu_position_to_id (cpu));
         if (bit < 0)
             return (-1);
-        CPU_SET (bit, setp);
-        cpu = (--cpu >= 0) ? cpu : (ncpus_available - 1);
+        CPU_SET_S (bit, cpu_setsize, setp);
+        cpu = (--cpu >= 0) ? cpu : (ncpus_usable () - 1);
     }
 
     return (0);
 }
 
+/*
+ *  Return 1 if [ntasks] tasks of [cpus_per_task] CPUs each can be
+ *   distributed round-robin across L3 domains without any task
+ *   straddling a domain, using only usable CPU positions.
+ */
+static int l3_layout_fits (int cpus_per_task)
+{
+    int i;
+    int per_domain;
+
+    if (nl3_domains <= 1)
+        return (0);
+
+    per_domain = ((ntasks + nl3_domains - 1) / nl3_domains) * cpus_per_task;
+
+    for (i = 0; i < nl3_domains; i++) {
+        if (l3_domain_size [i] < per_domain)
+            return (0);
+        if (l3_domain_start [i] + l3_domain_size [i] > ncpus_usable ())
+            return (0);
+    }
+    return (1);
+}
+
+/*
+ *  Place task [localid] within L3 domain (localid % nl3_domains),
+ *   filling each domain with consecutive blocks of cpus_per_task.
+ */
+static int generate_mask_l3 (cpu_set_t *setp, int localid)
+{
+    int i;
+    int cpus_per_task = get_cpus_per_task ();
+    int domain = localid % nl3_domains;
+    int pos = l3_domain_start [domain]
+            + (localid / nl3_domains) * cpus_per_task;
+
+    for (i = 0; i < cpus_per_task; i++) {
+        int bit = mask_to_available (cpu_position_to_id (pos + i));
+        if (bit < 0)
+            return (-1);
+        CPU_SET_S (bit, cpu_setsize, setp);
+    }
+
+    return (0);
+}
+
+/*
+ *  Rebuild the table of available CPU ids from the mask [setp], so
+ *   that mask_to_available() is a constant time lookup.
+ *
+ *  With smt=off the position map already skips sibling threads when
+ *   all CPUs are available. Otherwise positions are mapped by index
+ *   onto the available CPUs, so drop all but the first available
+ *   thread of each core here instead.
+ *
+ *  Returns the number of usable available CPUs.
+ */
+static int available_cpu_map_update (cpu_set_t *setp)
+{
+    int i;
+    int n = 0;
+    cpu_set_t *cores = NULL;
+
+    if (!available_cpu_map
+        && !(available_cpu_map = malloc (ncpus * sizeof (int)))) {
+        slurm_error ("auto-affinity: Out of memory");
+        return (-1);
+    }
+
+    if (cpu_core_leader && (cpu_set_count (setp) < ncpus)
+        && !(cores = cpu_set_create ()))
+        return (-1);
+
+    for (i = 0; i < ncpus; i++) {
+        if (!CPU_ISSET_S (i, cpu_setsize, setp))
+            continue;
+        if (cores) {
+            if (CPU_ISSET_S (cpu_core_leader [i], cpu_setsize, cores))
+                continue;
+            CPU_SET_S (cpu_core_leader [i], cpu_setsize, cores);
+        }
+        available_cpu_map [n++] = i;
+    }
+
+    if (cores)
+        CPU_FREE (cores);
+
+    return (navailable_map = n);
+}
+
 /*
  *  Set the provided cpu set to the actual CPUs available to the
  *   current task (which may be restricted by cpusets or other 
  *   mechanism. 
  * 
- *  Returns the number of cpus set in setp.
+ *  Returns the number of usable cpus in setp (see above).
  *
  */
-static int get_cpus_available (cpu_set_t *setp)
+static int get_cpus_available (void)
 {
-    if (sched_getaffinity (0, sizeof (cpu_set_t), setp) < 0) {
-        slurm_error ("auto-affinity: sched_getaffinity: %m");
+    if (!cpus_available && !(cpus_available = cpu_set_create ()))
         return (-1);
+
+    while (sched_getaffinity (0, cpu_setsize, cpus_available) < 0) {
+        /*
+         *  The kernel mask may be larger than the configured CPU count
+         *   (e.g. hotplug capable nodes). Grow the set size and retry.
+         */
+        if ((errno != EINVAL) || (cpu_set_max >= (1 << 20))) {
+            slurm_error ("auto-affinity: sched_getaffinity: %m");
+            return (-1);
+        }
+        CPU_FREE (cpus_available);
+        cpu_set_max *= 2;
+        cpu_setsize = CPU_ALLOC_SIZE (cpu_set_max);
+        if (!(cpus_available = cpu_set_create ()))
+            return (-1);
     }
 
-    return (cpu_set_count (setp));
+    return (available_cpu_map_update (cpus_available));
 }
 
 int slurm_spank_init_post_opt (spank_t sp, int ac, char **av)
 {
     if (!spank_remote (sp))
         return (0);
+    /*
+     *  Build the CPU position map after user options have been
+     *   processed, since the smt= option changes CPU ordering.
+     */
+    if (create_cpu_position_map (ncpus) < 0)
+        return (-1);
+
     /*
      *  Set available cpus mask after user options have been processed,
      *   in case our cpuset changed.
      */
-    ncpus_available = get_cpus_available (&cpus_available);
+    ncpus_available = get_cpus_available ();
     return (0);
 }
 
@@ -856,7 +1464,7 @@ int check_task_cpus_available (void)
      *   the cpu mask (or we are using per-task cpusets)
      *   and auto-affinity is not warranted.
      */
-     if ((n = get_cpus_available (&cpus_available)) && 
+     if ((n = get_cpus_available ()) && 
          (n != ncpus_available) ) {
          if (ncpus_available > 0) {
              if (verbose)
@@ -878,18 +1486,20 @@ static void generate_mask_from_cpus_list (const char *cpus_list,
         int i;
         int idx = localid * requested_cpus_per_task;
         for (i = 0; i < requested_cpus_per_task; idx++, i++)
-            CPU_SET (cstr_to_cpu_id (cpus_list, idx % nlist_elements), setp);
+            CPU_SET_S (cstr_to_cpu_id (cpus_list, idx % nlist_elements),
+                       cpu_setsize, setp);
     }
     else
-        CPU_SET (cstr_to_cpu_id (cpus_list, localid % nlist_elements), setp);
+        CPU_SET_S (cstr_to_cpu_id (cpus_list, localid % nlist_elements),
+                   cpu_setsize, setp);
 }
 
 
 int slurm_spank_task_init (spank_t sp, int ac, char **av)
 {
     int localid;
-    cpu_set_t setp[1];
-    char buf[4096];
+    int rc = 0;
+    cpu_set_t *setp;
 
     if (!enabled || disabled)
         return (0);
@@ -897,7 +1507,7 @@ int slurm_spank_task_init (spank_t sp, int ac, char **av)
     if (check_task_cpus_available () < 0)
         return (0);
 
-    if (ncpus_available <= 1)
+    if (ncpus_usable () <= 1)
         return (0);
 
     if ((ntasks <= 1) && !requested_cpus_per_task) {
@@ -910,44 +1520,59 @@ int slurm_spank_task_init (spank_t sp, int ac, char **av)
     /*
      * Do nothing if user is overcommitting resources
      */
-    if (ntasks > ncpus_available)
+    if (ntasks > ncpus_usable ())
         return (0);
 
     spank_get_item (sp, S_TASK_ID, &localid);
 
-    if (requested_cpus_per_task > ncpus_available) {
+    if (requested_cpus_per_task > ncpus_usable ()) {
         if (localid == 0)
             slurm_error ("auto-affinity cpus_per_task=%d > ncpus=%d. %s...",
-                    requested_cpus_per_task, ncpus_available, "Ignoring");
+                    requested_cpus_per_task, ncpus_usable (), "Ignoring");
         requested_cpus_per_task = 0;
     }
 
-    CPU_ZERO (setp);
+    if (!(setp = cpu_set_create ()))
+        return (-1);
+
+    if (l3_mode && verbose && (localid == 0)
+        && !cpus_list && !cpu_mask_list
+        && !l3_layout_fits (get_cpus_per_task ()))
+        fprintf (stderr, "auto-affinity: Tasks do not fit evenly in "
+                "%d L3 domains. Using default placement.\n", nl3_domains);
 
     if (cpus_list) {
         generate_mask_from_cpus_list (cpus_list, setp, localid);
         cpu_set_physical_to_logical (setp);
     }
     else if (cpu_mask_list) {
-        *setp = cpu_mask_list[localid % nlist_elements];
+        cpu_set_t *mask = cpu_mask_list[localid % nlist_elements];
+        memcpy (setp, mask, (cpu_mask_setsize < cpu_setsize) ?
+                cpu_mask_setsize : cpu_setsize);
         cpu_set_physical_to_logical (setp);
     }
+    else if (l3_mode && l3_layout_fits (get_cpus_per_task ()))
+        generate_mask_l3 (setp, localid);
     else if (reverse)
         generate_mask_reverse (setp, localid);
     else
         generate_mask (setp, localid);
 
-    if (verbose)
-        fprintf (stderr, "%s: local task %d: CPUs: %s\n", 
-                "auto-affinity", localid, cpuset_to_cstr (setp, buf));
+    if (verbose) {
+        char *str = cpuset_to_cstr (setp);
+        fprintf (stderr, "%s: local task %d: CPUs: %s\n",
+                "auto-affinity", localid, str ? str : "(unknown)");
+        free (str);
+    }
 
-    if (sched_setaffinity (getpid (), sizeof (*setp), setp) < 0) {
+    if (sched_setaffinity (getpid (), cpu_setsize, setp) < 0) {
         slurm_error ("Failed to set auto-affinity for task %d: %s\n",
                 localid, strerror (errno));
-        return (-1);
+        rc = -1;
     }
 
-    return (0);
+    CPU_FREE (setp);
+    return (rc);
 }
 
 /*****************************************************************************
@@ -983,19 +1608,19 @@ static int str_to_cpuset(cpu_set_t *mask, const char* str)
     if (len > 1 && !memcmp(str, "0x", 2L))
         str += 2;
 
-    CPU_ZERO(mask);
+    CPU_ZERO_S(cpu_setsize, mask);
     while (ptr >= str) {
         char val = char_to_val(*ptr);
         if (val == (char) -1)
             return -1;
         if (val & 1)
-            CPU_SET(base, mask);
+            CPU_SET_S(base, cpu_setsize, mask);
         if (val & 2)
-            CPU_SET(base + 1, mask);
+            CPU_SET_S(base + 1, cpu_setsize, mask);
         if (val & 4)
-            CPU_SET(base + 2, mask);
+            CPU_SET_S(base + 2, cpu_setsize, mask);
         if (val & 8)
-            CPU_SET(base + 3, mask);
+            CPU_SET_S(base + 3, cpu_setsize, mask);
         len--;
         ptr--;
         base += 4;
@@ -1104,40 +1729,43 @@ static int cstr_to_cpu_id (const char *str, int n)
 }
 
 
-static char * cpuset_to_cstr (cpu_set_t *mask, char *str)
+/*
+ *  Return the CPUs in [mask] in cpuset(4) list format as a malloc'd
+ *   string, or NULL on failure.
+ */
+static char * cpuset_to_cstr (cpu_set_t *mask)
 {
     int i;
-    char *ptr = str;
-    int entry_made = 0;
+    strbuf_t sb = strbuf_create ();
+
+    if (sb == NULL)
+        return NULL;
 
-    for (i = 0; i < CPU_SETSIZE; i++) {
-        if (CPU_ISSET(i, mask)) {
+    for (i = 0; i < cpu_set_max; i++) {
+        if (CPU_ISSET_S(i, cpu_setsize, mask)) {
             int j;
             int run = 0;
-            entry_made = 1;
-            for (j = i + 1; j < CPU_SETSIZE; j++) {
-                if (CPU_ISSET(j, mask))
+            for (j = i + 1; j < cpu_set_max; j++) {
+                if (CPU_ISSET_S(j, cpu_setsize, mask))
                     run++;
                 else
                     break;
             }
+            if (strbuf_len (sb))
+                strbuf_append (sb, ",");
             if (!run)
-                sprintf(ptr, "%d,", i);
+                strbuf_appendf(sb, "%d", i);
             else if (run == 1) {
-                sprintf(ptr, "%d,%d,", i, i + 1);
+                strbuf_appendf(sb, "%d,%d", i, i + 1);
                 i++;
             } else {
-                sprintf(ptr, "%d-%d,", i, i + run);
+                strbuf_appendf(sb, "%d-%d", i, i + run);
                 i += run;
             }
-            while (*ptr != 0)
-                ptr++;
         }
     }
-    ptr -= entry_made;
-    *ptr = 0;
 
-    return str;
+    return strbuf_steal (sb);
 }
 
 
@@ -0,0 +1,360 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <cpuset.h>
+#include <bitmask.h>
+
+#include "log.h"
+#include "backend.h"
+
+/*
+ *  Legacy cpuset filesystem backend, via libcpuset.
+ */
+
+static int legacy_create (const char *name)
+{
+    char path [4096];
+    int rc = 1;
+    mode_t oldmask;
+
+    snprintf (path, sizeof (path), "/dev/cpuset%s", name);
+
+    oldmask = umask (022);
+    if (mkdir (path, 0755) < 0)
+        rc = (errno == EEXIST) ? 0 : -1;
+    umask (oldmask);
+
+    return (rc);
+}
+
+static int legacy_set (const char *name, const struct bitmask *cpus,
+        const struct bitmask *mems, int notify)
+{
+    struct cpuset *cp;
+    int rc = -1;
+
+    if ((cp = cpuset_alloc ()) == NULL)
+        return (-1);
+
+    if (cpuset_setcpus (cp, cpus) < 0 || cpuset_setmems (cp, mems) < 0)
+        goto out;
+
+    if (notify)
+        cpuset_set_iopt (cp, "notify_on_release", 1);
+
+    rc = cpuset_modify (name, cp);
+out:
+    cpuset_free (cp);
+    return (rc);
+}
+
+static int legacy_getcpus (const char *name, struct bitmask *cpus)
+{
+    struct cpuset *cp;
+    int rc = -1;
+
+    if ((cp = cpuset_alloc ()) == NULL)
+        return (-1);
+    if (cpuset_query (cp, name) == 0)
+        rc = cpuset_getcpus (cp, cpus);
+    cpuset_free (cp);
+    return (rc);
+}
+
+static int legacy_getmems (const char *name, struct bitmask *mems)
+{
+    struct cpuset *cp;
+    int rc = -1;
+
+    if ((cp = cpuset_alloc ()) == NULL)
+        return (-1);
+    if (cpuset_query (cp, name) == 0)
+        rc = cpuset_getmems (cp, mems);
+    cpuset_free (cp);
+    return (rc);
+}
+
+/*
+ *  Write each of [pids] to [file], opened once. Both the legacy tasks
+ *   file and cgroup.procs take a single pid per write(2). Returns the
+ *   number of pids written or -1 if [file] can't be opened.
+ */
+int backend_write_pids (const char *file, const pid_t *pids, int n)
+{
+    char buf [32];
+    int fd;
+    int i;
+    int nmoved = 0;
+
+    if ((fd = open (file, O_WRONLY)) < 0)
+        return (-1);
+
+    for (i = 0; i < n; i++) {
+        int len = snprintf (buf, sizeof (buf), "%d\n", (int) pids[i]);
+        if (write (fd, buf, len) == len)
+            nmoved++;
+        else
+            log_debug ("move %d to %s: %s\n", 
+                    (int) pids[i], file, strerror (errno));
+    }
+    close (fd);
+
+    return (nmoved);
+}
+
+static int legacy_move (const char *name, const pid_t *pids, int n)
+{
+    char path [4096];
+
+    snprintf (path, sizeof (path), "/dev/cpuset%s/tasks", name);
+    return (backend_write_pids (path, pids, n));
+}
+
+static int legacy_pids (const char *name, pid_t **pidsp)
+{
+    struct cpuset_pidlist *pids;
+    int i, n;
+
+    if ((pids = cpuset_init_pidlist (name, 0)) == NULL)
+        return (-1);
+
+    n = cpuset_pidlist_length (pids);
+
+    if (pidsp) {
+        if ((*pidsp = malloc ((n + 1) * sizeof (pid_t))) == NULL) {
+            cpuset_freepidlist (pids);
+            return (-1);
+        }
+        for (i = 0; i < n; i++)
+            (*pidsp)[i] = cpuset_get_pidlist (pids, i);
+    }
+
+    cpuset_freepidlist (pids);
+    return (n);
+}
+
+static int legacy_current (char *name, int len)
+{
+    if (cpuset_getcpusetpath (0, name, len) == NULL)
+        return (-1);
+    return (0);
+}
+
+static int legacy_count (int mems)
+{
+    struct cpuset *cp;
+    int n = -1;
+
+    if ((cp = cpuset_alloc ()) == NULL)
+        return (-1);
+    if (cpuset_query (cp, "/") == 0)
+        n = mems ? cpuset_mems_weight (cp) : cpuset_cpus_weight (cp);
+    cpuset_free (cp);
+    return (n);
+}
+
+const struct cpuset_backend cpuset_legacy_backend = {
+    .name =    "cpuset",
+    .root =    "/dev/cpuset",
+    .create =  legacy_create,
+    .set =     legacy_set,
+    .getcpus = legacy_getcpus,
+    .getmems = legacy_getmems,
+    .move =    legacy_move,
+    .kill =    NULL,
+    .pids =    legacy_pids,
+    .current = legacy_current,
+    .count =   legacy_count,
+};
+
+/*
+ *  Return nonzero if the cgroup v2 hierarchy has a cpuset controller.
+ */
+static int cgroup2_available (void)
+{
+    char buf [1024];
+    char *word, *next;
+    FILE *fp;
+
+    if ((fp = fopen ("/sys/fs/cgroup/cgroup.controllers", "r")) == NULL)
+        return (0);
+    if (fgets (buf, sizeof (buf), fp) == NULL) {
+        fclose (fp);
+        return (0);
+    }
+    fclose (fp);
+
+    for (word = strtok_r (buf, " \n", &next); word;
+         word = strtok_r (NULL, " \n", &next)) {
+        if (strcmp (word, "cpuset") == 0)
+            return (1);
+    }
+    return (0);
+}
+
+static const struct cpuset_backend * backend (void)
+{
+    static const struct cpuset_backend *b = NULL;
+
+    if (b == NULL) {
+        if (access ("/dev/cpuset/cpus", F_OK) < 0
+           && access ("/dev/cpuset/cpuset.cpus", F_OK) < 0
+           && cgroup2_available ())
+            b = &cpuset_cgroup2_backend;
+        else
+            b = &cpuset_legacy_backend;
+        log_debug ("Using %s backend at %s\n", b->name, b->root);
+    }
+    return (b);
+}
+
+const char * backend_name (void)
+{
+    return (backend ()->name);
+}
+
+const char * backend_root (void)
+{
+    return (backend ()->root);
+}
+
+int backend_create (const char *name)
+{
+    return (backend ()->create (name));
+}
+
+int backend_set (const char *name, const struct bitmask *cpus,
+        const struct bitmask *mems, int notify)
+{
+    return (backend ()->set (name, cpus, mems, notify));
+}
+
+int backend_getcpus (const char *name, struct bitmask *cpus)
+{
+    return (backend ()->getcpus (name, cpus));
+}
+
+int backend_getmems (const char *name, struct bitmask *mems)
+{
+    return (backend ()->getmems (name, mems));
+}
+
+int backend_move (pid_t pid, const char *name)
+{
+    if (pid == 0)
+        pid = getpid ();
+    return (backend_move_pids (name, &pid, 1));
+}
+
+static int pid_cmp (const void *x, const void *y)
+{
+    pid_t a = *(const pid_t *) x;
+    pid_t b = *(const pid_t *) y;
+    return ((a > b) - (a < b));
+}
+
+int backend_move_pids (const char *name, const pid_t *pids, int n)
+{
+    pid_t *members;
+    int nmembers;
+    int i;
+    int rc = 0;
+
+    if (n <= 0)
+        return (0);
+
+    if (backend ()->move (name, pids, n) < 0)
+        return (-1);
+
+    /*
+     *  Verify with a single read of the task list. Tasks which exited
+     *   in the meantime don't count as failures.
+     */
+    if ((nmembers = backend_pids (name, &members)) < 0)
+        return (-1);
+
+    qsort (members, nmembers, sizeof (pid_t), pid_cmp);
+
+    for (i = 0; i < n; i++) {
+        if (bsearch (&pids[i], members, nmembers, sizeof (pid_t), pid_cmp))
+            continue;
+        if (kill (pids[i], 0) < 0 && errno == ESRCH)
+            continue;
+        log_err ("Failed to move pid %d to %s\n", (int) pids[i], name);
+        rc = -1;
+    }
+
+    free (members);
+
+    if (rc < 0)
+        errno = EPERM;
+    return (rc);
+}
+
+int backend_kill (const char *name)
+{
+    pid_t *pids;
+    int i, n;
+
+    if (backend ()->kill && backend ()->kill (name) == 0)
+        return (0);
+
+    if ((n = backend_pids (name, &pids)) < 0)
+        return (-1);
+
+    for (i = 0; i < n; i++)
+        kill (pids[i], SIGKILL);
+
+    free (pids);
+    return (0);
+}
+
+int backend_pids (const char *name, pid_t **pidsp)
+{
+    return (backend ()->pids (name, pidsp));
+}
+
+int backend_current (char *name, int len)
+{
+    return (backend ()->current (name, len));
+}
+
+int backend_count (int mems)
+{
+    return (backend ()->count (mems));
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
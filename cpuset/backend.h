@@ -0,0 +1,138 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#ifndef _HAVE_CPUSET_BACKEND_H
+#define _HAVE_CPUSET_BACKEND_H
+
+#include <sys/types.h>
+#include <bitmask.h>
+
+/*
+ *  Cpusets are named by their path relative to the backend root,
+ *   e.g. "/slurm/UID/JOBID", and "/" is the root cpuset. Two backends
+ *   are supported: the legacy cpuset filesystem at /dev/cpuset via
+ *   libcpuset, and the cpuset controller of a unified cgroup v2
+ *   hierarchy at /sys/fs/cgroup. The legacy backend is used if the
+ *   cpuset filesystem is mounted, otherwise cgroup v2 if its cpuset
+ *   controller is available.
+ */
+struct cpuset_backend {
+    const char *name;
+    const char *root;
+
+    int (*create)  (const char *name);
+    int (*set)     (const char *name, const struct bitmask *cpus,
+                    const struct bitmask *mems, int notify);
+    int (*getcpus) (const char *name, struct bitmask *cpus);
+    int (*getmems) (const char *name, struct bitmask *mems);
+    int (*move)    (const char *name, const pid_t *pids, int n);
+    int (*kill)    (const char *name);
+    int (*pids)    (const char *name, pid_t **pidsp);
+    int (*current) (char *name, int len);
+    int (*count)   (int mems);
+};
+
+extern const struct cpuset_backend cpuset_legacy_backend;
+extern const struct cpuset_backend cpuset_cgroup2_backend;
+
+/*
+ *  Write each of [pids] to tasks file [file]. For use by backends.
+ */
+int backend_write_pids (const char *file, const pid_t *pids, int n);
+
+const char * backend_name (void);
+/*
+ *  Return the name of the active backend, "cpuset" or "cgroup2".
+ */
+
+const char * backend_root (void);
+/*
+ *  Return the directory under which cpuset names are found.
+ */
+
+int backend_create (const char *name);
+/*
+ *  Create an empty cpuset [name]. Returns 1 if it was created, 0 if it
+ *   already existed, or -1 on failure.
+ */
+
+int backend_set (const char *name, const struct bitmask *cpus,
+        const struct bitmask *mems, int notify);
+/*
+ *  Set the CPUs and memory nodes of cpuset [name]. If [notify] is
+ *   nonzero, ask for a release notification when [name] empties.
+ *   (cgroup v2 always reports this through cgroup.events.)
+ */
+
+int backend_getcpus (const char *name, struct bitmask *cpus);
+int backend_getmems (const char *name, struct bitmask *mems);
+/*
+ *  Get the effective CPUs or memory nodes of cpuset [name]. A cgroup v2
+ *   cpuset whose CPUs were never set reports no CPUs, rather than the
+ *   CPUs it inherits from its parent.
+ */
+
+int backend_move (pid_t pid, const char *name);
+/*
+ *  Move process [pid] (0 for the calling process) into cpuset [name].
+ */
+
+int backend_move_pids (const char *name, const pid_t *pids, int n);
+/*
+ *  Move the [n] processes in [pids] into cpuset [name] in one pass,
+ *   then verify that every one of them that still exists is in
+ *   [name]. Returns 0 on success, -1 with errno set if any were not
+ *   moved.
+ */
+
+int backend_kill (const char *name);
+/*
+ *  Kill all tasks in cpuset [name] with SIGKILL, with a single write
+ *   to cgroup.kill where available. Returns 0 on success.
+ */
+
+int backend_pids (const char *name, pid_t **pidsp);
+/*
+ *  Return the number of tasks directly in cpuset [name], and if
+ *   [pidsp] is non-NULL a malloc'd array of their ids. Returns -1
+ *   on failure.
+ */
+
+int backend_current (char *name, int len);
+/*
+ *  Copy the name of the calling process's cpuset into [name].
+ *   A cgroup v2 process outside /slurm is reported as being in "/".
+ */
+
+int backend_count (int mems);
+/*
+ *  Return the number of CPUs (or memory nodes if [mems] is nonzero)
+ *   in the root cpuset.
+ */
+
+#endif
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
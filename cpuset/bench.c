@@ -0,0 +1,158 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+/*
+ *  Benchmark nodemap allocation policies on a simulated system.
+ *
+ *  Usage: bench NNODES CPUS_PER_NODE [NALLOCS [OPTIONS [L3 [SMT]]]]
+ *
+ *  Repeatedly allocates randomly sized jobs from a simulated node
+ *   with NNODES NUMA nodes of CPUS_PER_NODE CPUs each, starting over
+ *   with an empty node whenever the next job does not fit. OPTIONS
+ *   is a comma separated list of cpuset options, e.g. "worst-fit".
+ *   If L3 is given, the node has L3 domains of L3 CPUs and cores of
+ *   SMT hardware threads (default 1).
+ */
+
+#include <cpuset.h>
+#include <bitmask.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "nodemap.h"
+#include "util.h"
+#include "conf.h"
+#include "log.h"
+
+static int log_stderr (const char *msg) 
+{ 
+    fprintf (stderr, "%s", msg); return 0; 
+}
+
+static double now (void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static int parse_options (cpuset_conf_t conf, const char *s)
+{
+    char *str = strdup (s);
+    char *opt, *next;
+    int rc = 0;
+
+    for (opt = strtok_r (str, ",", &next); opt; 
+         opt = strtok_r (NULL, ",", &next)) {
+        if (cpuset_conf_parse_opt (conf, opt) < 0)
+            rc = -1;
+    }
+    free (str);
+    return (rc);
+}
+
+int main (int ac, char **av)
+{
+    cpuset_conf_t conf;
+    struct bitmask *used, *b;
+    struct nodemap *map;
+    int nnodes, cpus_per_node, ncpus;
+    int nallocs = 10000;
+    int cpus_per_l3 = 0;
+    int threads_per_core = 1;
+    int i, nresets = 0;
+    double t0, elapsed;
+
+    log_add_dest (0, log_stderr);
+
+    if (ac < 3
+       || (nnodes = str2int (av[1])) <= 0
+       || (cpus_per_node = str2int (av[2])) <= 0
+       || (ac > 3 && (nallocs = str2int (av[3])) <= 0)
+       || (ac > 5 && (cpus_per_l3 = str2int (av[5])) <= 0)
+       || (ac > 6 && (threads_per_core = str2int (av[6])) <= 0)) {
+        fprintf (stderr, "Usage: %s NNODES CPUS_PER_NODE "
+                "[NALLOCS [OPTIONS [L3 [SMT]]]]\n", av[0]);
+        exit (1);
+    }
+
+    conf = cpuset_conf_create ();
+
+    if (ac > 4 && parse_options (conf, av[4]) < 0)
+        exit (1);
+
+    ncpus = nnodes * cpus_per_node;
+    used = bitmask_alloc (ncpus);
+
+    srand (1);
+
+    t0 = now ();
+    for (i = 0; i < nallocs; i++) {
+        int n = 1 + rand () % (2 * cpus_per_node);
+
+        if (ncpus - bitmask_weight (used) < n) {
+            bitmask_clearall (used);
+            nresets++;
+        }
+
+        if (!(map = nodemap_create_simulated (conf, nnodes, cpus_per_node,
+                                              used))) {
+            fprintf (stderr, "Failed to create simulated nodemap\n");
+            exit (1);
+        }
+
+        if (cpus_per_l3 
+           && nodemap_simulate_topology (map, cpus_per_l3, 
+                                         threads_per_core) < 0) {
+            fprintf (stderr, "Failed to create simulated topology\n");
+            exit (1);
+        }
+
+        if (!(b = nodemap_allocate (map, n))) {
+            fprintf (stderr, "Failed to allocate %d CPUs\n", n);
+            exit (1);
+        }
+
+        bitmask_or (used, used, b);
+        bitmask_free (b);
+        nodemap_destroy (map);
+    }
+    elapsed = now () - t0;
+
+    fprintf (stdout, "%d nodes x %d CPUs: %d allocations (%d resets) "
+             "in %.3fs, %.2f us/allocation\n", 
+             nnodes, cpus_per_node, nallocs, nresets, 
+             elapsed, elapsed * 1e6 / nallocs);
+
+    bitmask_free (used);
+    cpuset_conf_destroy (conf);
+
+    exit (0);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
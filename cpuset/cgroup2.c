@@ -0,0 +1,386 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+/*
+ *  cgroup v2 cpuset backend.
+ *
+ *  Cpusets are cgroups under /sys/fs/cgroup with the cpuset controller
+ *   enabled. Everything below /slurm is made a threaded cgroup, since
+ *   user cpusets hold login processes as well as job cpusets, which
+ *   the no-internal-process rule of domain cgroups would not allow.
+ *   cpuset is a threaded controller, so this costs nothing here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <bitmask.h>
+
+#include "log.h"
+#include "backend.h"
+
+static const char cgroup_root[] = "/sys/fs/cgroup";
+
+/*
+ *  Copy the path of [file] in cgroup [name] (or of the cgroup itself
+ *   if [file] is NULL) into [buf].
+ */
+static int cgroup_path (const char *name, const char *file, 
+        char *buf, int len)
+{
+    int n;
+
+    if (strcmp (name, "/") == 0)
+        name = "";
+
+    if (file)
+        n = snprintf (buf, len, "%s%s/%s", cgroup_root, name, file);
+    else
+        n = snprintf (buf, len, "%s%s", cgroup_root, name);
+
+    if ((n < 0) || (n >= len)) {
+        errno = ENAMETOOLONG;
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ *  Read the first [len] - 1 bytes of [file] in cgroup [name] into
+ *   [buf], without any trailing newline.
+ */
+static int cgroup_read (const char *name, const char *file, 
+        char *buf, int len)
+{
+    char path [4096];
+    int fd;
+    int n;
+
+    if (cgroup_path (name, file, path, sizeof (path)) < 0)
+        return (-1);
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return (-1);
+    n = read (fd, buf, len - 1);
+    close (fd);
+
+    if (n < 0)
+        return (-1);
+
+    buf [n] = '\0';
+    buf [strcspn (buf, "\n")] = '\0';
+    return (0);
+}
+
+static int cgroup_write (const char *name, const char *file, const char *val)
+{
+    char path [4096];
+    int fd;
+    int n;
+
+    if (cgroup_path (name, file, path, sizeof (path)) < 0)
+        return (-1);
+
+    if ((fd = open (path, O_WRONLY)) < 0)
+        return (-1);
+
+    n = write (fd, val, strlen (val));
+    if (close (fd) < 0 || n < 0)
+        return (-1);
+    return (0);
+}
+
+static int cgroup2_create (const char *name)
+{
+    char path [4096];
+    char parent [4096];
+    char *p;
+    mode_t oldmask;
+    int rc = 1;
+
+    if (strlen (name) >= sizeof (parent) || !(p = strrchr (name, '/'))) {
+        errno = EINVAL;
+        return (-1);
+    }
+    strcpy (parent, name);
+    if (p == name)
+        strcpy (parent, "/");
+    else
+        parent [p - name] = '\0';
+
+    /*
+     *  Make sure the cpuset controller is enabled for children of the
+     *   parent. This is a no-op if it already is.
+     */
+    if (cgroup_write (parent, "cgroup.subtree_control", "+cpuset") < 0)
+        log_debug ("%s: enable cpuset controller: %s\n", 
+                parent, strerror (errno));
+
+    if (cgroup_path (name, NULL, path, sizeof (path)) < 0)
+        return (-1);
+
+    oldmask = umask (022);
+    if (mkdir (path, 0755) < 0)
+        rc = (errno == EEXIST) ? 0 : -1;
+    umask (oldmask);
+
+    /*
+     *  /slurm itself stays a domain cgroup and becomes the threaded
+     *   domain root once its first child is made threaded.
+     */
+    if ((rc == 1) && (strcmp (parent, "/") != 0)
+       && (cgroup_write (name, "cgroup.type", "threaded") < 0)) {
+        log_err ("%s: failed to make threaded cgroup: %s\n", 
+                name, strerror (errno));
+        rmdir (path);
+        return (-1);
+    }
+
+    return (rc);
+}
+
+static int cgroup2_set (const char *name, const struct bitmask *cpus,
+        const struct bitmask *mems, int notify)
+{
+    char buf [8192];
+    int n;
+
+    /*
+     *  cgroup v2 has no notify_on_release. Release is reported to the
+     *   background cleaner through cgroup.events instead.
+     */
+    n = bitmask_displaylist (buf, sizeof (buf) - 1, cpus);
+    strcpy (buf + strlen (buf), "\n");
+    if (n < 0 || cgroup_write (name, "cpuset.cpus", buf) < 0)
+        return (-1);
+
+    n = bitmask_displaylist (buf, sizeof (buf) - 1, mems);
+    strcpy (buf + strlen (buf), "\n");
+    if (n < 0 || cgroup_write (name, "cpuset.mems", buf) < 0)
+        return (-1);
+
+    return (0);
+}
+
+/*
+ *  Get the effective value of cpuset file [file] of [name] into [b].
+ */
+static int cgroup2_get (const char *name, const char *file, 
+        struct bitmask *b)
+{
+    char buf [8192];
+    char eff [64];
+
+    /*
+     *  An empty cpuset.cpus or cpuset.mems means the parent's CPUs or
+     *   memory nodes are inherited. Report that as empty, so that a
+     *   cgroup which has not been set up yet isn't counted as using
+     *   all of its parent's CPUs. The root has no such file.
+     */
+    if (strcmp (name, "/") != 0) {
+        if (cgroup_read (name, file, buf, sizeof (buf)) < 0)
+            return (-1);
+        if (buf [0] == '\0') {
+            bitmask_clearall (b);
+            return (0);
+        }
+    }
+
+    snprintf (eff, sizeof (eff), "%s.effective", file);
+    if (cgroup_read (name, eff, buf, sizeof (buf)) < 0)
+        return (-1);
+
+    return (bitmask_parselist (buf, b));
+}
+
+static int cgroup2_getcpus (const char *name, struct bitmask *cpus)
+{
+    return (cgroup2_get (name, "cpuset.cpus", cpus));
+}
+
+static int cgroup2_getmems (const char *name, struct bitmask *mems)
+{
+    return (cgroup2_get (name, "cpuset.mems", mems));
+}
+
+/*
+ *  Writing a pid to cgroup.procs moves the whole thread group.
+ */
+static int cgroup2_move (const char *name, const pid_t *pids, int n)
+{
+    char path [4096];
+
+    if (cgroup_path (name, "cgroup.procs", path, sizeof (path)) < 0)
+        return (-1);
+    return (backend_write_pids (path, pids, n));
+}
+
+/*
+ *  cgroup.kill (Linux 5.14 and later) kills every task in the cgroup
+ *   and its descendants with a single write.
+ */
+static int cgroup2_kill (const char *name)
+{
+    return (cgroup_write (name, "cgroup.kill", "1"));
+}
+
+/*
+ *  cgroup.procs can't be read in a threaded cgroup, so list the
+ *   threads instead. Any thread id is a valid target for kill(2).
+ */
+static int cgroup2_pids (const char *name, pid_t **pidsp)
+{
+    char path [4096];
+    pid_t *pids = NULL;
+    int n = 0;
+    int size = 0;
+    int id;
+    FILE *fp;
+
+    if (cgroup_path (name, "cgroup.threads", path, sizeof (path)) < 0)
+        return (-1);
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return (-1);
+
+    while (fscanf (fp, "%d", &id) == 1) {
+        if (pidsp && n == size) {
+            pid_t *p;
+            size = size ? size * 2 : 16;
+            if (!(p = realloc (pids, size * sizeof (pid_t)))) {
+                free (pids);
+                fclose (fp);
+                return (-1);
+            }
+            pids = p;
+        }
+        if (pidsp)
+            pids [n] = id;
+        n++;
+    }
+    fclose (fp);
+
+    if (pidsp)
+        *pidsp = pids;
+    return (n);
+}
+
+static int cgroup2_current (char *name, int len)
+{
+    char buf [4096];
+    char *p = NULL;
+    FILE *fp;
+
+    if ((fp = fopen ("/proc/self/cgroup", "r")) == NULL)
+        return (-1);
+
+    while (fgets (buf, sizeof (buf), fp)) {
+        if (strncmp (buf, "0::", 3) == 0) {
+            p = buf + 3;
+            p [strcspn (p, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose (fp);
+
+    if (p == NULL) {
+        errno = ENOENT;
+        return (-1);
+    }
+
+    /*
+     *  Under cgroup v2 every process is in some cgroup, e.g. slurmd in
+     *   its systemd service. Only cgroups under /slurm are ours, so
+     *   report anything else as the root, as the legacy cpuset
+     *   filesystem would.
+     */
+    if (strncmp (p, "/slurm", 6) != 0 || (p[6] != '\0' && p[6] != '/'))
+        p = "/";
+
+    if (strlen (p) >= len) {
+        errno = ENAMETOOLONG;
+        return (-1);
+    }
+    strcpy (name, p);
+    return (0);
+}
+
+/*
+ *  Return the number of ids in cpu list [s], e.g. "0-3,8" is 5.
+ */
+static int cpulist_weight (const char *s)
+{
+    int n = 0;
+
+    while (*s) {
+        char *p;
+        long lo, hi;
+
+        lo = hi = strtol (s, &p, 10);
+        if (p == s)
+            return (-1);
+        if (*p == '-')
+            hi = strtol (p + 1, &p, 10);
+        n += hi - lo + 1;
+        if (*p == ',')
+            p++;
+        s = p;
+    }
+    return (n);
+}
+
+static int cgroup2_count (int mems)
+{
+    char buf [8192];
+    const char *file = mems ? "cpuset.mems.effective" 
+                            : "cpuset.cpus.effective";
+
+    if (cgroup_read ("/", file, buf, sizeof (buf)) < 0)
+        return (-1);
+    return (cpulist_weight (buf));
+}
+
+const struct cpuset_backend cpuset_cgroup2_backend = {
+    .name =    "cgroup2",
+    .root =    cgroup_root,
+    .create =  cgroup2_create,
+    .set =     cgroup2_set,
+    .getcpus = cgroup2_getcpus,
+    .getmems = cgroup2_getmems,
+    .move =    cgroup2_move,
+    .kill =    cgroup2_kill,
+    .pids =    cgroup2_pids,
+    .current = cgroup2_current,
+    .count =   cgroup2_count,
+};
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
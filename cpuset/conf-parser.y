@@ -47,6 +47,7 @@ static int cf_use_idle (const char *);
 static int cf_order (const char *);
 static int cf_const_mem (int);
 static int cf_kill_orphs (int);
+static int cf_job_cache_ttl (const char *);
 
 %}
 
@@ -55,6 +56,7 @@ static int cf_kill_orphs (int);
 %token CONST_MEM    "constrain-mem"
 %token KILL_ORPHS   "kill-orphs"
 %token ORDER        "order"
+%token JOB_CACHE_TTL "job-cache-ttl"
 %token TRUE         "true"
 %token FALSE        "false"
 %token STRING       "string"
@@ -81,6 +83,9 @@ stmt    : POLICY '=' STRING      { if (cf_policy ($3) < 0)       YYABORT; }
         | KILL_ORPHS '=' TRUE    { if (cf_kill_orphs (1) < 0)    YYABORT; }
         | KILL_ORPHS '=' FALSE   { if (cf_kill_orphs (0) < 0)    YYABORT; }
         | ORDER '=' STRING       { if (cf_order ($3) < 0)        YYABORT; }
+        | JOB_CACHE_TTL '=' STRING { if (cf_job_cache_ttl ($3) < 0) YYABORT; }
+        | JOB_CACHE_TTL '=' FALSE  { if (cf_job_cache_ttl ("0") < 0) YYABORT; }
+        | JOB_CACHE_TTL '=' TRUE   { if (cf_job_cache_ttl ("1") < 0) YYABORT; }
 
 end     : '\n'                   { cpuset_conf_line++; }
         | ';'
@@ -193,6 +198,16 @@ static int cf_kill_orphs (int val)
     return (cpuset_conf_set_kill_orphans (conf, val));
 }
 
+static int cf_job_cache_ttl (const char *s)
+{
+    log_debug ("%s: %d: Setting job-cache-ttl to %s.\n", 
+            cf_file (), cf_line(), s);
+    if (cpuset_conf_set_job_cache_ttl_string (conf, s) < 0)
+        return log_err ("%s: %d: Invalid job-cache-ttl '%s'\n",
+                cf_file (), cf_line (), s);
+    return (0);
+}
+
 /*
  * vi: ts=4 sw=4 expandtab
  */
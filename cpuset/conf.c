@@ -38,6 +38,7 @@ struct cpuset_conf {
     char            filename [1024];
 
     enum fit_policy policy;                 
+    int             job_cache_ttl;
 
     unsigned        filename_valid:1;
     unsigned        reverse_order:1;
@@ -86,6 +87,11 @@ int cpuset_conf_reverse_order (cpuset_conf_t conf)
     return (conf->reverse_order);
 }
 
+int cpuset_conf_job_cache_ttl (cpuset_conf_t conf)
+{
+    return (conf->job_cache_ttl);
+}
+
 int cpuset_conf_set_policy (cpuset_conf_t conf, enum fit_policy policy)
 {
     if (!conf)
@@ -102,6 +108,10 @@ int cpuset_conf_set_policy_string (cpuset_conf_t conf, const char *name)
         return (cpuset_conf_set_policy (conf, WORST_FIT));
     else if (strcmp (name, "first-fit") == 0) 
         return (cpuset_conf_set_policy (conf, FIRST_FIT));
+    else if (strcmp (name, "best-fit-l3") == 0)
+        return (cpuset_conf_set_policy (conf, BEST_FIT_L3));
+    else if (strcmp (name, "core-pack") == 0)
+        return (cpuset_conf_set_policy (conf, CORE_PACK));
     else
         return (-1);
 }
@@ -191,6 +201,9 @@ int cpuset_conf_parse_opt (cpuset_conf_t conf, const char *opt)
     if ((strcmp ("order=normal", opt) == 0))
         return (cpuset_conf_set_order (conf, 0));
 
+    if (strncmp ("job-cache-ttl=", opt, 14) == 0)
+        return (cpuset_conf_set_job_cache_ttl_string (conf, opt + 14));
+
     return (log_err ("Unknown option \"%s\"\n", opt));
 }
 
@@ -218,6 +231,25 @@ int cpuset_conf_set_order (cpuset_conf_t conf, int reverse)
     return (0);
 }
 
+int cpuset_conf_set_job_cache_ttl (cpuset_conf_t conf, int ttl)
+{
+    if (!conf || ttl < 0)
+        return (-1);
+    conf->job_cache_ttl = ttl;
+    return (0);
+}
+
+int cpuset_conf_set_job_cache_ttl_string (cpuset_conf_t conf, const char *s)
+{
+    char *p;
+    long ttl = strtol (s, &p, 10);
+
+    if (*s == '\0' || *p != '\0' || ttl < 0) 
+        return (log_err ("Invalid job-cache-ttl \"%s\"\n", s));
+
+    return (cpuset_conf_set_job_cache_ttl (conf, ttl));
+}
+
 
 /*
  *  Create and Destroy:
@@ -241,6 +273,7 @@ cpuset_conf_t cpuset_conf_create ()
     conf->use_idle_if_multiple = 1;
     conf->constrain_mems =       1;
     conf->kill_orphans =         0;
+    conf->job_cache_ttl =        10;
 
     return (conf);
 }
@@ -35,6 +35,8 @@ enum fit_policy {
     BEST_FIT,
     FIRST_FIT,
     WORST_FIT,
+    BEST_FIT_L3,        /* Pack into fewest L3 domains, cores first  */
+    CORE_PACK,          /* Best fit, cores before hyperthreads       */
 };
 
 
@@ -55,6 +57,8 @@ int cpuset_conf_kill_orphans (cpuset_conf_t conf);
 
 int cpuset_conf_reverse_order (cpuset_conf_t conf);
 
+int cpuset_conf_job_cache_ttl (cpuset_conf_t conf);
+
 int cpuset_conf_set_policy (cpuset_conf_t conf, enum fit_policy policy);
 
 int cpuset_conf_set_alloc_idle (cpuset_conf_t conf, int alloc_idle);
@@ -70,6 +74,10 @@ int cpuset_conf_set_policy_string (cpuset_conf_t conf, const char *name);
 int cpuset_conf_set_constrain_mem (cpuset_conf_t conf, int constrain_mem);
 
 int cpuset_conf_set_order (cpuset_conf_t conf, int reverse);
+
+int cpuset_conf_set_job_cache_ttl (cpuset_conf_t conf, int ttl);
+
+int cpuset_conf_set_job_cache_ttl_string (cpuset_conf_t conf, const char *s);
 /*
  *  Create and Destroy:
  */
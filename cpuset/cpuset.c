@@ -43,6 +43,8 @@
 #include "conf.h"
 #include "log.h"
 #include "slurm.h"
+#include "jobcache.h"
+#include "backend.h"
 
 SPANK_PLUGIN (cpuset, 1)
 
@@ -70,6 +72,8 @@ where args... is a comma separated list of one or more of the following\n\
   help                 Display this message.\n\
   debug                Enable verbose debugging messages.\n\
   tasks                Additionally constrain tasks to cpusets.\n\
+  spread               With tasks, place each task on the emptiest NUMA\n\
+                        node and constrain its memory to that node.\n\
 \n\
  Policy options:\n\
   best-fit             Allocate tasks to most full nodes/sockets first.\n\
@@ -102,6 +106,7 @@ static cpuset_conf_t conf = NULL;
 
 //static int step_cpuset_created = 0;  
 static int per_task_cpuset = 0;      /* --use-cpuset=tasks */
+static int per_task_spread = 0;      /* --use-cpuset=spread */
 
 static uint32_t jobid;
 static uint32_t stepid;
@@ -130,16 +135,6 @@ static int parse_options (int ac, char **av)
     return (0);
 }
 
-static int get_nodeid (spank_t sp)
-{
-    int nodeid = -1;
-    if (spank_get_item (sp, S_JOB_NODEID, &nodeid) != ESPANK_SUCCESS) {
-        cpuset_error ("Failed to get my nodeid\n");
-        return (-1);
-    }
-    return (nodeid);
-}
-
 /*
  *  XXX: Since we don't have a good way to determine the number of
  *   CPUs allocated to this job on this node, we have to query
@@ -148,9 +143,8 @@ static int get_nodeid (spank_t sp)
  */
 static int query_ncpus_per_node (spank_t sp, uint32_t jobid)
 {
-    job_info_msg_t * msg;
+    struct job_cache_entry job;
     uint16_t cpus_per_node = 0;
-    int i;
 
     /*
      *  Use the S_JOB_NCPUS spank item if it exists:
@@ -161,32 +155,12 @@ static int query_ncpus_per_node (spank_t sp, uint32_t jobid)
     }
 
     /*
-     * Otherwise, we have to query all jobs and find the right job record.
+     *  Otherwise, look the job up in the node-local job cache, which
+     *   queries the controller only if this job isn't cached yet.
      */
-    /*
-     *  Ensure that libslurm.so has been dlopened with RTLD_GLOBAL passed.
-     */
-    dyn_slurm_open ();
-
-    if (slurm_load_job (&msg, jobid, SHOW_DETAIL) < 0) {
-        cpuset_error ("slurm_load_job: %s\n", slurm_strerror (errno));
-        return (-1);
-    }
-
-    for (i = 0; i < msg->record_count; i++) {
-        job_info_t *j = &msg->job_array[i];
-
-        if (j->job_id == jobid) {
-            int nodeid;
-            job_resources_t *jres = j->job_resrcs;
-            if ((nodeid = get_nodeid (sp)) >= 0)
-                cpus_per_node =
-                    slurm_job_cpus_allocated_on_node_id (jres, nodeid);
-            break;
-        }
-    }
+    if (job_cache_lookup (conf, jobid, &job) > 0)
+        cpus_per_node = job.ncpus;
 
-    slurm_free_job_info_msg (msg);
     if (cpus_per_node == 0)
         cpuset_error ("Failed to get nCPUs for this node: %s\n", slurm_strerror (errno));
     return (cpus_per_node);
@@ -198,7 +172,10 @@ int migrate_job_to_cpuset (uint32_t jobid, uid_t uid, pid_t pid)
     char path[4096];
     int n = 0;
 
-    cpuset_getcpusetpath (0, path, sizeof (path));
+    if (backend_current (path, sizeof (path)) < 0) {
+        cpuset_error ("Failed to get current cpuset: %s\n", strerror (errno));
+        return (-1);
+    }
 
     if (pid)
         cpuset_debug ("Migrate: Moving %d from cpuset %s\n", pid, path);
@@ -227,7 +204,7 @@ int migrate_job_to_cpuset (uint32_t jobid, uid_t uid, pid_t pid)
     else
         cpuset_debug ("Migrate: Moving to cpuset %s\n", path);
 
-    if (cpuset_move (pid, path) < 0) 
+    if (backend_move (pid, path) < 0) 
         return (-1);
     return (0);
 }
@@ -279,7 +256,7 @@ static int migrate_to_user_cpuset  (uid_t uid)
     if (rc < 0 || rc > sizeof (path))
         return (-1);
 
-    if (cpuset_move (0, path) < 0)
+    if (backend_move (0, path) < 0)
         return (-1);
 
     return (0);
@@ -422,6 +399,8 @@ static int set_user_options (int remote)
         }
         else if (strcmp (opt, "tasks") == 0) 
             per_task_cpuset = 1;
+        else if (strcmp (opt, "spread") == 0) 
+            per_task_cpuset = per_task_spread = 1;
         else if (strncmp ("debug=", opt, 6) == 0) 
             user_debug_level = str2int (opt + 6);
         else if (strcmp ("debug", opt) == 0) 
@@ -522,12 +501,55 @@ int slurm_spank_init_post_opt (spank_t sp, int ac, char **av)
     return (rc);
 }
 
+/*
+ *  Move each task in [pids] into the per-task cpuset of the matching
+ *   id in [ids], below the current (job step) cpuset.
+ */
+static int migrate_tasks_to_cpusets (const unsigned int *ids, 
+        const pid_t *pids, int n)
+{
+    char base [4096];
+    char path [4096];
+    int i;
+    int rc = 0;
+
+    if (backend_current (base, sizeof (base)) < 0) {
+        cpuset_error ("Failed to get current cpuset: %s\n", strerror (errno));
+        return (-1);
+    }
+
+    for (i = 0; i < n; i++) {
+        int len = snprintf (path, sizeof (path), "%s/%u", base, ids[i]);
+        if (len < 0 || len >= sizeof (path)) {
+            cpuset_error ("Migrate: cpuset path too long for task %u\n",
+                          ids[i]);
+            rc = -1;
+            continue;
+        }
+        cpuset_debug ("Migrate: Moving %d to cpuset %s\n", pids[i], path);
+        if (backend_move_pids (path, &pids[i], 1) < 0)
+            rc = -1;
+    }
+    return (rc);
+}
+
+/*
+ *  Per-task cpusets are created in one batch when the last local task
+ *   has been forked, under a single lock and nodemap, instead of once
+ *   per task. slurmstepd calls task_post_fork for every task before
+ *   letting any of them exec, so no task runs unconfined.
+ */
+static unsigned int *task_ids = NULL;
+static pid_t *task_pids = NULL;
+static uint32_t ntasks_forked = 0;
+
 int slurm_spank_task_post_fork (spank_t sp, int ac, char **av)
 {
     pid_t task_pid;
     int taskid;
     int lockfd;
     int cpus_per_task;
+    uint32_t ntasks;
     int rc;
 
     if (!per_task_cpuset)
@@ -543,18 +565,48 @@ int slurm_spank_task_post_fork (spank_t sp, int ac, char **av)
         return (-1);
     }
 
+    if (spank_get_item (sp, S_JOB_LOCAL_TASK_COUNT, &ntasks) 
+        != ESPANK_SUCCESS) {
+        cpuset_error ("Failed to get local task count\n");
+        return (-1);
+    }
+
+    if (task_ids == NULL) {
+        task_ids = malloc (ntasks * sizeof (unsigned int));
+        task_pids = malloc (ntasks * sizeof (pid_t));
+        if (!task_ids || !task_pids) {
+            cpuset_error ("Out of memory\n");
+            return (-1);
+        }
+    }
+
+    if (ntasks_forked >= ntasks)
+        return (-1);
+
+    task_ids [ntasks_forked] = taskid;
+    task_pids [ntasks_forked] = task_pid;
+
+    if (++ntasks_forked < ntasks)
+        return (0);
+
     if ((lockfd = slurm_cpuset_lock ()) < 0)
         return (-1);
 
     cpus_per_task = job_ncpus_per_task (sp);
 
-    if ((rc = create_cpuset_for_task (conf, taskid, cpus_per_task)) == 0)
-        rc = migrate_job_to_cpuset (taskid, -1, task_pid);
+    rc = create_cpusets_for_tasks (conf, task_ids, ntasks, cpus_per_task,
+            per_task_spread);
+    if (rc == 0)
+        rc = migrate_tasks_to_cpusets (task_ids, task_pids, ntasks);
 
     slurm_cpuset_unlock (lockfd);
 
-    return (rc);
+    free (task_ids);
+    free (task_pids);
+    task_ids = NULL;
+    task_pids = NULL;
 
+    return (rc);
 }
 
 /*
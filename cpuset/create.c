@@ -23,19 +23,26 @@
  ****************************************************************************/
 
 
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <dirent.h>
 #include <sys/types.h>
-#include <signal.h>
+#include <sys/stat.h>
 
+#include "list.h"
 #include "log.h"
 #include "conf.h"
 #include "create.h"
 #include "util.h"
 #include "nodemap.h"
+#include "backend.h"
+#include "jobcache.h"
 
 /*
- *  Return the /dev/cpuset relative path for job, step, or task [id].
+ *  Return the cpuset name for job, step, or task [id].
  *    Basically if we're in / or /slurm, return "/slurm/<uid>/<jobid>"
  *     otherwise return <current path>/<id>.
  */
@@ -44,7 +51,7 @@ static int job_cpuset_path (uint32_t id, uid_t uid, char *path, int len)
     int n;
     char buf [64];
 
-    if (cpuset_getcpusetpath (0, buf, sizeof (buf)) < 0)
+    if (backend_current (buf, sizeof (buf)) < 0)
         return (-1);
 
     /*
@@ -61,75 +68,86 @@ static int job_cpuset_path (uint32_t id, uid_t uid, char *path, int len)
 }
 
 /*
- *  Return a struct cpuset with cpus set to those in  [alloc] and
- *   memory constrained to local memories if constrain_mems == 1.
+ *  Return the memory nodes for a cpuset with cpus [alloc]: the nodes
+ *   local to [alloc] if [local] is nonzero, otherwise all memory
+ *   nodes of the current cpuset.
  */
-static struct cpuset * 
-do_cpuset_create (cpuset_conf_t cf, const struct bitmask *alloc)
+static struct bitmask * 
+cpuset_mems_create (const struct bitmask *alloc, int local)
 {
-    struct cpuset *cp;
     struct bitmask *mems;
-
-    if ((cp = cpuset_alloc ()) == NULL) {
-        cpuset_error ("Failed to alloc job cpuset: %m");
-        return (NULL);
-    }
-
-    if (cpuset_setcpus (cp, alloc) < 0) {
-        cpuset_error ("Failed to set cpus: %m");
-        goto fail1;
-    }
+    char name [4096];
 
     if ((mems = bitmask_alloc (cpuset_mems_nbits ())) == NULL) {
         cpuset_error ("failed to alloc mems bitmask: %m");
-        goto fail1;
+        return (NULL);
     }
 
-    if (cpuset_conf_constrain_mem (cf)) {
+    if (local) {
         if (cpuset_localmems (alloc, mems) < 0) {
             cpuset_error ("cpuset_localmems failed: %m");
-            goto fail2;
+            goto fail;
         }
     } else {
-        if (cpuset_getmems (NULL, mems) < 0)  {
-            cpuset_error ("cpuset_getmems: %m");
-            goto fail2;
+        if (backend_current (name, sizeof (name)) < 0 
+           || backend_getmems (name, mems) < 0)  {
+            cpuset_error ("Failed to get current cpuset mems: %m");
+            goto fail;
         }
     }
 
-    if (cpuset_setmems (cp, mems) < 0) {
-        cpuset_error ("cpuset_setmems failed: %m");
-        goto fail2;
-    }
-
-    cpuset_set_iopt (cp, "notify_on_release", 1);
-
-    bitmask_free (mems);
-    return (cp);
+    return (mems);
 
-fail2:
+fail:
     bitmask_free (mems);
-fail1:
-    cpuset_free (cp);
     return (NULL);
 }
 
 int job_cpuset_exists (uint32_t jobid, uid_t uid)
 {
+    char name [4096];
     char path [4096];
-    struct cpuset *cp;
-    int rc;
+    struct stat st;
 
-    if (job_cpuset_path (jobid, uid, path, sizeof (path)) < 0) {
+    if (job_cpuset_path (jobid, uid, name, sizeof (name)) < 0) {
         cpuset_error ("Failed to geneerate job cpuset path\n");
         return (0);
     }
 
-    cp = cpuset_alloc ();
-    rc = cpuset_query (cp, path);
-    cpuset_free (cp);
+    snprintf (path, sizeof (path), "%s%s", backend_root (), name);
+
+    return (stat (path, &st) == 0 && S_ISDIR (st.st_mode));
+}
+
+/*
+ *  Create cpuset [path] with cpus in [alloc] and memory nodes chosen
+ *   as by cpuset_mems_create(). The caller updates the ledger.
+ */
+static int job_cpuset_make (const char *path, const struct bitmask *alloc, 
+        int local)
+{
+    int rc = -1;
+    struct bitmask *mems;
+    char fullpath [4096];
+
+    if ((mems = cpuset_mems_create (alloc, local)) == NULL)
+        return (-1);
+
+    snprintf (fullpath, sizeof (fullpath), "%s%s", backend_root (), path);
+
+    if (backend_create (path) < 0)
+        cpuset_error ("create [%s]: %s", path, strerror (errno));
+    else if (backend_set (path, alloc, mems, 1) < 0) {
+        cpuset_error ("set [%s]: %s", path, strerror (errno));
+        rmdir (fullpath);
+    }
+    else {
+        rc = 0;
+        print_cpuset_info (path);
+    }
 
-    return (rc == 0);
+    bitmask_free (mems);
+    return (rc);
 }
 
 /*
@@ -139,32 +157,21 @@ static int
 job_cpuset_create (cpuset_conf_t cf, uint32_t jobid, uid_t uid, 
         const struct bitmask *alloc)
 {
-    int rc;
-    struct cpuset *cp;
     char path [4096];
-    mode_t oldmask;
-
-    if ((cp = do_cpuset_create (cf, alloc)) < 0)
-        return (-1);
+    char fullpath [4096];
 
     if (job_cpuset_path (jobid, uid, path, sizeof (path)) < 0) {
         cpuset_error ("Failed to generate job cpuset path: %s\n", 
                 strerror (errno));
-        goto out;
+        return (-1);
     }
 
-    oldmask = umask (022);
-    if (cpuset_create (path, cp) < 0)
-        cpuset_error ("create [%s]: %s", path, strerror (errno));
-    else
-        rc = 0;
-    umask (oldmask);
-
-    print_cpuset_info (path, cp);
+    if (job_cpuset_make (path, alloc, cpuset_conf_constrain_mem (cf)) < 0)
+        return (-1);
 
-out:
-    cpuset_free (cp);
-    return (rc);
+    snprintf (fullpath, sizeof (fullpath), "%s%s", backend_root (), path);
+    used_cpus_add (fullpath, alloc, 1);
+    return (0);
 }
 
 #if 0
@@ -194,6 +201,9 @@ out:
 }
 #endif
 
+static int do_user_cpuset_update (cpuset_conf_t cf, uid_t uid,
+        const struct bitmask *alloc, int defer);
+
 /*
  * Create a cpuset for [id] user [uid] with ncpus.
  */
@@ -202,21 +212,44 @@ create_cpuset (cpuset_conf_t cf, unsigned int id, uid_t uid, int ncpus)
 {
     struct nodemap *map;
     struct bitmask *alloc;
+    int userfd = -1;
     int rc = -1;
 
     if (!(map = nodemap_create (cf, NULL)))
         return (-1);
 
-    if ((alloc = nodemap_allocate (map, ncpus)) == NULL) 
-        goto out;
+    if ((alloc = nodemap_allocate (map, ncpus)) == NULL) {
+        /*
+         *  With a background cleaner running, CPUs of exited jobs
+         *   may not have been released yet. Clean up synchronously
+         *   and try once more.
+         */
+        if (cpuset_cleaner_notify (NULL) < 0)
+            goto out;
+        cpuset_debug ("Allocation failed, cleaning stale cpusets\n");
+        nodemap_destroy (map);
+        /*
+         *  Jobs that ended within the job cache TTL would still be
+         *   considered running, so refresh the cache first.
+         */
+        job_cache_refresh (cf);
+        slurm_cpuset_clean (cf);
+        if (!(map = nodemap_create (cf, NULL)))
+            goto out;
+        if ((alloc = nodemap_allocate (map, ncpus)) == NULL)
+            goto out;
+    }
 
     /*
      *  Create and/or update user cpuset, under which job cpuset will
-     *   be created.
+     *   be created. Hold the user lock until the job cpuset exists
+     *   so a concurrent cleanup can't shrink the user cpuset first.
      */
     if ((int) uid >= 0) {
+        if ((userfd = user_cpuset_lock (uid)) < 0)
+            goto out;
         cpuset_debug ("Updating user %d cpuset with %d cpus\n", uid, ncpus);
-        if (user_cpuset_update (cf, uid, alloc) < 0) {
+        if (do_user_cpuset_update (cf, uid, alloc, 0) < 0) {
             cpuset_error ("Failed to update user cpuset");
             goto out;
         }
@@ -227,6 +260,8 @@ create_cpuset (cpuset_conf_t cf, unsigned int id, uid_t uid, int ncpus)
 
     rc = 0;
 out:
+    if (userfd >= 0)
+        user_cpuset_unlock (userfd);
     if (map)
         nodemap_destroy (map);
     if (alloc)
@@ -255,11 +290,118 @@ int create_cpuset_for_task (cpuset_conf_t cf, unsigned int taskid, int ncpus)
     return (create_cpuset (cf, taskid, -1, ncpus));
 }
 
+static void tasks_plan_destroy (struct bitmask **plan, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        if (plan[i])
+            bitmask_free (plan[i]);
+    free (plan);
+}
+
+/*
+ *  Compute the CPUs for all [n] tasks from one nodemap, since
+ *   nodemap_allocate() marks the CPUs it hands out as used.
+ */
+static struct bitmask ** 
+tasks_plan_create (cpuset_conf_t cf, int n, int ncpus, int spread)
+{
+    struct nodemap *map;
+    struct bitmask **plan;
+    int i;
+
+    if (!(plan = calloc (n, sizeof (*plan)))) {
+        cpuset_error ("Out of memory\n");
+        return (NULL);
+    }
+
+    if (!(map = nodemap_create (cf, NULL))) {
+        free (plan);
+        return (NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (spread)
+            plan[i] = nodemap_allocate_spread (map, ncpus);
+        else
+            plan[i] = nodemap_allocate (map, ncpus);
+        if (plan[i] == NULL)
+            break;
+    }
+
+    nodemap_destroy (map);
+
+    if (i < n) {
+        log_debug2 ("tasks_plan_create: ntasks=%d ncpus=%d: "
+                "Failed at task %d.\n", n, ncpus, i);
+        tasks_plan_destroy (plan, n);
+        return (NULL);
+    }
+
+    return (plan);
+}
+
+int create_cpusets_for_tasks (cpuset_conf_t cf, const unsigned int *ids,
+        int n, int ncpus, int spread)
+{
+    struct bitmask **plan;
+    struct bitmask *used;
+    char base [4096];
+    char path [4096];
+    int local;
+    int i;
+    int rc = 0;
+
+    if (n <= 0)
+        return (0);
+
+    if (!(plan = tasks_plan_create (cf, n, ncpus, spread)))
+        return (-1);
+
+    if (!(used = bitmask_alloc (bitmask_nbits (plan[0])))) {
+        cpuset_error ("Out of memory\n");
+        tasks_plan_destroy (plan, n);
+        return (-1);
+    }
+
+    /*
+     *  Spread tasks each sit on one NUMA node, so always keep
+     *   their memory local.
+     */
+    local = spread || cpuset_conf_constrain_mem (cf);
+
+    for (i = 0; i < n; i++) {
+        if (job_cpuset_path (ids[i], -1, path, sizeof (path)) < 0) {
+            cpuset_error ("Failed to generate task cpuset path\n");
+            rc = -1;
+            break;
+        }
+        if ((rc = job_cpuset_make (path, plan[i], local)) < 0) {
+            log_debug2 ("create_cpusets_for_tasks: ntasks=%d ncpus=%d: "
+                    "Failed at task %u.\n", n, ncpus, ids[i]);
+            break;
+        }
+        bitmask_or (used, used, plan[i]);
+        snprintf (base, sizeof (base), "%s%s", backend_root (), path);
+    }
+
+    /*
+     *  Account all created task cpusets in one ledger update.
+     */
+    if (i > 0)
+        used_cpus_add (base, used, i);
+
+    bitmask_free (used);
+    tasks_plan_destroy (plan, n);
+    return (rc);
+}
+
 static int user_cpuset_orphan (uid_t uid, const char *path)
 {
     char orphan [1024];
     int n;
-    n = snprintf (orphan, sizeof (orphan), "/dev/cpuset/slurm/orphan:%d", uid);
+    n = snprintf (orphan, sizeof (orphan), "%s/slurm/orphan:%d", 
+            backend_root (), uid);
     if ((n <= 0) || (n > sizeof (orphan)))
         return (-1);
     if (rename (path, orphan) < 0)
@@ -269,19 +411,11 @@ static int user_cpuset_orphan (uid_t uid, const char *path)
 
 static int kill_orphan (const char *name)
 {
-    struct cpuset_pidlist *pids;
-    int i;
-
-    if ((pids = cpuset_init_pidlist (name, 0)) == NULL) {
-        cpuset_error ("cpuset_init_pidlist: %s: %s\n", 
+    if (backend_kill (name) < 0) {
+        cpuset_error ("Failed to kill tasks in %s: %s\n", 
                 name, strerror (errno));
         return (-1);
     }
-
-    for (i = 0; i < cpuset_pidlist_length (pids); i++)
-        kill (cpuset_get_pidlist (pids, i), SIGKILL);
-
-    cpuset_freepidlist (pids);
     return (0);
 }
 
@@ -289,7 +423,8 @@ static int user_cpuset_unorphan (uid_t uid, const char *path)
 {
     char orphan [1024];
     int n;
-    n = snprintf (orphan, sizeof (orphan), "/dev/cpuset/slurm/orphan:%d", uid);
+    n = snprintf (orphan, sizeof (orphan), "%s/slurm/orphan:%d", 
+            backend_root (), uid);
     if ((n <= 0) || (n > sizeof (orphan)))
         return (-1);
     cpuset_debug ("rename (%s, %s)\n", orphan, path);
@@ -300,33 +435,94 @@ static int user_cpuset_unorphan (uid_t uid, const char *path)
 
 /*
  *  If user cpuset does not exist, keep its cpus and mems empty
- *   They'll be filled in later.
+ *   They'll be filled in later. Returns 1 if the cpuset was created,
+ *   0 if it already existed.
  */
-static int user_cpuset_create (const char *path)
+static int user_cpuset_create (const char *name)
 {
-    int rc = 0;
-    mode_t oldmask = umask (022);
+    int rc;
 
-    if ((mkdir (path, 0755)) < 0 && errno != EEXIST) {
-        cpuset_error ("mkdir %s: %m", path);
-        rc = -1;
-    }
-    umask (oldmask);
+    if ((rc = backend_create (name)) < 0)
+        cpuset_error ("create %s: %m", name);
     return (rc);
 }
 
 
-int 
-user_cpuset_update (cpuset_conf_t cf, uid_t uid, const struct bitmask *alloc)
+/*
+ *  User cpuset updates which failed with EBUSY while the global
+ *   slurm cpuset lock was held, to be retried once it is released.
+ */
+struct deferred_update {
+    cpuset_conf_t cf;
+    uid_t         uid;
+};
+
+static List deferred_updates = NULL;
+
+static int user_cpuset_defer (cpuset_conf_t cf, uid_t uid)
+{
+    struct deferred_update *d;
+
+    if (!deferred_updates)
+        deferred_updates = list_create ((ListDelF) free);
+
+    if (!(d = malloc (sizeof (*d))))
+        return (-1);
+    d->cf = cf;
+    d->uid = uid;
+    list_append (deferred_updates, d);
+
+    cpuset_debug ("Deferring update of user %d cpuset\n", uid);
+    return (0);
+}
+
+/*
+ *  Set cpuset [name] to [cpus] and [mems]. This can fail with EBUSY
+ *   (or EAGAIN) while CPUs being removed are still in use.
+ *   If [retry] is nonzero, retry with exponential backoff starting
+ *   at 10ms and capped at 1s per attempt, giving up after about 10s.
+ */
+static int user_cpuset_modify (const char *name, const struct bitmask *cpus,
+        const struct bitmask *mems, int retry)
+{
+    struct timespec ts = { 0, 10000000 };
+    int tries = retry ? 15 : 1;
+    int rc;
+
+    while ((rc = backend_set (name, cpus, mems, 1)) < 0 && --tries > 0) {
+        if (errno != EBUSY && errno != EAGAIN)
+            break;
+        cpuset_debug2 ("modify %s: %m, retry in %ldms\n",
+                name, ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+        nanosleep (&ts, NULL);
+        if (ts.tv_sec == 0 && (ts.tv_nsec *= 2) >= 1000000000) {
+            ts.tv_sec = 1;
+            ts.tv_nsec = 0;
+        }
+    }
+    return (rc);
+}
+
+/*
+ *  Update the user cpuset for [uid] to the CPUs in use by its jobs
+ *   plus [alloc]. The caller must hold the user lock for [uid].
+ *   If [defer] is nonzero, an EBUSY failure is queued for retry
+ *   after the global slurm cpuset lock is released instead of
+ *   being retried here.
+ */
+static int do_user_cpuset_update (cpuset_conf_t cf, uid_t uid,
+        const struct bitmask *alloc, int defer)
 {
     int rc = -1;
     char path [1024];
     const char *name;
     struct bitmask *used;
-    struct cpuset *cp;
+    struct bitmask *prev = NULL;
+    struct bitmask *mems;
     int orphan = 0;
+    int created = 0;
 
-    snprintf (path, sizeof (path), "/dev/cpuset/slurm/%d", uid);
+    snprintf (path, sizeof (path), "%s/slurm/%d", backend_root (), uid);
     name = cpuset_path_to_name (path);
 
     /*
@@ -335,9 +531,20 @@ user_cpuset_update (cpuset_conf_t cf, uid_t uid, const struct bitmask *alloc)
      *   already exist.
      */
     if (!(orphan = user_cpuset_unorphan (uid, path))
-       && (user_cpuset_create (path) < 0))
+       && ((created = user_cpuset_create (name)) < 0))
         return (-1);
 
+    /*
+     *  Remember the current CPUs of an existing user cpuset so we
+     *   know whether the allocation ledger can simply be added to.
+     */
+    if (!orphan && !created && (prev = bitmask_alloc (cpumask_size ()))) {
+        if (backend_getcpus (name, prev) < 0) {
+            bitmask_free (prev);
+            prev = NULL;
+        }
+    }
+
     cpuset_debug ("Updating user cpuset at %s\n", path);
     used = used_cpus_bitmask_path (path, 1);
     if (orphan)
@@ -359,38 +566,81 @@ user_cpuset_update (cpuset_conf_t cf, uid_t uid, const struct bitmask *alloc)
             kill_orphan (name);
         else
             user_cpuset_orphan (uid, path);
-        return (0);
+        used_cpus_invalidate (path);
+        rc = 0;
+        goto out;
     }
 
-    if (!(cp = do_cpuset_create (cf, used))) {
-        bitmask_free (used);
-        return (-1);
+    if (!(mems = cpuset_mems_create (used, cpuset_conf_constrain_mem (cf)))) {
+        rc = -1;
+        goto out;
     }
 
-again:
-    if ((rc = cpuset_modify (name, cp)) < 0) {
-        /*
-         *  cpuset_modify can potentially return EBUSY.
-         */
-        if (errno == EBUSY || errno == EAGAIN) {
-            sleep (1);
-            goto again;
-        }
-        cpuset_error ("Failed to modify %s: %m", name);
+    if ((rc = user_cpuset_modify (name, used, mems, !defer)) < 0) {
+        if (defer && (errno == EBUSY || errno == EAGAIN))
+            rc = user_cpuset_defer (cf, uid);
+        else
+            cpuset_error ("Failed to modify %s: %m", name);
+        used_cpus_invalidate (path);
     }
+    else if (orphan || created || (prev && bitmask_subset (prev, used)))
+        used_cpus_add (path, used, created);
+    else
+        used_cpus_invalidate (path);
 
+    bitmask_free (mems);
+out:
+    if (prev)
+        bitmask_free (prev);
     bitmask_free (used);
-    cpuset_free (cp);
+    return (rc);
+}
+
+int user_cpuset_update (cpuset_conf_t cf, uid_t uid, 
+        const struct bitmask *alloc)
+{
+    int fd;
+    int rc;
+
+    if ((fd = user_cpuset_lock (uid)) < 0)
+        return (-1);
+    rc = do_user_cpuset_update (cf, uid, alloc, alloc == NULL);
+    user_cpuset_unlock (fd);
+
+    return (rc);
+}
+
+int user_cpuset_retry_deferred (void)
+{
+    struct deferred_update *d;
+    int rc = 0;
+
+    if (!deferred_updates)
+        return (0);
+
+    while ((d = list_pop (deferred_updates))) {
+        int fd;
+        cpuset_debug ("Retrying update of user %d cpuset\n", d->uid);
+        if ((fd = user_cpuset_lock (d->uid)) < 0
+            || do_user_cpuset_update (d->cf, d->uid, NULL, 0) < 0)
+            rc = -1;
+        if (fd >= 0)
+            user_cpuset_unlock (fd);
+        free (d);
+    }
+
     return (rc);
 }
 
 int update_user_cpusets (cpuset_conf_t cf)
 {
+    char path [4096];
     DIR *dirp;
     struct dirent *dp;
 
-    if ((dirp = opendir ("/dev/cpuset/slurm")) == NULL) {
-        cpuset_error ("Unable to open /dev/cpuset/slurm: %m");
+    snprintf (path, sizeof (path), "%s/slurm", backend_root ());
+    if ((dirp = opendir (path)) == NULL) {
+        cpuset_error ("Unable to open %s: %m", path);
         return (-1);
     }
 
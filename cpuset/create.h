@@ -43,9 +43,28 @@ int create_cpuset_for_step (cpuset_conf_t cf,
 int create_cpuset_for_task (cpuset_conf_t cf,
 		unsigned int taskid, int ncpus_per_task);
 
+/*
+ *  Create per-task cpusets for the [n] tasks in [ids] in one pass.
+ *   If [spread] is nonzero, place each task on the emptiest NUMA node
+ *   and constrain its memory to that node.
+ */
+int create_cpusets_for_tasks (cpuset_conf_t cf,
+		const unsigned int *ids, int n, int ncpus_per_task, int spread);
+
+/*
+ *  Update user cpuset for [uid] with CPUs in [b], taking the user lock.
+ *   When shrinking (b == NULL), an EBUSY failure is deferred until
+ *   user_cpuset_retry_deferred() is called.
+ */
 int user_cpuset_update (cpuset_conf_t cf, 
 		uid_t uid, const struct bitmask *b);
 
+/*
+ *  Retry deferred user cpuset updates with backoff. Called by 
+ *   slurm_cpuset_unlock() after the global lock is released.
+ */
+int user_cpuset_retry_deferred (void);
+
 int update_user_cpusets ();
 
 #endif 
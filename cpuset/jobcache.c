@@ -0,0 +1,367 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <slurm/slurm.h>
+
+#include "fd.h"
+#include "log.h"
+#include "slurm.h"
+#include "jobcache.h"
+
+static const char job_cache_path[] = "/var/run/slurm-cpuset.jobs";
+
+#define JOB_CACHE_MAGIC   0x4a4f4253    /* "JOBS" */
+#define JOB_CACHE_VERSION 1
+
+/*
+ *  Minimum age in seconds of a snapshot before a lookup miss
+ *   triggers a refresh from the controller.
+ */
+#define JOB_CACHE_MIN_REFRESH 1
+
+struct job_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    int64_t  updated;
+    uint32_t count;
+};
+
+struct job_snapshot {
+    time_t                  updated;
+    int                     count;
+    struct job_cache_entry *jobs;
+};
+
+/*
+ *  Most recent snapshot seen by this process
+ */
+static struct job_snapshot *snapshot = NULL;
+
+static void snapshot_destroy (struct job_snapshot *s)
+{
+    if (s) {
+        free (s->jobs);
+        free (s);
+    }
+}
+
+static struct job_snapshot * snapshot_create (int count)
+{
+    struct job_snapshot *s = malloc (sizeof (*s));
+
+    if (s == NULL)
+        return (NULL);
+    s->updated = 0;
+    s->count = 0;
+    if (!(s->jobs = malloc ((count ? count : 1) * sizeof (*s->jobs)))) {
+        free (s);
+        return (NULL);
+    }
+    return (s);
+}
+
+static int short_hostname (char *buf, int len)
+{
+    char *p;
+
+    if (gethostname (buf, len) < 0)
+        return (-1);
+    if ((p = strchr (buf, '.')))
+        *p = '\0';
+    return (0);
+}
+
+/*
+ *  Query slurmctld for running jobs, of all users if [uid] is -1,
+ *   otherwise of user [uid] only, and keep those with CPUs allocated
+ *   on this node.
+ *
+ *  XXX: There is no controller-side filter for the jobs on a given
+ *   node, so the full job table is still transferred here when
+ *   querying all users. The cache only reduces how often that happens.
+ */
+static struct job_snapshot * snapshot_fetch (uid_t uid)
+{
+    char hostname [256];
+    job_info_msg_t *msg;
+    struct job_snapshot *s;
+    int i;
+
+    if (short_hostname (hostname, sizeof (hostname)) < 0)
+        return (NULL);
+
+    if (dyn_slurm_open () < 0)
+        return (NULL);
+
+    if ((int) uid < 0) {
+        cpuset_debug ("Querying controller for running jobs\n");
+        if (slurm_load_jobs (0, &msg, SHOW_ALL|SHOW_DETAIL) < 0) {
+            cpuset_error ("slurm_load_jobs: %s\n", slurm_strerror (errno));
+            return (NULL);
+        }
+    }
+    else {
+        cpuset_debug ("Querying controller for jobs of uid %d\n", uid);
+        if (slurm_load_job_user (&msg, uid, SHOW_ALL|SHOW_DETAIL) < 0) {
+            cpuset_error ("slurm_load_job_user: %s\n", 
+                    slurm_strerror (errno));
+            return (NULL);
+        }
+    }
+
+    if ((s = snapshot_create (msg->record_count)) == NULL) {
+        slurm_free_job_info_msg (msg);
+        return (NULL);
+    }
+
+    for (i = 0; i < msg->record_count; i++) {
+        job_info_t *j = &msg->job_array[i];
+        int ncpus;
+
+        if (j->job_state != JOB_RUNNING)
+            continue;
+
+        ncpus = slurm_job_cpus_allocated_on_node (j->job_resrcs, hostname);
+        if (ncpus <= 0)
+            continue;
+
+        s->jobs[s->count].jobid = j->job_id;
+        s->jobs[s->count].uid = j->user_id;
+        s->jobs[s->count].ncpus = ncpus;
+        s->count++;
+    }
+
+    slurm_free_job_info_msg (msg);
+
+    s->updated = time (NULL);
+    return (s);
+}
+
+/*
+ *  Write snapshot [s] to the shared file. The file is written in
+ *   full to a temporary file and renamed into place so that readers
+ *   never see a partial snapshot.
+ */
+static int snapshot_write (struct job_snapshot *s)
+{
+    char tmp [1024];
+    struct job_cache_header h;
+    size_t len = s->count * sizeof (*s->jobs);
+    int fd;
+
+    snprintf (tmp, sizeof (tmp), "%s.%d", job_cache_path, (int) getpid ());
+
+    if ((fd = open (tmp, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0644)) < 0) {
+        cpuset_debug ("job cache: open %s: %s\n", tmp, strerror (errno));
+        return (-1);
+    }
+
+    h.magic = JOB_CACHE_MAGIC;
+    h.version = JOB_CACHE_VERSION;
+    h.updated = s->updated;
+    h.count = s->count;
+
+    if (fd_write_n (fd, &h, sizeof (h)) < 0
+        || fd_write_n (fd, s->jobs, len) < 0
+        || close (fd) < 0) {
+        cpuset_error ("job cache: write %s: %s\n", tmp, strerror (errno));
+        unlink (tmp);
+        return (-1);
+    }
+
+    if (rename (tmp, job_cache_path) < 0) {
+        cpuset_error ("job cache: rename %s: %s\n", tmp, strerror (errno));
+        unlink (tmp);
+        return (-1);
+    }
+
+    return (0);
+}
+
+static struct job_snapshot * snapshot_read (void)
+{
+    struct job_cache_header h;
+    struct job_snapshot *s;
+    size_t len;
+    int fd;
+
+    if ((fd = open (job_cache_path, O_RDONLY)) < 0)
+        return (NULL);
+
+    if (fd_read_n (fd, &h, sizeof (h)) != sizeof (h)
+        || h.magic != JOB_CACHE_MAGIC 
+        || h.version != JOB_CACHE_VERSION
+        || !(s = snapshot_create (h.count))) {
+        close (fd);
+        return (NULL);
+    }
+
+    len = h.count * sizeof (*s->jobs);
+    if (fd_read_n (fd, s->jobs, len) != len) {
+        snapshot_destroy (s);
+        close (fd);
+        return (NULL);
+    }
+    close (fd);
+
+    s->updated = h.updated;
+    s->count = h.count;
+    return (s);
+}
+
+static void snapshot_replace (struct job_snapshot *s)
+{
+    if (s != snapshot) {
+        snapshot_destroy (snapshot);
+        snapshot = s;
+    }
+}
+
+/*
+ *  Return a snapshot no older than the configured TTL, from memory,
+ *   the shared file, or the controller, in that order. If [refresh]
+ *   is set, always query the controller.
+ */
+static struct job_snapshot * snapshot_get (cpuset_conf_t cf, int refresh)
+{
+    int ttl = cpuset_conf_job_cache_ttl (cf);
+    time_t now = time (NULL);
+    struct job_snapshot *s;
+
+    if (!refresh && ttl > 0) {
+        if (snapshot && (now - snapshot->updated) < ttl)
+            return (snapshot);
+
+        if ((s = snapshot_read ()) && (now - s->updated) < ttl) {
+            snapshot_replace (s);
+            return (snapshot);
+        }
+        snapshot_destroy (s);
+    }
+
+    if ((s = snapshot_fetch (-1)) == NULL)
+        return (NULL);
+
+    if (ttl > 0)
+        snapshot_write (s);
+
+    snapshot_replace (s);
+    return (snapshot);
+}
+
+static struct job_cache_entry * 
+snapshot_find (struct job_snapshot *s, uint32_t jobid)
+{
+    int i;
+    for (i = 0; i < s->count; i++) {
+        if (s->jobs[i].jobid == jobid)
+            return (&s->jobs[i]);
+    }
+    return (NULL);
+}
+
+int job_cache_lookup (cpuset_conf_t cf, uint32_t jobid,
+        struct job_cache_entry *e)
+{
+    struct job_snapshot *s;
+    struct job_cache_entry *j;
+
+    if (!(s = snapshot_get (cf, 0)))
+        return (-1);
+
+    if (!(j = snapshot_find (s, jobid)) 
+        && (time (NULL) - s->updated) >= JOB_CACHE_MIN_REFRESH) {
+        /*
+         *  Job may have started since the snapshot was taken.
+         */
+        if (!(s = snapshot_get (cf, 1)))
+            return (-1);
+        j = snapshot_find (s, jobid);
+    }
+
+    if (j == NULL)
+        return (0);
+
+    if (e)
+        *e = *j;
+    return (1);
+}
+
+int job_cache_refresh (cpuset_conf_t cf)
+{
+    return (snapshot_get (cf, 1) ? 0 : -1);
+}
+
+int job_cache_user_jobs (cpuset_conf_t cf, uid_t uid,
+        struct job_cache_entry **ep)
+{
+    struct job_snapshot *s;
+    struct job_snapshot *u = NULL;
+    int i, n = 0;
+
+    if (!(s = snapshot_get (cf, 0)))
+        return (-1);
+
+    for (i = 0; i < s->count; i++) {
+        if (s->jobs[i].uid == uid)
+            n++;
+    }
+
+    if (n > 0 || (time (NULL) - s->updated) >= JOB_CACHE_MIN_REFRESH) {
+        /*
+         *  Jobs in the snapshot may have ended, or the user's first
+         *   job may have started, since the snapshot was taken. Ask
+         *   the controller for just this user's jobs.
+         */
+        if (!(u = snapshot_fetch (uid)))
+            return (-1);
+        s = u;
+    }
+
+    if (!(*ep = malloc ((s->count ? s->count : 1) * sizeof (**ep)))) {
+        snapshot_destroy (u);
+        return (-1);
+    }
+
+    for (i = n = 0; i < s->count; i++) {
+        if (s->jobs[i].uid == uid)
+            (*ep)[n++] = s->jobs[i];
+    }
+    snapshot_destroy (u);
+    return (n);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
@@ -0,0 +1,76 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#ifndef _HAVE_CPUSET_JOBCACHE_H
+#define _HAVE_CPUSET_JOBCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "conf.h"
+
+/*
+ *  Node-local snapshot of the jobs running on this node, so that
+ *   cpuset cleanup and PAM logins don't each pull the whole job
+ *   table from slurmctld. The snapshot is shared between processes
+ *   through a file under /var/run and is refreshed from the
+ *   controller once it is older than the configured job-cache-ttl.
+ */
+struct job_cache_entry {
+    uint32_t jobid;
+    uint32_t uid;
+    uint32_t ncpus;     /* CPUs allocated to the job on this node */
+};
+
+int job_cache_lookup (cpuset_conf_t cf, uint32_t jobid,
+        struct job_cache_entry *e);
+/*
+ *  Look up running job [jobid] on this node, copying its record into
+ *   [e] if non-NULL. On a miss, the snapshot is refreshed from the
+ *   controller at most once per second before giving up.
+ *  Returns 1 if found, 0 if not, or -1 if the controller query failed.
+ */
+
+int job_cache_refresh (cpuset_conf_t cf);
+/*
+ *  Refresh the snapshot from the controller now, e.g. before acting
+ *   on a job that may have ended within the cache TTL.
+ *  Returns 0 on success, -1 if the controller query failed.
+ */
+
+int job_cache_user_jobs (cpuset_conf_t cf, uid_t uid,
+        struct job_cache_entry **ep);
+/*
+ *  Set [ep] to a malloc'd array of the running jobs of user [uid] on
+ *   this node, which the caller must free. Jobs found in the snapshot
+ *   are confirmed with the controller (querying only this user's
+ *   jobs) before being returned, so ended jobs are not reported.
+ *  Returns the number of jobs, or -1 if the controller query failed.
+ */
+
+#endif
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
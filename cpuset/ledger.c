@@ -0,0 +1,352 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <bitmask.h>
+
+#include "fd.h"
+#include "log.h"
+#include "util.h"
+#include "ledger.h"
+
+static const char ledger_path[] = "/var/run/slurm-cpuset.ledger";
+
+/*
+ *  Bump LEDGER_VERSION whenever the layout below changes. A ledger
+ *   with the wrong magic, version or size is simply reinitialized.
+ */
+#define LEDGER_MAGIC    0x4c444752  /* "LDGR" */
+#define LEDGER_VERSION  1
+#define LEDGER_ENTRIES  256
+#define LEDGER_PATHLEN  128
+#define LEDGER_MAXCPUS  4096
+#define LEDGER_WORDBITS (8 * sizeof (unsigned long))
+#define LEDGER_WORDS    (LEDGER_MAXCPUS / LEDGER_WORDBITS)
+
+struct ledger_stamp {
+    ino_t   ino;
+    nlink_t nlink;
+    time_t  mtime;
+    long    mtime_nsec;
+};
+
+struct ledger_entry {
+    char                path [LEDGER_PATHLEN];
+    struct ledger_stamp stamp;
+    unsigned long       cpus [LEDGER_WORDS];
+};
+
+struct ledger {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            ncpus;
+    uint32_t            nentries;
+    uint32_t            next;       /* Next slot to recycle when full */
+    struct ledger_entry entries [LEDGER_ENTRIES];
+};
+
+static void ledger_close (struct ledger *l, int fd)
+{
+    if (l)
+        munmap (l, sizeof (*l));
+    /*
+     *  Closing the fd also drops our lock.
+     */
+    if (fd >= 0)
+        close (fd);
+}
+
+/*
+ *  Open, lock, and map the ledger. Returns NULL if the ledger is
+ *   unusable, in which case callers fall back to scanning the cpuset tree.
+ */
+static struct ledger * ledger_open (int *fdp)
+{
+    struct ledger *l;
+    struct stat st;
+    int fd;
+
+    *fdp = -1;
+
+    if (cpumask_size () > LEDGER_MAXCPUS)
+        return (NULL);
+
+    if ((fd = open (ledger_path, O_RDWR|O_CREAT|O_NOFOLLOW, 0600)) < 0) {
+        cpuset_debug ("ledger: open %s: %s\n", ledger_path, strerror (errno));
+        return (NULL);
+    }
+
+    if (fd_get_writew_lock (fd) < 0 || fstat (fd, &st) < 0) {
+        cpuset_error ("ledger: lock %s: %s\n", ledger_path, strerror (errno));
+        close (fd);
+        return (NULL);
+    }
+
+    if (st.st_size != sizeof (*l)) {
+        if (ftruncate (fd, 0) < 0 || ftruncate (fd, sizeof (*l)) < 0) {
+            cpuset_error ("ledger: truncate %s: %s\n", 
+                    ledger_path, strerror (errno));
+            close (fd);
+            return (NULL);
+        }
+    }
+
+    l = mmap (NULL, sizeof (*l), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (l == MAP_FAILED) {
+        cpuset_error ("ledger: mmap %s: %s\n", ledger_path, strerror (errno));
+        close (fd);
+        return (NULL);
+    }
+
+    if (l->magic != LEDGER_MAGIC || l->version != LEDGER_VERSION
+        || l->ncpus != cpumask_size ()) {
+        cpuset_debug ("ledger: initializing %s\n", ledger_path);
+        memset (l, 0, sizeof (*l));
+        l->magic = LEDGER_MAGIC;
+        l->version = LEDGER_VERSION;
+        l->ncpus = cpumask_size ();
+    }
+
+    *fdp = fd;
+    return (l);
+}
+
+static int ledger_stamp_get (const char *path, struct ledger_stamp *s)
+{
+    struct stat st;
+
+    if (stat (path, &st) < 0)
+        return (-1);
+
+    s->ino = st.st_ino;
+    s->nlink = st.st_nlink;
+    s->mtime = st.st_mtim.tv_sec;
+    s->mtime_nsec = st.st_mtim.tv_nsec;
+    return (0);
+}
+
+static int ledger_stamp_equal (const struct ledger_stamp *a, 
+        const struct ledger_stamp *b)
+{
+    return (a->ino == b->ino && a->nlink == b->nlink 
+            && a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec);
+}
+
+/*
+ *  Return true if [s] is what stamp [a] should look like after
+ *   [nlink_delta] children were created and nothing else changed.
+ *   Creating a child always moves the directory mtime forward, so
+ *   in that case mtime may only have advanced, otherwise it must be
+ *   unchanged.
+ */
+static int ledger_stamp_expected (const struct ledger_stamp *a,
+        const struct ledger_stamp *s, int nlink_delta)
+{
+    struct ledger_stamp expect = *a;
+
+    expect.nlink += nlink_delta;
+
+    if (nlink_delta == 0)
+        return (ledger_stamp_equal (&expect, s));
+
+    if (s->mtime < a->mtime
+        || (s->mtime == a->mtime && s->mtime_nsec <= a->mtime_nsec))
+        return (0);
+
+    expect.mtime = s->mtime;
+    expect.mtime_nsec = s->mtime_nsec;
+    return (ledger_stamp_equal (&expect, s));
+}
+
+static struct ledger_entry * ledger_find (struct ledger *l, const char *path)
+{
+    int i;
+    for (i = 0; i < l->nentries; i++) {
+        if (strcmp (l->entries[i].path, path) == 0)
+            return (&l->entries[i]);
+    }
+    return (NULL);
+}
+
+static struct ledger_entry * ledger_entry_alloc (struct ledger *l)
+{
+    int i;
+
+    for (i = 0; i < l->nentries; i++) {
+        if (l->entries[i].path[0] == '\0')
+            return (&l->entries[i]);
+    }
+
+    if (l->nentries < LEDGER_ENTRIES)
+        return (&l->entries[l->nentries++]);
+
+    return (&l->entries[l->next++ % LEDGER_ENTRIES]);
+}
+
+static void ledger_entry_drop (struct ledger_entry *e)
+{
+    memset (e, 0, sizeof (*e));
+}
+
+static void ledger_entry_add_cpus (struct ledger_entry *e, 
+        const struct bitmask *b)
+{
+    unsigned int i;
+    unsigned int n = bitmask_nbits (b);
+
+    for (i = bitmask_first (b); i < n; i = bitmask_next (b, i + 1)) {
+        if (i < LEDGER_MAXCPUS)
+            e->cpus [i / LEDGER_WORDBITS] |= 1UL << (i % LEDGER_WORDBITS);
+    }
+}
+
+static void ledger_entry_get_cpus (const struct ledger_entry *e, 
+        struct bitmask *b)
+{
+    unsigned int i;
+    unsigned int n = bitmask_nbits (b);
+
+    bitmask_clearall (b);
+    for (i = 0; i < n && i < LEDGER_MAXCPUS; i++) {
+        if (e->cpus [i / LEDGER_WORDBITS] & (1UL << (i % LEDGER_WORDBITS)))
+            bitmask_setbit (b, i);
+    }
+}
+
+int cpuset_ledger_lookup (const char *path, struct bitmask *used)
+{
+    struct ledger *l;
+    struct ledger_entry *e;
+    struct ledger_stamp s;
+    int fd;
+    int rc = -1;
+
+    if (!(l = ledger_open (&fd)))
+        return (-1);
+
+    if ((e = ledger_find (l, path)) && ledger_stamp_get (path, &s) == 0) {
+        if (ledger_stamp_equal (&e->stamp, &s)) {
+            ledger_entry_get_cpus (e, used);
+            rc = 0;
+        }
+        else {
+            cpuset_debug ("ledger: %s is stale\n", path);
+            ledger_entry_drop (e);
+        }
+    }
+
+    ledger_close (l, fd);
+    return (rc);
+}
+
+int cpuset_ledger_store (const char *path, const struct bitmask *used)
+{
+    struct ledger *l;
+    struct ledger_entry *e;
+    struct ledger_stamp s;
+    int fd;
+
+    if (strlen (path) >= LEDGER_PATHLEN)
+        return (-1);
+
+    if (ledger_stamp_get (path, &s) < 0)
+        return (-1);
+
+    if (!(l = ledger_open (&fd)))
+        return (-1);
+
+    if ((e = ledger_find (l, path)) == NULL)
+        e = ledger_entry_alloc (l);
+
+    ledger_entry_drop (e);
+    strcpy (e->path, path);
+    e->stamp = s;
+    ledger_entry_add_cpus (e, used);
+
+    ledger_close (l, fd);
+    return (0);
+}
+
+int cpuset_ledger_update (const char *path, const struct bitmask *cpus,
+        int nlink_delta)
+{
+    struct ledger *l;
+    struct ledger_entry *e;
+    struct ledger_stamp s;
+    int fd;
+
+    if (!(l = ledger_open (&fd)))
+        return (-1);
+
+    if ((e = ledger_find (l, path)) == NULL)
+        goto out;
+
+    /*
+     *  Only trust the entry if the directory is the same one we
+     *   recorded and the caller's change accounts for everything
+     *   that changed since. Otherwise someone else has been here,
+     *   and the next lookup will have to rescan.
+     */
+    if (ledger_stamp_get (path, &s) < 0 
+        || !ledger_stamp_expected (&e->stamp, &s, nlink_delta)) {
+        cpuset_debug ("ledger: dropping %s\n", path);
+        ledger_entry_drop (e);
+        goto out;
+    }
+
+    ledger_entry_add_cpus (e, cpus);
+    e->stamp = s;
+out:
+    ledger_close (l, fd);
+    return (0);
+}
+
+void cpuset_ledger_invalidate (const char *path)
+{
+    struct ledger *l;
+    struct ledger_entry *e;
+    int fd;
+
+    if (!(l = ledger_open (&fd)))
+        return;
+
+    if ((e = ledger_find (l, path)))
+        ledger_entry_drop (e);
+
+    ledger_close (l, fd);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
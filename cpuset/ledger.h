@@ -0,0 +1,71 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#ifndef _HAVE_CPUSET_LEDGER_H
+#define _HAVE_CPUSET_LEDGER_H
+
+#include <bitmask.h>
+
+/*
+ *  The allocation ledger is a small mmap'd file under /var/run which
+ *   caches, for each cpuset directory, the union of the CPUs of all
+ *   its child cpusets. Each entry is stamped with the inode, mtime
+ *   and link count of the directory at the time it was recorded, so
+ *   that an entry is only trusted while the directory is unchanged.
+ *   Stale entries are reconciled by rescanning the cpuset tree.
+ *
+ *  All functions lock the ledger file for the duration of the call.
+ */
+
+int cpuset_ledger_lookup (const char *path, struct bitmask *used);
+/*
+ *  Copy the cached child CPUs for cpuset directory [path] into [used].
+ *  Returns 0 on success, -1 if there is no current entry for [path].
+ */
+
+int cpuset_ledger_store (const char *path, const struct bitmask *used);
+/*
+ *  Record [used] as the child CPUs of cpuset directory [path],
+ *   stamped with the current state of the directory.
+ */
+
+int cpuset_ledger_update (const char *path, const struct bitmask *cpus,
+        int nlink_delta);
+/*
+ *  Add [cpus] to the entry for cpuset directory [path] after a child
+ *   was created (nlink_delta = 1) or grown (nlink_delta = 0). The
+ *   entry is dropped instead if the directory changed in any other way
+ *   since it was recorded.
+ */
+
+void cpuset_ledger_invalidate (const char *path);
+/*
+ *  Drop any entry for cpuset directory [path].
+ */
+
+#endif
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
@@ -27,15 +27,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 #include <slurm/spank.h>
 
 #include "log.h"
-#include "list.h"
 #include "util.h"
 #include "conf.h"
 #include "nodemap.h"
+#include "backend.h"
 
 
 /*
@@ -45,8 +46,8 @@ struct node {
     int             nodeid;    /* The NUMA node id                         */
     int             ncpus;     /* Total Number of CPUs                     */
     int             navail;    /* Number of currently available CPUs       */
-    struct bitmask *localcpus; /* Bitmask mapping local CPUs to global     */
-    struct bitmask *usedcpus;  /* Bitmask of used cpus (size = ncpus)      */
+    struct bitmask *localcpus; /* Bitmask of local CPUs (global index)     */
+    struct bitmask *availcpus; /* Bitmask of local CPUs not yet in use     */
     struct nodemap *map;       /* Pointer back to the nodemap              */
 };
 
@@ -61,6 +62,8 @@ struct policy {
     unsigned int best_fit:1;
     unsigned int first_fit:1;
     unsigned int worst_fit:1;
+    unsigned int l3:1;            /* Allocate by L3 domain, not NUMA node */
+    unsigned int core_first:1;    /* Use first thread of each core first  */
     unsigned int alloc_idle_first:1;
     unsigned int alloc_idle_multiples_only:1;
 };
@@ -83,7 +86,13 @@ struct nodemap {
     struct bitmask *usedcpus;  /* Bitmask of used CPUs                      */
     struct bitmask *cpus;      /* Bitmask of available CPUs relative to the 
                                    current cpuset */ 
-    List            nodelist;  /* List of nodes in this map                 */
+    int             nlocal;    /* Number of nodes in this map               */
+    struct node   **nodes;     /* Nodes in this map, in order of node id    */
+
+    int             topology;  /* Nonzero once L3/SMT topology is loaded    */
+    struct bitmask *primary;   /* First hardware thread of each core        */
+    int             nl3;       /* Number of L3 domains (0 if unknown)       */
+    struct node   **l3;        /* L3 cache domains, in order of first CPU   */
 };
 
 /*
@@ -95,13 +104,19 @@ struct allocation {
     struct nodemap * map;      /* pointer back to nodemap                   */
     struct bitmask * allocated_cpus;
                                /* The final bitmask of allocated CPUs       */
+    int              nnodes;   /* Number of nodes in order                  */
+    struct node   ** order;    /* Nodes in allocation order                 */
 };
 
 int nodemap_policy_update (struct nodemap *map, cpuset_conf_t cf)
 {
-    map->policy.best_fit = cpuset_conf_policy (cf) == BEST_FIT;
-    map->policy.worst_fit = cpuset_conf_policy (cf) == WORST_FIT;
-    map->policy.first_fit = cpuset_conf_policy (cf) == FIRST_FIT;
+    enum fit_policy policy = cpuset_conf_policy (cf);
+
+    map->policy.best_fit = policy == BEST_FIT || policy == CORE_PACK;
+    map->policy.worst_fit = policy == WORST_FIT;
+    map->policy.first_fit = policy == FIRST_FIT;
+    map->policy.l3 = policy == BEST_FIT_L3;
+    map->policy.core_first = policy == BEST_FIT_L3 || policy == CORE_PACK;
     map->policy.alloc_idle_first = cpuset_conf_alloc_idle (cf);
     map->policy.alloc_idle_multiples_only = 
         cpuset_conf_alloc_idle_multiple (cf);
@@ -113,22 +128,17 @@ int nodemap_policy_update (struct nodemap *map, cpuset_conf_t cf)
 static struct bitmask *current_cpuset_cpus ()
 {
     struct bitmask *cpus;
-    struct cpuset *cp;
+    char name [4096];
    
-   if ((cp = cpuset_alloc ()) == NULL) {
-       cpuset_error ("Failed to alloc cpuset: %s\n", strerror (errno));
-       return (NULL);
-   }
-
    if ((cpus = bitmask_alloc (cpumask_size ())) == NULL) {
        cpuset_error ("Failed to alloc bitmask: %s\n", strerror (errno));
-       cpuset_free (cp);
        return (NULL);
    }
    
-   cpuset_query (cp, ".");
-   cpuset_getcpus (cp, cpus);
-   cpuset_free (cp);
+   if (backend_current (name, sizeof (name)) < 0
+      || backend_getcpus (name, cpus) < 0)
+       cpuset_error ("Failed to get current cpuset CPUs: %s\n", 
+               strerror (errno));
 
    return (cpus);
 }
@@ -138,10 +148,13 @@ static struct bitmask *used_cpus_bitmask ()
     return (used_cpus_bitmask_path (NULL, 0));
 }
 
-static struct node * node_create (struct nodemap *map, int id)
+/*
+ *  Create node [id] with local CPUs [localcpus]. The node takes
+ *   ownership of the [localcpus] bitmask.
+ */
+static struct node * 
+node_create (struct nodemap *map, int id, struct bitmask *localcpus)
 {
-    int i, offset;
-    struct bitmask *mems;
     struct node *n = malloc (sizeof (*n));
 
     if (n == NULL)
@@ -151,16 +164,7 @@ static struct node * node_create (struct nodemap *map, int id)
     n->map = map;
 
     n->nodeid = id;
-    n->ncpus = 0;
-    n->localcpus = bitmask_alloc (cpumask_size ());
-
-    /*
-     *  Get the bitmask of local cpus for this node
-     */
-    mems = bitmask_alloc (memmask_size ());
-    bitmask_setbit (mems, n->nodeid);
-    cpuset_localcpus (mems, n->localcpus);
-    bitmask_free (mems);
+    n->localcpus = localcpus;
 
     /*
      *  Now count the number of local CPUs
@@ -169,17 +173,17 @@ static struct node * node_create (struct nodemap *map, int id)
 
 
     /*
-     *  Now set used cpus from node map
+     *  Available CPUs are local CPUs not in use in the node map. These
+     *   are kept with the same global indexing as map->usedcpus so
+     *   that allocation can operate on whole words at a time.
      */
-    n->usedcpus = bitmask_alloc (n->ncpus);
-
-    offset = bitmask_first (n->localcpus);
-    for (i = 0; i < n->ncpus; i++) {
-        if (bitmask_isbitset (map->usedcpus, offset + i))
-            bitmask_setbit (n->usedcpus, i);
+    if (!(n->availcpus = bitmask_alloc (bitmask_nbits (n->localcpus)))) {
+        free (n);
+        return (NULL);
     }
+    bitmask_andnot (n->availcpus, n->localcpus, map->usedcpus);
 
-    n->navail = n->ncpus - bitmask_weight (n->usedcpus);
+    n->navail = bitmask_weight (n->availcpus);
 
     cpuset_debug2 ("Done creating node%d with %d/%d CPUs\n",
             n->nodeid, n->navail, n->ncpus);
@@ -187,69 +191,148 @@ static struct node * node_create (struct nodemap *map, int id)
     return (n);
 }
 
+/*
+ *  Create node [id] with its local CPUs as reported by libcpuset.
+ */
+static struct node * node_create_system (struct nodemap *map, int id)
+{
+    struct bitmask *mems;
+    struct bitmask *localcpus;
+    struct node *n;
+
+    if (!(localcpus = bitmask_alloc (map->ncpus)))
+        return (NULL);
+
+    /*
+     *  Get the bitmask of local cpus for this node
+     */
+    mems = bitmask_alloc (memmask_size ());
+    bitmask_setbit (mems, id);
+    cpuset_localcpus (mems, localcpus);
+    bitmask_free (mems);
+
+    if (!(n = node_create (map, id, localcpus)))
+        bitmask_free (localcpus);
+    return (n);
+}
+
 static void node_destroy (struct node *n)
 {
     bitmask_free (n->localcpus);
-    bitmask_free (n->usedcpus);
+    bitmask_free (n->availcpus);
     free (n);
 }
 
 
 void nodemap_destroy (struct nodemap *map)
 {
-    bitmask_free (map->usedcpus);
-    list_destroy (map->nodelist);
+    int i;
+
+    for (i = 0; i < map->nlocal; i++)
+        node_destroy (map->nodes[i]);
+    free (map->nodes);
+    for (i = 0; i < map->nl3; i++)
+        node_destroy (map->l3[i]);
+    free (map->l3);
+    if (map->primary)
+        bitmask_free (map->primary);
+    if (map->usedcpus)
+        bitmask_free (map->usedcpus);
+    if (map->cpus)
+        bitmask_free (map->cpus);
     free (map);
 }
 
-static int node_cpus_available (struct nodemap *map, int i)
+/*
+ *  Allocate an empty nodemap for [nnodes] NUMA nodes and [ncpus]
+ *   CPUs, initialized with a copy of [used] if non-NULL.
+ */
+static struct nodemap * nodemap_alloc (int nnodes, int ncpus,
+        const struct bitmask *used)
 {
-    int rc;
-    struct bitmask * mems = bitmask_alloc (memmask_size ());
+    struct nodemap *map = malloc (sizeof (*map));
 
-    if (mems == NULL)
-        return log_err ("failed to allocate mems mask!!\n");
+    if (map == NULL)
+        return (NULL);
 
-    if (cpuset_localmems (map->cpus, mems) < 0)
-        return log_err ("cpuset_localmems: %s\n", strerror (errno));
+    map->policy = default_policy;
 
-    rc = bitmask_isbitset (mems, i);
+    map->nnodes = nnodes;
+    map->ncpus = ncpus;
+    map->nlocal = 0;
+    map->usedcpus = NULL;
+    map->cpus = NULL;
+    map->topology = 0;
+    map->primary = NULL;
+    map->nl3 = 0;
+    map->l3 = NULL;
+
+    if (!(map->nodes = malloc (nnodes * sizeof (struct node *)))) {
+        free (map);
+        return (NULL);
+    }
 
-    bitmask_free (mems);
-    return (rc);
+    if (used) {
+        map->usedcpus = bitmask_alloc (bitmask_nbits (used));
+        bitmask_copy (map->usedcpus, used);
+    }
+
+    return (map);
 }
 
-struct nodemap * nodemap_create (cpuset_conf_t cf, struct bitmask *used)
+static void nodemap_finish (struct nodemap *map, cpuset_conf_t cf)
 {
-    int i;
-    struct nodemap *map = malloc (sizeof (*map));
-
-    if (map == NULL)
-        return (NULL);
+    map->navail = map->ncpus - bitmask_weight (map->usedcpus);
 
-    map->policy = default_policy;
+    log_debug2 ("Created nodemap with %d nodes, %d/%d CPUs\n",
+            map->nnodes, map->navail, map->ncpus);
 
-    map->nodelist = list_create ((ListDelF) node_destroy);
+    nodemap_policy_update (map, cf);
+}
 
-    map->nnodes = memmask_size ();
-    map->ncpus = cpumask_size ();
+/*
+ *  Return the set of memory nodes local to the CPUs in the current
+ *   cpuset. Computed once per nodemap rather than once per node.
+ */
+static struct bitmask * nodemap_localmems (struct nodemap *map)
+{
+    struct bitmask * mems = bitmask_alloc (memmask_size ());
 
-    if (used) {
-        map->usedcpus = bitmask_alloc (bitmask_weight (used));
-        bitmask_copy (map->usedcpus, used);
+    if (mems == NULL) {
+        log_err ("failed to allocate mems mask!!\n");
+        return (NULL);
     }
-    else {
-        map->usedcpus = used_cpus_bitmask ();
+
+    if (cpuset_localmems (map->cpus, mems) < 0) {
+        log_err ("cpuset_localmems: %s\n", strerror (errno));
+        bitmask_free (mems);
+        return (NULL);
     }
 
-    if (!map->usedcpus) {
-        list_destroy (map->nodelist);
-        free (map);
+    return (mems);
+}
+
+struct nodemap * nodemap_create (cpuset_conf_t cf, struct bitmask *used)
+{
+    int i;
+    struct bitmask *mems;
+    struct nodemap *map;
+
+    if (!(map = nodemap_alloc (memmask_size (), cpumask_size (), used)))
+        return (NULL);
+
+    if (!used && !(map->usedcpus = used_cpus_bitmask ())) {
+        nodemap_destroy (map);
         return (NULL);
     }
 
     map->cpus = current_cpuset_cpus ();
 
+    if ((mems = nodemap_localmems (map)) == NULL) {
+        nodemap_destroy (map);
+        return (NULL);
+    }
+
     for (i = 0; i < map->nnodes; i++) {
         struct node *n;
 
@@ -257,47 +340,237 @@ struct nodemap * nodemap_create (cpuset_conf_t cf, struct bitmask *used)
          *  Don't bother appending this node if none of its CPUs
          *   are available in the current cpuset
          */
-        if (!node_cpus_available (map, i))
+        if (!bitmask_isbitset (mems, i))
             continue;
 
-        if ((n  = node_create (map, i)) == NULL) {
+        if ((n  = node_create_system (map, i)) == NULL) {
+            bitmask_free (mems);
             nodemap_destroy (map);
             return (NULL);
         }
-        list_push (map->nodelist, n);
+        map->nodes[map->nlocal++] = n;
     }
+    bitmask_free (mems);
 
-    map->navail = map->ncpus - bitmask_weight (map->usedcpus);
+    nodemap_finish (map, cf);
 
-    log_debug2 ("Created nodemap with %d nodes, %d/%d CPUs\n",
-            map->nnodes, map->navail, map->ncpus);
+    return (map);
+}
 
-    nodemap_policy_update (map, cf);
+struct nodemap * nodemap_create_simulated (cpuset_conf_t cf, 
+        int nnodes, int cpus_per_node, struct bitmask *used)
+{
+    int i, j;
+    int ncpus = nnodes * cpus_per_node;
+    struct nodemap *map;
+
+    if (!(map = nodemap_alloc (nnodes, ncpus, used)))
+        return (NULL);
+
+    if (!used && !(map->usedcpus = bitmask_alloc (ncpus))) {
+        nodemap_destroy (map);
+        return (NULL);
+    }
+
+    map->cpus = bitmask_alloc (ncpus);
+    bitmask_setall (map->cpus);
+
+    for (i = 0; i < nnodes; i++) {
+        struct bitmask *localcpus = bitmask_alloc (ncpus);
+        struct node *n;
+
+        for (j = 0; j < cpus_per_node; j++)
+            bitmask_setbit (localcpus, i * cpus_per_node + j);
+
+        if ((n = node_create (map, i, localcpus)) == NULL) {
+            bitmask_free (localcpus);
+            nodemap_destroy (map);
+            return (NULL);
+        }
+        map->nodes[map->nlocal++] = n;
+    }
+
+    nodemap_finish (map, cf);
 
     return (map);
 }
 
+/*
+ *  Read the CPU list in sysfs file [name] for CPU [cpu] into a new
+ *   bitmask of [nbits] bits. Returns NULL if the file can't be read.
+ */
+static struct bitmask * read_cpu_list (int cpu, const char *name, int nbits)
+{
+    char path [4096];
+    char buf [4096];
+    struct bitmask *b;
+    FILE *fp;
+
+    snprintf (path, sizeof (path), "/sys/devices/system/cpu/cpu%d/%s", 
+            cpu, name);
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return (NULL);
+
+    if (fgets (buf, sizeof (buf), fp) == NULL) {
+        fclose (fp);
+        return (NULL);
+    }
+    fclose (fp);
+    buf [strcspn (buf, "\n")] = '\0';
+
+    if ((b = bitmask_alloc (nbits)) == NULL)
+        return (NULL);
+
+    if (bitmask_parselist (buf, b) < 0) {
+        bitmask_free (b);
+        return (NULL);
+    }
+    return (b);
+}
+
+/*
+ *  Add an L3 domain with CPUs [cpus] (restricted to the current cpuset)
+ *   to [map]. Takes ownership of [cpus].
+ */
+static int nodemap_add_l3 (struct nodemap *map, struct bitmask *cpus)
+{
+    struct node *n;
+
+    bitmask_and (cpus, cpus, map->cpus);
+
+    if ((n = node_create (map, map->nl3, cpus)) == NULL) {
+        bitmask_free (cpus);
+        return (-1);
+    }
+    map->l3[map->nl3++] = n;
+    return (0);
+}
+
+static void nodemap_clear_l3 (struct nodemap *map)
+{
+    int i;
+    for (i = 0; i < map->nl3; i++)
+        node_destroy (map->l3[i]);
+    map->nl3 = 0;
+}
+
+/*
+ *  Load the L3 cache domains and first hardware thread of each core
+ *   for CPUs in the current cpuset from sysfs. Without L3 information
+ *   allocation falls back to NUMA nodes, and without SMT information
+ *   every CPU is treated as a separate core.
+ */
+static int nodemap_load_topology (struct nodemap *map)
+{
+    struct bitmask *seen, *b;
+    int cpu;
+
+    map->topology = 1;
+
+    if (!(map->l3 = malloc (map->ncpus * sizeof (struct node *)))
+       || !(map->primary = bitmask_alloc (map->ncpus))
+       || !(seen = bitmask_alloc (map->ncpus))) {
+        cpuset_error ("Failed to allocate topology: %s\n", strerror (errno));
+        return (-1);
+    }
+
+    for (cpu = bitmask_first (map->cpus); cpu < map->ncpus; 
+         cpu = bitmask_next (map->cpus, cpu + 1)) {
+
+        b = read_cpu_list (cpu, "topology/thread_siblings_list", map->ncpus);
+        if (b == NULL || bitmask_first (b) == cpu)
+            bitmask_setbit (map->primary, cpu);
+        if (b)
+            bitmask_free (b);
+
+        if (bitmask_isbitset (seen, cpu))
+            continue;
+
+        b = read_cpu_list (cpu, "cache/index3/shared_cpu_list", map->ncpus);
+        if (b == NULL || !bitmask_isbitset (b, cpu)) {
+            log_debug ("No L3 cache information for CPU%d\n", cpu);
+            if (b)
+                bitmask_free (b);
+            nodemap_clear_l3 (map);
+            bitmask_setall (seen);
+            continue;
+        }
+
+        bitmask_or (seen, seen, b);
+        if (nodemap_add_l3 (map, b) < 0) {
+            nodemap_clear_l3 (map);
+            bitmask_setall (seen);
+        }
+    }
+
+    bitmask_free (seen);
+
+    log_debug ("Loaded topology: %d L3 domains, %d cores\n",
+            map->nl3, bitmask_weight (map->primary));
+    return (0);
+}
+
+int nodemap_simulate_topology (struct nodemap *map, int cpus_per_l3,
+        int threads_per_core)
+{
+    int cpu;
+
+    if (cpus_per_l3 <= 0 || threads_per_core <= 0)
+        return (-1);
+
+    nodemap_clear_l3 (map);
+    free (map->l3);
+    if (map->primary)
+        bitmask_free (map->primary);
+
+    map->topology = 1;
+    if (!(map->l3 = malloc (map->ncpus * sizeof (struct node *)))
+       || !(map->primary = bitmask_alloc (map->ncpus)))
+        return (-1);
+
+    for (cpu = 0; cpu < map->ncpus; cpu++) {
+        if (cpu % threads_per_core == 0)
+            bitmask_setbit (map->primary, cpu);
+
+        if (cpu % cpus_per_l3 == 0) {
+            struct bitmask *b = bitmask_alloc (map->ncpus);
+            int i;
+
+            if (b == NULL)
+                return (-1);
+            for (i = cpu; i < cpu + cpus_per_l3 && i < map->ncpus; i++)
+                bitmask_setbit (b, i);
+            if (nodemap_add_l3 (map, b) < 0)
+                return (-1);
+        }
+    }
+    return (0);
+}
+
 void print_nodemap (const struct nodemap *map)
 {
     struct node *n;
     struct bitmask *b;
-    ListIterator i = list_iterator_create (map->nodelist);
+    int i;
 
     print_bitmask ("Available CPUs: %s\n", map->cpus);
 
-    b = bitmask_alloc (cpumask_size ());
+    b = bitmask_alloc (map->ncpus);
     bitmask_and (b, map->cpus, map->usedcpus);
 
     print_bitmask ("Used CPUs:      %s\n", b);
-    bitmask_free (b);
 
-    while ((n = list_next (i))) {
+    for (i = 0; i < map->nlocal; i++) {
+        n = map->nodes[i];
         //slurm_info ("Node%d:", n->nodeid);
+        bitmask_andnot (b, n->localcpus, n->availcpus);
         print_bitmask ("Local CPUs: %s\n", n->localcpus);
-        print_bitmask ("Used CPUs:  %s\n", n->usedcpus);
+        print_bitmask ("Used CPUs:  %s\n", b);
     }
-
-    list_iterator_destroy (i);
+    for (i = 0; i < map->nl3; i++)
+        print_bitmask ("L3 domain:  %s\n", map->l3[i]->localcpus);
+    bitmask_free (b);
 }
 
 
@@ -315,9 +588,11 @@ static int find_node_lt_size (struct node *n, int *np)
     return (0);
 }
 
-static int should_allocate_idle_nodes (struct nodemap *m, int count)
+static int should_allocate_idle_nodes (struct allocation *a, int count)
 {
-    ListFindF fn;
+    struct nodemap *m = a->map;
+    int (*fn) (struct node *, int *);
+    int i;
 
     log_debug ("should_allocate_idle_nodes: %d\n", m->policy.alloc_idle_first);
 
@@ -325,17 +600,22 @@ static int should_allocate_idle_nodes (struct nodemap *m, int count)
         return (0);
 
     if (m->policy.alloc_idle_multiples_only)
-        fn = (ListFindF) find_multiple_of_node_size;
+        fn = find_multiple_of_node_size;
     else 
-        fn = (ListFindF) find_node_lt_size;
+        fn = find_node_lt_size;
 
-    if (list_find_first (m->nodelist, fn, &count))
-        return (1);
+    for (i = 0; i < a->nnodes; i++) {
+        if (fn (a->order[i], &count))
+            return (1);
+    }
     return (0);
 }
 
 static struct allocation * allocation_create (struct nodemap *map, int ntasks)
 {
+    int i;
+    int nunits = map->nlocal;
+    struct node **units = map->nodes;
     struct allocation *a = malloc (sizeof (*a));
 
     if (a == NULL)
@@ -344,97 +624,153 @@ static struct allocation * allocation_create (struct nodemap *map, int ntasks)
     a->map = map;
 
     a->ntasks = a->nleft = ntasks;
-    a->allocated_cpus = bitmask_alloc (cpumask_size ());
+
+    /*
+     *  With the l3 policy, L3 domains take the place of NUMA nodes.
+     *   Both sets of units share map->usedcpus, so refresh the available
+     *   CPUs of whichever set is used, since the other set may have
+     *   been allocated from since.
+     */
+    if (map->nl3 > 0) {
+        if (map->policy.l3) {
+            nunits = map->nl3;
+            units = map->l3;
+        }
+        for (i = 0; i < nunits; i++) {
+            struct node *n = units[i];
+            bitmask_andnot (n->availcpus, n->localcpus, map->usedcpus);
+            n->navail = bitmask_weight (n->availcpus);
+        }
+    }
+
+    /*
+     *  Nodes are considered in order of node id, or in reverse
+     *   order of node id for the reverse policy.
+     */
+    a->nnodes = nunits;
+    if (!(a->order = malloc ((nunits + 1) * sizeof (struct node *)))) {
+        free (a);
+        return (NULL);
+    }
+    for (i = 0; i < nunits; i++) {
+        int j = map->policy.reverse ? nunits - i - 1 : i;
+        a->order[i] = units[j];
+    }
+
+    a->allocated_cpus = bitmask_alloc (map->ncpus);
 
     return (a);
 }
 
 static void allocation_destroy (struct allocation *a)
 {
+    free (a->order);
     free (a);
 }
 
-static int node_cpu_to_global (struct node *n, int cpu)
-{
-    int firstcpu = bitmask_first (n->localcpus);
-    return (firstcpu + cpu);
-}
+#define BITS_PER_LONG (8 * sizeof (unsigned long))
 
-static int node_allocate_cpu (struct node *n, int cpu)
+static int mask_nwords (const struct bitmask *b)
 {
-    int gcpu;
-    if (bitmask_isbitset (n->usedcpus, cpu))
-        return (-1);
-
-    gcpu = node_cpu_to_global (n, cpu);
-    if (bitmask_isbitset (n->map->usedcpus, gcpu))
-        return (-1);
-
-    bitmask_setbit (n->usedcpus, cpu);
-    n->navail--;
-    bitmask_setbit (n->map->usedcpus, gcpu);
-    n->map->navail--;
-    return (gcpu);
+    return ((bitmask_nbits (b) + BITS_PER_LONG - 1) / BITS_PER_LONG);
 }
 
-static void allocation_add_cpu (struct allocation *a, int cpu)
+/*
+ *  Return the lowest (or highest if [reverse]) [count] set bits of [w].
+ */
+static unsigned long word_select (unsigned long w, int count, int reverse)
 {
-    bitmask_setbit (a->allocated_cpus, cpu);
-    a->nleft--;
+    unsigned long sel = 0;
+    unsigned long bit;
+
+    while (count-- > 0) {
+        if (reverse)
+            bit = 1UL << (BITS_PER_LONG - 1 - __builtin_clzl (w));
+        else
+            bit = w & -w;
+        sel |= bit;
+        w &= ~bit;
+    }
+    return (sel);
 }
 
-static int try_alloc (struct node *n, struct allocation *a, int cpu)
+/*
+ *  Move up to [count] available CPUs of node [n], restricted to [mask]
+ *   if non-NULL, into allocation [a]. CPUs are taken lowest first
+ *   (highest first for the reverse policy) one word at a time: any word
+ *   of available CPUs that fits entirely is moved into the allocation
+ *   and the map's used CPUs with a single mask operation.
+ */
+static int node_take (struct node *n, struct allocation *a, int count,
+        const struct bitmask *mask)
 {
-    int globalcpu = node_allocate_cpu (n, cpu);
+    unsigned long *avail = bitmask_mask (n->availcpus);
+    unsigned long *used = bitmask_mask (n->map->usedcpus);
+    unsigned long *alloc = bitmask_mask (a->allocated_cpus);
+    const unsigned long *m = mask ? bitmask_mask ((struct bitmask *) mask) 
+                                  : NULL;
+    int reverse = n->map->policy.reverse;
+    int nwords = mask_nwords (n->availcpus);
+    int nalloc = 0;
+    int i, k;
 
-    if (globalcpu < 0) /* CPU is in use */
-        return (-1);
+    if (mask_nwords (n->map->usedcpus) < nwords)
+        nwords = mask_nwords (n->map->usedcpus);
+    if (mask_nwords (a->allocated_cpus) < nwords)
+        nwords = mask_nwords (a->allocated_cpus);
+    if (mask && mask_nwords (mask) < nwords)
+        nwords = mask_nwords (mask);
+
+    for (k = 0; k < nwords && nalloc < count; k++) {
+        unsigned long w;
+        int weight;
 
-    cpuset_debug2 ("Node%d: allocated local CPU%d = CPU%d\n", 
-                   n->nodeid, cpu, globalcpu);
+        i = reverse ? nwords - 1 - k : k;
+        if ((w = m ? avail[i] & m[i] : avail[i]) == 0)
+            continue;
 
-    allocation_add_cpu (a, globalcpu);
+        weight = __builtin_popcountl (w);
+        if (weight > count - nalloc) {
+            weight = count - nalloc;
+            w = word_select (w, weight, reverse);
+        }
 
-    return (0);
+        avail[i] &= ~w;
+        used[i] |= w;
+        alloc[i] |= w;
+        nalloc += weight;
+    }
+
+    n->navail -= nalloc;
+    n->map->navail -= nalloc;
+    a->nleft -= nalloc;
+
+    return (nalloc);
 }
 
+/*
+ *  Allocate up to [count] available CPUs from node [n] to allocation [a],
+ *   or all available CPUs if count == -1. With the core_first policy,
+ *   the first hardware thread of each core is used before any siblings.
+ */
 static int node_allocate_n (struct node *n, struct allocation *a, int count)
 {
     int nalloc = 0;
-    int i;
 
-    if (a->nleft == 0)
+    if (count < 0 || count > n->navail)
+        count = n->navail;
+    if (count > a->nleft)
+        count = a->nleft;
+    if (count == 0)
         return (0);
 
-    /*
-     *  Allocate all CPUs left in node if count == -1
-     */
-    if (count < 0)
-        count = n->navail;
+    if (n->map->policy.core_first && n->map->primary)
+        nalloc = node_take (n, a, count, n->map->primary);
+    if (nalloc < count)
+        nalloc += node_take (n, a, count - nalloc, NULL);
 
-    cpuset_debug2 ("Allocating %d CPUs from node%d. nleft = %d\n", 
-            count, n->nodeid, a->nleft);
-
-    if (!n->map->policy.reverse) {
-        /*
-         *  Start with first CPU in node
-         */
-        for (i = 0; i < n->ncpus && a->nleft && nalloc < count; i++) {
-            if (try_alloc (n, a, i) < 0)
-                continue;
-            nalloc++;
-        }
-    }
-    else {
-        /*
-         *  Start with last CPU in node
-         */
-        for (i = n->ncpus - 1; i >= 0 && a->nleft && nalloc < count; i--) {
-            if (try_alloc (n, a, i) < 0)
-                continue;
-            nalloc++;
-        }
-    }
+    cpuset_debug2 ("Allocated %d CPUs from node%d. nleft = %d\n",
+            nalloc, n->nodeid, a->nleft);
 
     return (nalloc);
 }
@@ -446,14 +782,14 @@ static int node_allocate_all (struct node *n, struct allocation *a)
 
 static int alloc_idle_nodes (struct allocation *a)
 {
-    ListIterator i;
     struct node *n;
     int nalloc = 0;
+    int i;
 
     cpuset_debug ("Attempting to allocate idle nodes\n"); 
-    i = list_iterator_create (a->map->nodelist);
 
-    while ((n = list_next (i)) && (a->nleft > 0)) {
+    for (i = 0; i < a->nnodes && (a->nleft > 0); i++) {
+        n = a->order[i];
 
         log_debug2 ("alloc_idle: node%d; avail=%d\n", n->nodeid, n->navail);
         if(n->navail == 0)
@@ -480,50 +816,54 @@ static int alloc_idle_nodes (struct allocation *a)
     return (nalloc);
 }
 
-static int node_cmp_free (struct node *n1, struct node *n2)
+/*
+ *  Compare nodes by allocation order: node id, or reverse node id 
+ *   for the reverse policy.
+ */
+static int node_cmp_order (const struct node *n1, const struct node *n2)
 {
-    if (n1->navail == n2->navail)
-        return (0);
-    else if (n1->navail < n2->navail)
-        return (-1);
-    else
-        return (1);
-}
+    int rc = 0;
 
-static int node_cmp_avail (struct node *n1, struct node *n2)
-{
-    int rc = node_cmp_free (n1, n2);
-    return (-rc);
+    if (n1->nodeid < n2->nodeid)
+        rc = -1;
+    else if (n1->nodeid > n2->nodeid)
+        rc = 1;
+
+    return (n1->map->policy.reverse ? -rc : rc);
 }
 
-static int node_cmp_nodeid (struct node *n1, struct node *n2)
+/*
+ *  qsort(3) comparison for best-fit: fewest available CPUs first,
+ *   ties broken by allocation order.
+ */
+static int node_cmp_free (const void *x, const void *y)
 {
-    if (n1->nodeid < n2->nodeid)
+    const struct node *n1 = *(struct node * const *) x;
+    const struct node *n2 = *(struct node * const *) y;
+
+    if (n1->navail < n2->navail)
         return (-1);
-    else if (n1->nodeid > n2->nodeid)
+    else if (n1->navail > n2->navail)
         return (1);
-    else /* Shouldn't happen, but we'll check anyway */
-        return (0);
+    return (node_cmp_order (n1, n2));
 }
 
-static int node_cmp_reverse (struct node *n1, struct node *n2)
+static int do_allocation (struct allocation *a, 
+        int (*cmp) (const void *, const void *))
 {
-    return (-node_cmp_nodeid (n1, n2));
-}
+    int i;
 
+    if (cmp)
+        qsort (a->order, a->nnodes, sizeof (struct node *), cmp);
+
+    for (i = 0; i < a->nnodes && a->nleft > 0; i++)
+        node_allocate_all (a->order[i], a);
 
-static int do_allocation (struct allocation *a, ListCmpF sort_f)
-{
-    if (sort_f)
-        list_sort (a->map->nodelist, sort_f);
-    list_for_each (a->map->nodelist, (ListForF) node_allocate_all, a);
     return (0);
 }
 
 static int allocation_best_fit (struct allocation *a)
 {
-    ListCmpF fn;
-
     log_debug ("allocation: best-fit\n");
     /*
      *  Best fit:
@@ -531,9 +871,40 @@ static int allocation_best_fit (struct allocation *a)
      *  Sort NUMA nodes by amount of CPUs free in ascending 
      *   order, then pack in first-fit mode.
      */
-    fn = (ListCmpF) node_cmp_free;
+    return (do_allocation (a, node_cmp_free));
+}
 
-    return (do_allocation (a, fn));
+/*
+ *  Best fit by L3 domain: if a single domain can hold the rest of the
+ *   allocation, use the fullest such domain. Otherwise take all of the
+ *   emptiest domain and repeat. This keeps the job in the fewest cache
+ *   domains while still filling partially used domains where possible.
+ */
+static int allocation_best_fit_l3 (struct allocation *a)
+{
+    int i;
+
+    log_debug ("allocation: best-fit-l3\n");
+
+    while (a->nleft > 0) {
+        struct node *fit = NULL;
+        struct node *max = NULL;
+
+        for (i = 0; i < a->nnodes; i++) {
+            struct node *n = a->order[i];
+            if (n->navail >= a->nleft
+               && (fit == NULL || n->navail < fit->navail))
+                fit = n;
+            if (max == NULL || n->navail > max->navail)
+                max = n;
+        }
+
+        if (fit == NULL)
+            fit = max;
+        if (fit == NULL || node_allocate_all (fit, a) <= 0)
+            return (-1);
+    }
+    return (0);
 }
 
 static int allocation_first_fit (struct allocation *a)
@@ -542,18 +913,62 @@ static int allocation_first_fit (struct allocation *a)
     return (do_allocation (a, NULL));
 }
 
+/*
+ *  Return nonzero if [n1] should be above [n2] in the worst-fit heap:
+ *   more available CPUs first, ties broken by allocation order.
+ */
+static int node_heap_before (const struct node *n1, const struct node *n2)
+{
+    if (n1->navail != n2->navail)
+        return (n1->navail > n2->navail);
+    return (node_cmp_order (n1, n2) < 0);
+}
+
+static void node_heap_sift_down (struct node **heap, int len, int i)
+{
+    for (;;) {
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int top = i;
+        struct node *tmp;
+
+        if (l < len && node_heap_before (heap[l], heap[top]))
+            top = l;
+        if (r < len && node_heap_before (heap[r], heap[top]))
+            top = r;
+        if (top == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[top];
+        heap[top] = tmp;
+        i = top;
+    }
+}
+
 static int allocation_worst_fit (struct allocation *a)
 {
+    struct node **heap = a->order;
+    int len = a->nnodes;
+    int i;
+
     log_debug ("allocation: worst-fit\n");
+
+    /*
+     *  For worst-fit, each CPU is allocated from the node with the
+     *   most available CPUs. Keep nodes in a max-heap keyed on
+     *   available CPUs so that after each allocation only the top
+     *   node has to be moved down, in O(log nnodes).
+     */
+    for (i = len / 2 - 1; i >= 0; i--)
+        node_heap_sift_down (heap, len, i);
+
     while (a->nleft) {
-        /*
-         *  For worst-fit, we have to sort by available CPUs in
-         *   desending order, then allocate 1 CPU. Then re-sort, and
-         *   so on.
-         */
-        list_sort (a->map->nodelist, (ListCmpF) node_cmp_avail);
-        if (node_allocate_n (list_peek (a->map->nodelist), a, 1) < 0)
+        if (len == 0 || heap[0]->navail == 0)
+            return (-1);
+        if (node_allocate_n (heap[0], a, 1) <= 0)
             return (-1);
+        node_heap_sift_down (heap, len, 0);
     }
     return (0);
 }
@@ -572,22 +987,22 @@ struct bitmask * nodemap_allocate (struct nodemap *map, int ncpus)
         return (NULL);
     }
 
-    if (!map->policy.reverse)
-        list_sort (map->nodelist, (ListCmpF) node_cmp_nodeid);
-    else
-        list_sort (map->nodelist, (ListCmpF) node_cmp_reverse);
+    if ((map->policy.l3 || map->policy.core_first) && !map->topology)
+        nodemap_load_topology (map);
 
     if ((a = allocation_create (map, ncpus)) == NULL)
         return (NULL);
 
-    if (should_allocate_idle_nodes (a->map, ncpus))
+    if (should_allocate_idle_nodes (a, ncpus))
         alloc_idle_nodes (a);
 
     if (a->nleft > 0) {
         /*
          *  Allocate based on policy.
          */
-        if (a->map->policy.best_fit)
+        if (a->map->policy.l3)
+            allocation_best_fit_l3 (a);
+        else if (a->map->policy.best_fit)
             allocation_best_fit (a);
         else if (a->map->policy.first_fit)
             allocation_first_fit (a);
@@ -606,6 +1021,71 @@ struct bitmask * nodemap_allocate (struct nodemap *map, int ncpus)
     return (allocated);
 }
 
+/*
+ *  qsort(3) comparison for spreading: most available CPUs first,
+ *   ties broken by allocation order.
+ */
+static int node_cmp_free_desc (const void *x, const void *y)
+{
+    const struct node *n1 = *(struct node * const *) x;
+    const struct node *n2 = *(struct node * const *) y;
+
+    if (n1->navail > n2->navail)
+        return (-1);
+    else if (n1->navail < n2->navail)
+        return (1);
+    return (node_cmp_order (n1, n2));
+}
+
+struct bitmask * nodemap_allocate_spread (struct nodemap *map, int ncpus)
+{
+    struct bitmask *allocated;
+    struct allocation *a;
+    struct node *best = NULL;
+    int i;
+
+    log_debug ("nodemap_allocate_spread (ncpus=%d, navail=%d)\n",
+            ncpus, map->navail);
+
+    if (ncpus > map->navail) {
+        cpuset_error ("%d CPUs requested, but only %d available\n",
+                ncpus, map->navail);
+        return (NULL);
+    }
+
+    if ((map->policy.l3 || map->policy.core_first) && !map->topology)
+        nodemap_load_topology (map);
+
+    if ((a = allocation_create (map, ncpus)) == NULL)
+        return (NULL);
+
+    /*
+     *  Use the emptiest node that can hold all [ncpus], so that
+     *   successive calls place tasks round-robin across nodes.
+     *   Otherwise take whole nodes, emptiest first.
+     */
+    for (i = 0; i < a->nnodes; i++) {
+        struct node *n = a->order[i];
+        if (n->navail >= ncpus && (best == NULL || n->navail > best->navail))
+            best = n;
+    }
+
+    if (best)
+        node_allocate_n (best, a, ncpus);
+    else
+        do_allocation (a, node_cmp_free_desc);
+
+    if (a->nleft > 0)
+        cpuset_error ("Failed to allocate %d tasks.\n", a->nleft);
+
+    allocated = a->allocated_cpus;
+    a->allocated_cpus = NULL;
+
+    allocation_destroy (a);
+
+    return (allocated);
+}
+
 const struct bitmask * nodemap_used (struct nodemap *map)
 {
     return (map->usedcpus);
@@ -34,6 +34,23 @@
  *   with the actual utilized CPUs.
  */
 struct nodemap * nodemap_create (cpuset_conf_t cf, struct bitmask *used);
+
+/*
+ *  Create a nodemap for a simulated system of [nnodes] NUMA nodes
+ *   with [cpus_per_node] CPUs each, without consulting libcpuset.
+ *   Used for testing and benchmarking allocation policies.
+ */
+struct nodemap * nodemap_create_simulated (cpuset_conf_t cf,
+        int nnodes, int cpus_per_node, struct bitmask *used);
+
+/*
+ *  Give a simulated nodemap L3 domains of [cpus_per_l3] consecutive
+ *   CPUs and cores of [threads_per_core] consecutive hardware threads,
+ *   in place of the topology that would be read from sysfs.
+ */
+int nodemap_simulate_topology (struct nodemap *map, int cpus_per_l3,
+        int threads_per_core);
+
 int nodemap_policy_update (struct nodemap *map, cpuset_conf_t cf);
 
 void nodemap_destroy (struct nodemap *);
@@ -45,6 +62,13 @@ void print_nodemap (const struct nodemap *);
  */
 struct bitmask * nodemap_allocate (struct nodemap *map, int ncpus);
 
+/*
+ *  Allocate ncpus from the emptiest NUMA node (or L3 domain with the
+ *   best-fit-l3 policy) that can hold them all. Repeated calls spread
+ *   allocations round-robin across nodes.
+ */
+struct bitmask * nodemap_allocate_spread (struct nodemap *map, int ncpus);
+
 const struct bitmask * nodemap_used (struct nodemap *map);
 
 
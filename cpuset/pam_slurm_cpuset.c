@@ -40,8 +40,11 @@
 #include "slurm.h"
 #include "conf.h"
 #include "log.h"
+#include "jobcache.h"
+#include "backend.h"
 
-static int create_all_job_cpusets (cpuset_conf_t conf, uid_t uid);
+static int create_all_job_cpusets (cpuset_conf_t conf,
+        struct job_cache_entry *jobs, int njobs);
 static int migrate_to_user_cpuset (uid_t uid);
 static int in_user_cpuset (uid_t uid);
 
@@ -86,7 +89,10 @@ pam_sm_acct_mgmt (pam_handle_t *pamh, int flags, int ac, const char **av)
     struct passwd *pw;
     uid_t uid;
     const void **uptr = (const void **) &user;
+    struct job_cache_entry *jobs;
+    int njobs;
     int lockfd;
+    int userfd;
 
     cpuset_conf_t conf = cpuset_conf_create ();
 
@@ -134,6 +140,25 @@ pam_sm_acct_mgmt (pam_handle_t *pamh, int flags, int ac, const char **av)
     if (!cpuset_conf_file (conf))
         cpuset_conf_parse_system (conf);
 
+    /*
+     *  Get this user's running jobs on this node before taking the
+     *   slurm cpuset lock, so that we don't hold up other logins and
+     *   job launches while waiting for slurmctld to confirm them.
+     */
+    if ((njobs = job_cache_user_jobs (conf, uid, &jobs)) < 0) {
+        log_err ("Failed to load jobs: %m");
+        dyn_slurm_close ();
+        return (PAM_SYSTEM_ERR);
+    }
+
+    if (njobs == 0) {
+        log_err ("Access denied: User %s (uid=%d) has no active SLURM jobs.", 
+                user, uid);
+        free (jobs);
+        dyn_slurm_close ();
+        return (PAM_PERM_DENIED);
+    }
+
     /*
      *  Now we have to create cpusets for all running jobs
      *   on the system for this user, so that they have the
@@ -143,6 +168,8 @@ pam_sm_acct_mgmt (pam_handle_t *pamh, int flags, int ac, const char **av)
 
     if ((lockfd = slurm_cpuset_create (conf)) < 0) {
         log_err ("Unable to initialilze slurm cpuset");
+        free (jobs);
+        dyn_slurm_close ();
         return (PAM_SYSTEM_ERR);
     }
     
@@ -150,25 +177,36 @@ pam_sm_acct_mgmt (pam_handle_t *pamh, int flags, int ac, const char **av)
      *  create_all_job_cpusets returns the number of CPUs
      *   the user has allocated on this node (or -1 for failure)
      */
+    n = create_all_job_cpusets (conf, jobs, njobs);
+    slurm_cpuset_unlock (lockfd);
 
-    if ((n = create_all_job_cpusets (conf, uid)) < 0) {
+    free (jobs);
+    dyn_slurm_close ();
+
+    if (n < 0) {
         log_err ("Failed to create user cpuset for uid=%d", uid);
-        slurm_cpuset_unlock (lockfd);
         return (PAM_SYSTEM_ERR);
     }
     else if (n == 0) {
         log_err ("Access denied: User %s (uid=%d) has no active SLURM jobs.", 
                 user, uid);
-        slurm_cpuset_unlock (lockfd);
         return (PAM_PERM_DENIED);
     }
 
-    if (migrate_to_user_cpuset (uid) < 0) {
+    /*
+     *  Only the user lock is needed to join the user cpuset.
+     */
+    if ((userfd = user_cpuset_lock (uid)) < 0) {
+        log_err ("Failed to lock user cpuset for uid=%d", uid);
+        return (PAM_SYSTEM_ERR);
+    }
+    rc = migrate_to_user_cpuset (uid);
+    user_cpuset_unlock (userfd);
+
+    if (rc < 0) {
         log_err ("Failed to create user cpuset for uid=%d", uid);
-        slurm_cpuset_unlock (lockfd);
         return (PAM_SYSTEM_ERR);
     }
-    slurm_cpuset_unlock (lockfd);
 
     log_msg ("Access granted for user %s (uid=%d) with %d CPUs", 
             user, uid, n);
@@ -184,7 +222,7 @@ static int in_user_cpuset (uid_t uid)
     char q [1024];
     int n;
 
-    if (!cpuset_getcpusetpath (0, p, sizeof (p)))
+    if (backend_current (p, sizeof (p)) < 0)
         return (0);
 
     n = snprintf (q, sizeof (q), "/slurm/%d", uid);
@@ -203,7 +241,7 @@ static int migrate_to_user_cpuset  (uid_t uid)
     if (rc < 0 || rc > sizeof (path))
         return (-1);
 
-    if (cpuset_move (0, path) < 0) 
+    if (backend_move (0, path) < 0) 
         return (-1);
 
     return (0);
@@ -223,54 +261,24 @@ int hostname_hostid (const char *host, const char *nodes)
     return (n);
 }
 
-int cpus_on_node (job_info_t *j, const char *host)
-{
-    return slurm_job_cpus_allocated_on_node (j->job_resrcs, host);
-}
-
-int create_all_job_cpusets (cpuset_conf_t conf, uid_t uid)
+int create_all_job_cpusets (cpuset_conf_t conf,
+        struct job_cache_entry *jobs, int njobs)
 {
     int i;
-    char hostname[256];
-    char *p;
-    job_info_msg_t * msg;
     int total_cpus = 0;
 
-    if (gethostname (hostname, sizeof (hostname)) < 0) {
-        return (-1);
-    }
-
-    if ((p = strchr (hostname, '.')))
-        *p = '\0';
-
-    dyn_slurm_open ();
-    if (slurm_load_jobs (0, &msg, SHOW_ALL|SHOW_DETAIL) < 0) {
-        return (-1);
-    }
-
-    for (i = 0; i < msg->record_count; i++) {
-        job_info_t *j = &msg->job_array[i];
-        int ncpus;
+    for (i = 0; i < njobs; i++) {
+        struct job_cache_entry *j = &jobs[i];
 
-        if ((j->user_id != uid) || (j->job_state != JOB_RUNNING))
-            continue;
-
-        if ((ncpus = cpus_on_node (j, hostname)) <= 0)
-            continue;
-
-        if (!job_cpuset_exists (j->job_id, j->user_id) &&
-            create_cpuset_for_job (conf, j->job_id, j->user_id, ncpus) < 0) {
-            log_err ("job %u: Failed to create cpuset: %m", j->job_id);
+        if (!job_cpuset_exists (j->jobid, j->uid) &&
+            create_cpuset_for_job (conf, j->jobid, j->uid, j->ncpus) < 0) {
+            log_err ("job %u: Failed to create cpuset: %m", j->jobid);
             continue;
         }
 
-        total_cpus += ncpus;
+        total_cpus += j->ncpus;
     }
 
-    slurm_free_job_info_msg (msg);
-
-    dyn_slurm_close ();
-
     return (total_cpus);
 }
 
@@ -28,43 +28,287 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
+#include "fd.h"
 #include "util.h"
 #include "create.h"
 #include "conf.h"
 #include "log.h"
+#include "backend.h"
 
-const char cpuset_path[] = "/dev/cpuset";
+const char cleaner_pidfile[] = "/var/run/slurm-cpuset-cleaner.pid";
+
+/*
+ *  Seconds between cleanups by the background cleaner when no
+ *   release notifications arrive, in case any were missed.
+ */
+#define CLEANER_INTERVAL 60
 
 const char * basename (const char *path);
 static FILE *fp = NULL;
 
+static volatile sig_atomic_t cleaner_done = 0;
+
 static int log_fp (const char *msg) 
 {
-    if (fp)
+    if (fp) {
         fprintf (fp, "%s", msg);
+        fflush (fp);
+    }
+    return (0);
+}
+
+static void cleaner_exit_handler (int signum)
+{
+    cleaner_done = 1;
+}
+
+static int cleaner_signals_init (void)
+{
+    struct sigaction sa;
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = cleaner_exit_handler;
+    sigemptyset (&sa.sa_mask);
+
+    if (sigaction (SIGTERM, &sa, NULL) < 0 || sigaction (SIGINT, &sa, NULL) < 0)
+        return (-1);
+
+    signal (SIGPIPE, SIG_IGN);
+    return (0);
+}
+
+static int write_pidfile (const char *path)
+{
+    FILE *pf;
+
+    if ((pf = fopen (path, "w")) == NULL)
+        return (-1);
+    fprintf (pf, "%d\n", (int) getpid ());
+    return (fclose (pf));
+}
+
+/*
+ *  Read and log all pending release notifications from [fd].
+ */
+static void cleaner_drain (int fd)
+{
+    char buf [4096];
+    ssize_t n;
+
+    while ((n = read (fd, buf, sizeof (buf) - 1)) > 0) {
+        char *line, *next;
+        buf [n] = '\0';
+        for (line = strtok_r (buf, "\n", &next); line; 
+             line = strtok_r (NULL, "\n", &next))
+            log_verbose ("Released %s\n", line);
+    }
+}
+
+static int cleaner_run_once (cpuset_conf_t conf)
+{
+    int lockfd;
+
+    if ((lockfd = slurm_cpuset_create (conf)) < 0) {
+        log_err ("Failed to lock slurm cpuset: %s\n", strerror (errno));
+        return (-1);
+    }
+    slurm_cpuset_clean (conf);
+    slurm_cpuset_unlock (lockfd);
+    return (0);
+}
+
+static int cleaner_watch_one (const char *path, void *arg)
+{
+    char file [4096];
+    int ifd = *(int *) arg;
+
+    snprintf (file, sizeof (file), "%s/cgroup.events", path);
+    if (inotify_add_watch (ifd, path, IN_CREATE|IN_ONLYDIR) < 0
+       || inotify_add_watch (ifd, file, IN_MODIFY) < 0)
+        log_debug ("inotify_add_watch %s: %s\n", path, strerror (errno));
+    return (0);
+}
+
+/*
+ *  cgroup v2 has no release agent. Instead, watch the cgroup.events
+ *   file of every cgroup below /slurm, which is modified when the
+ *   cgroup becomes populated or empty, and each cgroup directory for
+ *   new children to watch. Watches on removed cgroups go away by
+ *   themselves, and adding an existing watch again is harmless.
+ */
+static void cleaner_watch (int ifd)
+{
+    char path [4096];
+
+    snprintf (path, sizeof (path), "%s/slurm", backend_root ());
+    cleaner_watch_one (path, &ifd);
+    cpuset_walk (path, cleaner_watch_one, &ifd);
+}
+
+/*
+ *  Read all pending inotify events from [ifd]. Returns nonzero if any
+ *   cgroup.events file changed.
+ */
+static int cleaner_drain_events (int ifd)
+{
+    char buf [4096]
+        __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    int released = 0;
+    ssize_t n;
+
+    while ((n = read (ifd, buf, sizeof (buf))) > 0) {
+        char *p = buf;
+        while (p < buf + n) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_MODIFY)
+                released = 1;
+            p += sizeof (*ev) + ev->len;
+        }
+    }
+    return (released);
+}
+
+/*
+ *  Run as a long-lived cleaner. With the legacy cpuset filesystem the
+ *   kernel still invokes the release agent for each released cpuset,
+ *   but instead of cleaning up itself the agent just writes the cpuset
+ *   name to our FIFO. With cgroup v2, cgroup.events changes are
+ *   watched directly. All pending notifications are handled by a
+ *   single cleanup pass.
+ */
+static int cleaner_daemon (cpuset_conf_t conf)
+{
+    struct pollfd pfd [2];
+    int nfds = 1;
+    int ifd = -1;
+    int fd;
+
+    if (daemon (0, 0) < 0) {
+        log_err ("daemon: %s\n", strerror (errno));
+        return (1);
+    }
+
+    if (cleaner_signals_init () < 0) {
+        log_err ("sigaction: %s\n", strerror (errno));
+        return (1);
+    }
+
+    unlink (CPUSET_CLEANER_FIFO);
+    if (mkfifo (CPUSET_CLEANER_FIFO, 0600) < 0) {
+        log_err ("mkfifo %s: %s\n", CPUSET_CLEANER_FIFO, strerror (errno));
+        return (1);
+    }
+
+    /*
+     *  Open read-write so that the FIFO never sees EOF when the
+     *   last writer closes it.
+     */
+    if ((fd = open (CPUSET_CLEANER_FIFO, O_RDWR)) < 0) {
+        log_err ("open %s: %s\n", CPUSET_CLEANER_FIFO, strerror (errno));
+        unlink (CPUSET_CLEANER_FIFO);
+        return (1);
+    }
+    fd_set_nonblocking (fd);
+    fd_set_close_on_exec (fd);
+
+    if (write_pidfile (cleaner_pidfile) < 0)
+        log_err ("Failed to write %s: %s\n", cleaner_pidfile, strerror (errno));
+
+    log_verbose ("Cleaner started, pid %d\n", (int) getpid ());
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+
+    if (strcmp (backend_name (), "cgroup2") == 0) {
+        if ((ifd = inotify_init ()) < 0)
+            log_err ("inotify_init: %s\n", strerror (errno));
+        else {
+            fd_set_nonblocking (ifd);
+            fd_set_close_on_exec (ifd);
+            pfd[1].fd = ifd;
+            pfd[1].events = POLLIN;
+            nfds = 2;
+        }
+    }
+
+    /*
+     *  Catch up on anything released before we started.
+     */
+    cleaner_run_once (conf);
+    if (ifd >= 0)
+        cleaner_watch (ifd);
+
+    while (!cleaner_done) {
+        int clean = 1;
+        int n = poll (pfd, nfds, CLEANER_INTERVAL * 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_err ("poll: %s\n", strerror (errno));
+            break;
+        }
+        if (n > 0 && (pfd[0].revents & POLLIN))
+            cleaner_drain (fd);
+        if (n > 0 && ifd >= 0 && (pfd[1].revents & POLLIN)) {
+            /*
+             *  New cgroups only need to be watched, not cleaned.
+             */
+            clean = cleaner_drain_events (ifd) || (pfd[0].revents & POLLIN);
+        }
+        if (clean)
+            cleaner_run_once (conf);
+        if (ifd >= 0)
+            cleaner_watch (ifd);
+    }
+
+    log_verbose ("Cleaner exiting\n");
+
+    if (ifd >= 0)
+        close (ifd);
+    close (fd);
+    unlink (CPUSET_CLEANER_FIFO);
+    unlink (cleaner_pidfile);
     return (0);
 }
 
 int main (int ac, char **av)
 {
     int lockfd;
+    int rc = 0;
     char path [4096];
     const char *prog = basename (av[0]);
 
     cpuset_conf_t conf = cpuset_conf_create ();
 
     if (ac < 2) {
-        fprintf (stderr, "Usage: %s cpuset_path\n", prog); 
+        fprintf (stderr, "Usage: %s [--daemon] | cpuset_path\n", prog); 
         return (1);
     }
 
+    /*
+     *  If a background cleaner is running, hand this cpuset off to it.
+     */
+    if (*av[1] == '/' && cpuset_cleaner_notify (av[1]) == 0)
+        return (0);
+
     fp = fopen ("/var/log/slurm-cpuset.log", "a");
 
     log_add_dest (C_LOG_VERBOSE, log_fp);
     cpuset_conf_parse_system (conf); /* Ignore errors, we must proceed */
 
-    snprintf (path, sizeof (path), "%s%s", cpuset_path, av[1]);
+    if (strcmp (av[1], "-d") == 0 || strcmp (av[1], "--daemon") == 0) {
+        rc = cleaner_daemon (conf);
+        goto done;
+    }
+
+    snprintf (path, sizeof (path), "%s%s", backend_root (), av[1]);
 
     if ((lockfd = slurm_cpuset_create (conf)) < 0) {
         log_err ("Failed to lock slurm cpuset: %s\n", strerror (errno));
@@ -75,10 +319,12 @@ int main (int ac, char **av)
 
     update_user_cpusets (conf);
     slurm_cpuset_unlock (lockfd);
+done:
     cpuset_conf_destroy (conf);
-    fclose (fp);
+    if (fp)
+        fclose (fp);
 
-    return (0);
+    return (rc);
 }
 
 /*
@@ -53,6 +53,7 @@ int dyn_slurm_open ()
 void dyn_slurm_close ()
 {
     if (slurm_h) dlclose (slurm_h);
+    slurm_h = NULL;
 }
 
 /*
@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include <slurm/slurm.h>
 #include <slurm/spank.h>
@@ -41,11 +42,9 @@
 #include "create.h"
 #include "slurm.h"
 #include "log.h"
-
-/*
- *  Path to base SLURM cpuset, which contains all other cpusets.
- */
-static const char slurm_cpuset[] = "/dev/cpuset/slurm";
+#include "ledger.h"
+#include "jobcache.h"
+#include "backend.h"
 
 void print_bitmask (const char *fmt, const struct bitmask *b)
 {
@@ -54,66 +53,43 @@ void print_bitmask (const char *fmt, const struct bitmask *b)
     log_msg (fmt, buf);
 }
 
-static struct cpuset * get_cpuset (const char *path)
-{
-    struct cpuset *cpuset = NULL;
-
-    if (!(cpuset = cpuset_alloc ()))
-        return (NULL);
-
-    if (cpuset_query (cpuset, path) < 0) {
-        cpuset_free (cpuset);
-        return (NULL);
-    }
-
-    return (cpuset);
-}
-
 int cpumask_size (void)
 {
-    struct cpuset *cp;
     static int totalcpus = -1;
-    if (totalcpus < 0) {
-        cp = get_cpuset ("/");
-        totalcpus = cpuset_cpus_weight (cp);
-        cpuset_free (cp);
-    }
+    if (totalcpus < 0)
+        totalcpus = backend_count (0);
     return (totalcpus);
 }
 
 int memmask_size (void)
 {
-    struct cpuset *cp;
     static int totalmems = -1;
-    if (totalmems < 0) {
-        cp = get_cpuset ("/");
-        totalmems = cpuset_mems_weight (cp);
-        cpuset_free (cp);
-    }
+    if (totalmems < 0)
+        totalmems = backend_count (1);
     return (totalmems);
 }
 
-void print_cpuset_info (const char *path, struct cpuset *cp)
+void print_cpuset_info (const char *name)
 {
     char cstr [16];
     char mstr [16];
     struct bitmask *cpus, *mems;
     int ncpus, nmems;
 
-    ncpus = cpuset_cpus_weight (cp);
-    nmems = cpuset_mems_weight (cp);
-
     cpus = bitmask_alloc (cpumask_size ());
     mems = bitmask_alloc (memmask_size ());
     
-    cpuset_getcpus (cp, cpus);
-    cpuset_getmems (cp, mems);
+    backend_getcpus (name, cpus);
+    backend_getmems (name, mems);
+
+    ncpus = bitmask_weight (cpus);
+    nmems = bitmask_weight (mems);
 
     bitmask_displaylist (cstr, sizeof (cstr), cpus);
     bitmask_displaylist (mstr, sizeof (mstr), mems);
 
     cpuset_verbose ("%s: %d cpu%s [%s], %d mem%s [%s]\n", 
-            path,
+            name,
             ncpus, (ncpus == 1 ? "" : "s"), cstr, 
             nmems, (nmems == 1 ? "" : "s"), mstr);
 
@@ -123,88 +99,72 @@ void print_cpuset_info (const char *path, struct cpuset *cp)
 
 void print_current_cpuset_info ()
 {
-    char path [4096];
-    struct cpuset *cp = cpuset_alloc ();
-
-    cpuset_getcpusetpath (0, path, sizeof (path));
-    cpuset_query (cp, path);
-
-    print_cpuset_info (path, cp);
+    char name [4096];
 
-    cpuset_free (cp);
+    if (backend_current (name, sizeof (name)) == 0)
+        print_cpuset_info (name);
 }
 
 static int current_cpuset_path (char *path, int len)
 {
-    if (len < 12) 
+    char name [4096];
+    int n;
+
+    if (backend_current (name, sizeof (name)) < 0)
         return (-1);
 
-    strncpy (path, "/dev/cpuset", len);
+    /*
+     *  If we are in the root cpuset, pretend we're in /slurm instead.
+     */
+    if (strcmp (name, "/") == 0)
+        strcpy (name, "/slurm");
 
-    if (!cpuset_getcpusetpath (0, path + 11, len - 11))
+    n = snprintf (path, len, "%s%s", backend_root (), name);
+    if ((n < 0) || (n >= len))
         return (-1);
 
-    if (strcmp (path, "/dev/cpuset/") == 0) {
-        /*
-         *  If we are in the root cpuset, pretend we're in /slurm instead.
-         */
-        strncat (path, "slurm", len);
-    }
-
     return (0);
 }
 
 const char * cpuset_path_to_name (const char *path)
 {
-    return (path + 11);
+    return (path + strlen (backend_root ()));
 }
 
-struct bitmask *used_cpus_bitmask_path (char *path, int clearall)
+/*
+ *  Return the union of the CPUs of all child cpusets of [path],
+ *   from the allocation ledger if it is current, otherwise by
+ *   scanning [path] and recording the result in the ledger.
+ */
+static struct bitmask *child_cpus_bitmask (const char *path)
 {
-    char buf [4096];
     const char *current;
     struct bitmask *b, *used;
     DIR *dirp;
     struct dirent *dp;
-    struct cpuset *cp;
 
-    if (path == NULL) {
-        path = buf;
-        if (current_cpuset_path (buf, sizeof (buf)) < 0) {
-            cpuset_error ("Unable to get current cpuset path: %m");
-            return (NULL);
-        }
-        cpuset_debug ("used_cpus_bitmask_path (%s)\n", path);
+    if ((used = bitmask_alloc (cpumask_size ())) == NULL) {
+        cpuset_error ("Couldn't alloc bitmask: %m");
+        return (NULL);
     }
 
+    if (cpuset_ledger_lookup (path, used) == 0)
+        return (used);
+
     if ((dirp = opendir (path)) == NULL) {
         cpuset_error ("Couldn't open %s: %m", path);
+        bitmask_free (used);
         return NULL;
     }
 
-    if ((cp = cpuset_alloc ()) == NULL) {
-        cpuset_error ("Couldn't alloc cpuset: %m");
-        return (NULL);
-    }
-
     current = cpuset_path_to_name (path);
 
     b = bitmask_alloc (cpumask_size ());
-    used = bitmask_alloc (cpumask_size ());
-
-    if (!clearall) {
-        /*
-         *  First, set all CPUs not in this cpuset as used
-         */
-        cpuset_query (cp, current);
-        cpuset_getcpus (cp, used);
-        bitmask_complement (used, used);
-    }
 
     while ((dp = readdir (dirp))) {
         char name [4096];
 
-        if (*dp->d_name == '.')
+        if (*dp->d_name == '.' || dp->d_type != DT_DIR)
             continue;
 
         /*
@@ -214,79 +174,118 @@ struct bitmask *used_cpus_bitmask_path (char *path, int clearall)
            continue;
 
         /*
-         *  Generate cpuset name relative to /dev/cpuset
+         *  Generate cpuset name relative to the backend root
          */
         snprintf (name, sizeof (name), "%s/%s", current, dp->d_name);
-        if (cpuset_query (cp, name) < 0) 
-            continue;
-
-        if (cpuset_getcpus (cp, b) < 0)
+        if (backend_getcpus (name, b) < 0) {
             cpuset_error ("Failed to get CPUs for %s: %m", name);
+            continue;
+        }
 
         used = bitmask_or (used, b, used);
     }
     closedir (dirp);
 
+    cpuset_ledger_store (path, used);
+
     bitmask_free (b);
     return (used);
 }
 
-int slurm_jobid_is_valid (int jobid)
+struct bitmask *used_cpus_bitmask_path (char *path, int clearall)
 {
-    static job_info_msg_t *msg = NULL;
-    static time_t last_update = 0;
-    int i;
-    int try = 0;
-
-    dyn_slurm_open ();
+    char buf [4096];
+    struct bitmask *b, *used;
 
-    cpuset_debug ("slurm_jobid_is_valid (%d)\n", jobid);
+    if (path == NULL) {
+        path = buf;
+        if (current_cpuset_path (buf, sizeof (buf)) < 0) {
+            cpuset_error ("Unable to get current cpuset path: %m");
+            return (NULL);
+        }
+        cpuset_debug ("used_cpus_bitmask_path (%s)\n", path);
+    }
 
-    while (slurm_load_jobs (last_update, &msg, SHOW_DETAIL) < 0 &&
-            errno != SLURM_NO_CHANGE_IN_DATA) {
+    if ((used = child_cpus_bitmask (path)) == NULL)
+        return (NULL);
 
-        /*  Give up after 3 tries and for safety mark the job
-         *   as valid
+    if (!clearall) {
+        /*
+         *  Also set all CPUs not in this cpuset as used
          */
-        if (++try > 3)
-            return (1);
+        b = bitmask_alloc (cpumask_size ());
+        backend_getcpus (cpuset_path_to_name (path), b);
+        bitmask_complement (b, b);
+        bitmask_or (used, used, b);
+        bitmask_free (b);
     }
 
-    last_update = time (NULL);
+    return (used);
+}
 
-    if (jobid == -1) {
-        slurm_free_job_info_msg (msg);
-        return (0);
-    }
+/*
+ *  Copy the parent directory of [path] into [buf].
+ */
+static int parent_path (const char *path, char *buf, int len)
+{
+    char *p;
 
-    for (i = 0; i < msg->record_count; i++) {
-        job_info_t *j = &msg->job_array[i];
+    if (strlen (path) >= len)
+        return (-1);
+    strcpy (buf, path);
+    if (!(p = strrchr (buf, '/')) || p == buf)
+        return (-1);
+    *p = '\0';
+    return (0);
+}
 
-        if (j->job_id == jobid && j->job_state == JOB_RUNNING) 
-            return (1);
-    }
+/*
+ *  Drop the ledger entry for the parent of cpuset [path] after
+ *   [path] was removed or shrunk.
+ */
+void used_cpus_invalidate (const char *path)
+{
+    char parent [4096];
 
-    return (0);
+    if (parent_path (path, parent, sizeof (parent)) == 0)
+        cpuset_ledger_invalidate (parent);
 }
 
-int cpuset_ntasks (const char *path)
+/*
+ *  Add [cpus] to the ledger entry for the parent of cpuset [path]
+ *   after [created] sibling cpusets including [path] were created,
+ *   or [path] was grown (created = 0).
+ */
+void used_cpus_add (const char *path, const struct bitmask *cpus, int created)
 {
-    struct cpuset_pidlist *pids;
-    int n;
-   
-    if ((pids = cpuset_init_pidlist (path, 0)) == NULL) {
-        cpuset_error ("cpuset_init_pidlist %s: %m", path);
-        return (-1);
-    }
+    char parent [4096];
 
-    n = cpuset_pidlist_length (pids);
+    if (parent_path (path, parent, sizeof (parent)) == 0)
+        cpuset_ledger_update (parent, cpus, created);
+}
 
-    cpuset_freepidlist (pids);
+static int slurm_jobid_is_valid (cpuset_conf_t cf, int jobid)
+{
+    cpuset_debug ("slurm_jobid_is_valid (%d)\n", jobid);
+
+    /*
+     *  If the controller can't be reached, for safety mark 
+     *   the job as valid.
+     */
+    return (job_cache_lookup (cf, jobid, NULL) != 0);
+}
+
+int cpuset_ntasks (const char *name)
+{
+    int n;
+   
+    if ((n = backend_pids (name, NULL)) < 0)
+        cpuset_error ("Failed to list tasks in %s: %m", name);
 
     return (n);
 }
 
-int slurm_cpuset_clean_path (const char *path)
+int slurm_cpuset_clean_path (cpuset_conf_t cf, const char *path)
 {
     int userid;
     int jobid;
@@ -303,49 +302,93 @@ int slurm_cpuset_clean_path (const char *path)
         char user_cpuset [128];
         snprintf (user_cpuset, sizeof (user_cpuset), "/slurm/%d", userid);
         if ((cpuset_ntasks (user_cpuset) > 0) && 
-            slurm_jobid_is_valid (jobid))
+            slurm_jobid_is_valid (cf, jobid))
             return (0);
     }
 
-    rmdir (path);
+    if (rmdir (path) == 0)
+        used_cpus_invalidate (path);
     return (0);
 }
 
-int slurm_cpuset_clean (cpuset_conf_t cf)
+int cpuset_walk (const char *path, 
+        int (*fn) (const char *path, void *arg), void *arg)
 {
-    struct cpuset_fts_tree *fts;
-    const struct cpuset_fts_entry *entry;
+    DIR *dirp;
+    struct dirent *dp;
 
-    if (!(fts = cpuset_fts_open ("/slurm")))
+    if ((dirp = opendir (path)) == NULL)
         return (-1);
-    /*
-     *  Reverse cpuset fts tree so that child cpusets
-     *   are returned before parents. This is important
-     *   because a cpuset can seemingly only be removed
-     *   after all its children have been removed.
-     */
 
-    cpuset_fts_reverse (fts);
+    while ((dp = readdir (dirp))) {
+        char child [4096];
+        int n;
 
-    while ((entry = cpuset_fts_read (fts))) {
-        const char *name = cpuset_fts_get_path (entry);
+        if (*dp->d_name == '.' || dp->d_type != DT_DIR)
+            continue;
 
+        n = snprintf (child, sizeof (child), "%s/%s", path, dp->d_name);
+        if ((n < 0) || (n >= sizeof (child)))
+            continue;
 
-        if (strcmp (name, "/slurm") != 0) {
-            char path [4096];
-            snprintf (path, sizeof (path), "/dev/cpuset%s", name);
-            cpuset_debug ("clean: %s\n", name);
-            slurm_cpuset_clean_path (path);
-        }
+        cpuset_walk (child, fn, arg);
+        fn (child, arg);
     }
+    closedir (dirp);
+
+    return (0);
+}
+
+static int clean_one (const char *path, void *arg)
+{
+    cpuset_debug ("clean: %s\n", cpuset_path_to_name (path));
+    return (slurm_cpuset_clean_path ((cpuset_conf_t) arg, path));
+}
+
+int slurm_cpuset_clean (cpuset_conf_t cf)
+{
+    char path [4096];
 
-    cpuset_fts_close (fts);
+    /*
+     *  Children are visited before their parents, since a cpuset
+     *   can only be removed after all its children have been removed.
+     */
+    snprintf (path, sizeof (path), "%s/slurm", backend_root ());
+    if (cpuset_walk (path, clean_one, cf) < 0)
+        return (-1);
 
     update_user_cpusets (cf);
 
     return (0);
 }
 
+int cpuset_cleaner_notify (const char *name)
+{
+    int fd;
+
+    /*
+     *  Opening a FIFO for write with O_NONBLOCK fails with ENXIO
+     *   if there is no reader, i.e. no cleaner is running.
+     */
+    if ((fd = open (CPUSET_CLEANER_FIFO, O_WRONLY|O_NONBLOCK)) < 0)
+        return (-1);
+
+    if (name) {
+        char buf [PIPE_BUF];
+        int n = snprintf (buf, sizeof (buf), "%s\n", name);
+        /*
+         *  Writes of up to PIPE_BUF bytes are atomic. If the FIFO is
+         *   full the cleaner is already behind and will rescan
+         *   everything anyway, so a failed write is not an error.
+         */
+        if (n > 0 && n < sizeof (buf) && write (fd, buf, n) < 0)
+            cpuset_debug ("cleaner notify %s: %m\n", name);
+    }
+
+    close (fd);
+    return (0);
+}
+
 static int do_cpuset_lock (const char *name)
 {
     int fd;
@@ -394,7 +437,27 @@ int slurm_cpuset_lock (void)
 
 int slurm_cpuset_unlock (int fd)
 {
-    return (do_cpuset_unlock (fd));
+    int rc = do_cpuset_unlock (fd);
+
+    /*
+     *  Now that the global lock is dropped, retry any user cpuset
+     *   updates that failed with EBUSY while it was held.
+     */
+    user_cpuset_retry_deferred ();
+
+    return (rc);
+}
+
+int user_cpuset_lock (uid_t uid)
+{
+    char name [64];
+    snprintf (name, sizeof (name), "slurm-%d", uid);
+    return (do_cpuset_lock (name));
+}
+
+void user_cpuset_unlock (int fd)
+{
+    do_cpuset_unlock (fd);
 }
 
 /*
@@ -403,12 +466,9 @@ int slurm_cpuset_unlock (int fd)
  */
 static int create_and_lock_cpuset_dir (cpuset_conf_t cf, const char *name)
 {
-    char path [1024] = "/dev/cpuset";
-    struct cpuset *cp;
+    struct bitmask *cpus, *mems;
     int fd;
-    mode_t oldmask = umask (022);
-
-    strncat (path, name, sizeof (path));
+    int rc;
 
     cpuset_debug2 ("create_and_lock_cpuset_dir (%s)\n", name);
 
@@ -416,45 +476,48 @@ static int create_and_lock_cpuset_dir (cpuset_conf_t cf, const char *name)
      *  First grab cpuset lock from /var/lock:
      */
     if ((fd = do_cpuset_lock (name)) < 0) {
-        cpuset_error ("Failed to lock %s: %m", path);
+        cpuset_error ("Failed to lock %s: %m", name);
         return (-1);
     }
 
-    if ((mkdir (path, 0755)) < 0) {
-        /* If mkdir fails with EEXIST, then slurm cpuset already
-         *  exists and we can simply return lockfd after ensuring
-         *  the cpuset is "clean"
+    if ((rc = backend_create (name)) < 0) {
+        cpuset_error ("create %s%s: %m", backend_root (), name);
+        do_cpuset_unlock (fd);
+        return (-1);
+    }
+    else if (rc == 0) {
+        /*
+         *  If the slurm cpuset already exists, we can simply return
+         *   lockfd after ensuring the cpuset is "clean". Leave garbage
+         *   collection to the background cleaner if one is running,
+         *   otherwise clean up synchronously.
          */
-        umask (oldmask);
-        if (errno == EEXIST) {
+        if (cpuset_cleaner_notify (NULL) < 0)
             slurm_cpuset_clean (cf);
-            return (fd);
-        }
-        else {
-            cpuset_error ("mkdir %s: %m", path);
-            return (-1);
-        }
+        return (fd);
     } 
-    umask (oldmask);
 
     /*
      *  Initialize SLURM cpuset with all CPUs and MEMs:
      */
-    cp = cpuset_alloc ();
-    if (cpuset_query (cp, "/") < 0) {
+    cpus = bitmask_alloc (cpumask_size ());
+    mems = bitmask_alloc (memmask_size ());
+    if (backend_getcpus ("/", cpus) < 0 || backend_getmems ("/", mems) < 0) {
         cpuset_error ("Failed to query root cpuset: %m");
-        return (-1);
+        rc = -1;
     }
+    else {
+        cpuset_debug2 ("modifying %s cpuset\n", name);
+        if ((rc = backend_set (name, cpus, mems, 0)) < 0)
+            cpuset_error ("Failed to modify %s cpuset: %m", name);
+    }
+    bitmask_free (cpus);
+    bitmask_free (mems);
 
-    cpuset_debug2 ("modifying %s cpuset\n", name);
-
-    if (cpuset_modify (name, cp) < 0) {
-        cpuset_error ("Failed to modify %s cpuset: %m", name);
+    if (rc < 0) {
+        do_cpuset_unlock (fd);
         return (-1);
     }
-
-    cpuset_free (cp);
-
     return (fd);
 }
 
@@ -38,6 +38,12 @@
 int cpumask_size (void);
 int memmask_size (void);
 
+/*
+ *  Locking is two-level: the global slurm cpuset lock covers CPU
+ *   accounting and allocation, and a per-uid lock covers modification
+ *   of the user cpuset /slurm/UID and the job cpusets created in it.
+ *   When both are needed, the global lock must be taken first.
+ */
 int slurm_cpuset_lock (void);
 int slurm_cpuset_unlock (int fd);
 
@@ -45,14 +51,36 @@ int user_cpuset_lock (uid_t uid);
 void user_cpuset_unlock (int fd);
 
 void print_current_cpuset_info ();
-void print_cpuset_info (const char *path, struct cpuset *cp);
+void print_cpuset_info (const char *name);
 
 void print_bitmask (const char * fmt, const struct bitmask *b);
 
 struct bitmask *used_cpus_bitmask_path (char *path, int clearall);
+void used_cpus_add (const char *path, const struct bitmask *cpus, int created);
+void used_cpus_invalidate (const char *path);
 
 int slurm_cpuset_create (cpuset_conf_t conf);
-int slurm_cpuset_clean_path (const char *path);
+int slurm_cpuset_clean (cpuset_conf_t conf);
+int slurm_cpuset_clean_path (cpuset_conf_t conf, const char *path);
+
+/*
+ *  Call [fn] on every cpuset below directory [path], children
+ *   before their parents.
+ */
+int cpuset_walk (const char *path, 
+        int (*fn) (const char *path, void *arg), void *arg);
+
+/*
+ *  FIFO on which the background cleaner (cpuset_release_agent -d)
+ *   receives the names of released cpusets.
+ */
+#define CPUSET_CLEANER_FIFO "/var/run/slurm-cpuset-cleaner.fifo"
+
+/*
+ *  Send cpuset [name] to the background cleaner, or just check that
+ *   it is running if [name] is NULL. Returns -1 if no cleaner is running.
+ */
+int cpuset_cleaner_notify (const char *name);
 
 int str2int (const char *str);
 
@@ -0,0 +1,155 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "strbuf.h"
+
+#define STRBUF_MINSIZE 64
+
+struct strbuf {
+    char * buf;
+    size_t len;     /* Length of string in buf, excluding NUL */
+    size_t size;    /* Allocated size of buf                  */
+};
+
+strbuf_t strbuf_create (void)
+{
+    strbuf_t sb = malloc (sizeof (*sb));
+
+    if (sb == NULL)
+        return (NULL);
+
+    if ((sb->buf = malloc (STRBUF_MINSIZE)) == NULL) {
+        free (sb);
+        return (NULL);
+    }
+    sb->buf[0] = '\0';
+    sb->len = 0;
+    sb->size = STRBUF_MINSIZE;
+
+    return (sb);
+}
+
+void strbuf_destroy (strbuf_t sb)
+{
+    if (sb == NULL)
+        return;
+    free (sb->buf);
+    free (sb);
+}
+
+/*
+ *  Ensure there is room for [n] more characters plus NUL in [sb],
+ *   doubling the buffer size as necessary.
+ */
+static int strbuf_reserve (strbuf_t sb, size_t n)
+{
+    size_t size = sb->size;
+    char *buf;
+
+    if (sb->len + n + 1 <= size)
+        return (0);
+
+    while (sb->len + n + 1 > size)
+        size *= 2;
+
+    if ((buf = realloc (sb->buf, size)) == NULL)
+        return (-1);
+
+    sb->buf = buf;
+    sb->size = size;
+    return (0);
+}
+
+int strbuf_append (strbuf_t sb, const char *str)
+{
+    size_t n = strlen (str);
+
+    if (strbuf_reserve (sb, n) < 0)
+        return (-1);
+
+    memcpy (sb->buf + sb->len, str, n + 1);
+    sb->len += n;
+    return (0);
+}
+
+int strbuf_appendf (strbuf_t sb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start (ap, fmt);
+    n = vsnprintf (sb->buf + sb->len, sb->size - sb->len, fmt, ap);
+    va_end (ap);
+
+    if (n < 0)
+        return (-1);
+
+    if (sb->len + n + 1 > sb->size) {
+        if (strbuf_reserve (sb, n) < 0) {
+            sb->buf[sb->len] = '\0';
+            return (-1);
+        }
+        va_start (ap, fmt);
+        n = vsnprintf (sb->buf + sb->len, sb->size - sb->len, fmt, ap);
+        va_end (ap);
+        if (n < 0)
+            return (-1);
+    }
+
+    sb->len += n;
+    return (0);
+}
+
+const char * strbuf_str (strbuf_t sb)
+{
+    return (sb->buf);
+}
+
+size_t strbuf_len (strbuf_t sb)
+{
+    return (sb->len);
+}
+
+char * strbuf_steal (strbuf_t sb)
+{
+    char *str;
+
+    if (sb == NULL)
+        return (NULL);
+
+    str = sb->buf;
+    free (sb);
+    return (str);
+}
+
+/* vi: ts=4 sw=4 expandtab
+ */
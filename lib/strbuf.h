@@ -0,0 +1,77 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2026 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#ifndef _STRBUF_H
+#define _STRBUF_H
+
+#include <stddef.h>
+
+/*
+ *  Growable string buffer. Appending is amortized linear in the
+ *   length of the appended string.
+ */
+typedef struct strbuf * strbuf_t;
+
+strbuf_t strbuf_create (void);
+/*
+ *  Create a new, empty string buffer. Returns NULL on failure.
+ */
+
+void strbuf_destroy (strbuf_t sb);
+/*
+ *  Free string buffer [sb] and its contents.
+ */
+
+int strbuf_append (strbuf_t sb, const char *str);
+/*
+ *  Append [str] to [sb]. Returns 0 on success, -1 on failure.
+ */
+
+int strbuf_appendf (strbuf_t sb, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+/*
+ *  Append printf-style formatted output to [sb].
+ *  Returns 0 on success, -1 on failure.
+ */
+
+const char * strbuf_str (strbuf_t sb);
+/*
+ *  Return the current contents of [sb]. The string is owned by [sb]
+ *   and is invalidated by the next append.
+ */
+
+size_t strbuf_len (strbuf_t sb);
+/*
+ *  Return the length of the string in [sb].
+ */
+
+char * strbuf_steal (strbuf_t sb);
+/*
+ *  Destroy [sb] and return its contents as a malloc'd string, which
+ *   the caller must free. Returns NULL on failure.
+ */
+
+#endif /* !_STRBUF_H */
+
+/* vi: ts=4 sw=4 expandtab
+ */
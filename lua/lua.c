@@ -23,14 +23,24 @@
  ****************************************************************************/
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dlfcn.h>
 #include <glob.h>
 #include <setjmp.h> /* need longjmp for lua_atpanic */
+#include <time.h>
+#include <syslog.h>
 #include <libgen.h> /* basename(3) */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <slurm/spank.h>
@@ -44,6 +54,10 @@
 #define LIBLUA_DSO "liblua.so"
 #endif
 
+#ifndef LUA_CACHE_DIR
+#define LUA_CACHE_DIR "/var/cache/spank-lua"
+#endif
+
 SPANK_PLUGIN (lua, 1)
 
 /*  Name of spank_t lightuserdata reference in
@@ -57,6 +71,18 @@ SPANK_PLUGIN (lua, 1)
 #define LFORMATTER "string.format(table.unpack({...}))"
 #endif /* LUA_VERSION <= 5.1 */
 
+#if LUA_VERSION_NUM >= 503
+#define lua_dump_chunk(L,w,d) lua_dump ((L), (w), (d), 0)
+#else
+#define lua_dump_chunk(L,w,d) lua_dump ((L), (w), (d))
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#define lua_load_chunk(L,b,n,name) luaL_loadbufferx ((L), (b), (n), (name), "b")
+#else
+#define lua_load_chunk(L,b,n,name) luaL_loadbuffer ((L), (b), (n), (name))
+#endif
+
 /*
  *  This module keeps a list of options provided by the lua
  *   script so that it can easily map the option val (s_opt.val)
@@ -80,6 +106,43 @@ struct lua_script_option {
 static lua_State *global_L = NULL;
 static List script_option_list = NULL;
 
+/*
+ *  Allocator of the global Lua state, wrapped to count allocations
+ *   for SPANK.allocations() and to account memory to scripts:
+ */
+static lua_Alloc lua_alloc_orig = NULL;
+static void * lua_alloc_orig_ud = NULL;
+static unsigned long lua_alloc_count = 0;
+static size_t lua_mem_inuse = 0;    /* Bytes allocated by Lua            */
+static size_t lua_mem_base = 0;     /* lua_mem_inuse at start of call    */
+static size_t lua_mem_peak = 0;     /* Peak lua_mem_inuse during call    */
+static unsigned long lua_insns = 0; /* Instructions executed during call */
+
+/*
+ *  Instructions between calls of the count hook:
+ */
+#define LUA_HOOK_INTERVAL 1000
+
+/*
+ *  Latency profile of one callback or SPANK.profile() span in a script.
+ *   Bucket i of the histogram counts latencies below 2^i usec.
+ */
+#define LUA_PROFILE_BUCKETS 40
+
+struct lua_profile {
+    char *name;             /* Callback or span name          */
+    unsigned long count;    /* Number of calls                */
+    double total;           /* Total wall time in seconds     */
+    double max;             /* Longest call in seconds        */
+    unsigned long hist [LUA_PROFILE_BUCKETS];
+};
+
+/*
+ *  Where to dump profiles at exit: NULL (profiling disabled),
+ *   "" for the SLURM log, "syslog", or a file name.
+ */
+static const char *profile_dest = NULL;
+
 /*
  *  Structure describing an individual lua script
  *   and a list of such scripts
@@ -89,15 +152,171 @@ struct lua_script {
     lua_State *L;       /* Copy of global Lua state */
     int env_ref;        /* reference for _ENV table */
     int fail_on_error;
+    const char *cache_dir; /* bytecode cache directory or NULL */
+    struct stat st;     /* Script stat, valid if have_stat is set */
+    int have_stat;
+    int indexed;        /* callbacks is valid */
+    unsigned callbacks; /* Callback index bits, see spank_callbacks[] */
+    int spank_ref;      /* reference for cached spank table */
+    char *index_args;   /* Script args, part of the callback index key */
+
+    size_t max_mem;     /* Memory budget per call in bytes, 0 = none */
+    unsigned long max_insns; /* Instruction budget per call, 0 = none */
+    unsigned long ncalls;    /* Calls into this script */
+    double cpu_time;    /* CPU seconds spent in this script */
+    size_t mem_peak;    /* Peak memory growth during a call */
+    List profile;       /* List of struct lua_profile, or NULL */
 };
 List lua_script_list = NULL;
 
+/*
+ *  Script currently executing, to which allocations are charged:
+ */
+static struct lua_script *lua_current = NULL;
+
 /*
  *  Tell lua_atpanic where to longjmp on exceptions:
  */
 static jmp_buf panicbuf;
 static int spank_atpanic (lua_State *L) { longjmp (panicbuf, 0); }
 
+/*
+ *  Lua allocator wrapper. Growth is refused once the current script
+ *   exceeds its memory budget, which Lua raises as a memory error
+ *   in that script.
+ */
+static void * lua_alloc_counted (void *ud, void *ptr, size_t osize,
+        size_t nsize)
+{
+    /*  When ptr is NULL, osize is an object type, not a size */
+    size_t old = ptr ? osize : 0;
+    void *p;
+
+    if (nsize > old) {
+        lua_alloc_count++;
+        if (lua_current && lua_current->max_mem
+            && lua_mem_inuse + (nsize - old) > 
+               lua_mem_base + lua_current->max_mem)
+            return (NULL);
+    }
+
+    p = (*lua_alloc_orig) (lua_alloc_orig_ud, ptr, osize, nsize);
+    if (p == NULL && nsize > 0)
+        return (NULL);
+
+    lua_mem_inuse = lua_mem_inuse - old + nsize;
+    if (lua_mem_inuse > lua_mem_peak)
+        lua_mem_peak = lua_mem_inuse;
+    return (p);
+}
+
+static void lua_count_hook (lua_State *L, lua_Debug *ar)
+{
+    if (lua_current == NULL || lua_current->max_insns == 0)
+        return;
+    lua_insns += LUA_HOOK_INTERVAL;
+    if (lua_insns > lua_current->max_insns)
+        luaL_error (L, "instruction budget of %lu exceeded",
+                    lua_current->max_insns);
+}
+
+static double timespec_diff (struct timespec *t1, struct timespec *t0)
+{
+    return ((t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+static void lua_profile_destroy (struct lua_profile *p)
+{
+    free (p->name);
+    free (p);
+}
+
+static int lua_profile_find (struct lua_profile *p, const char *name)
+{
+    return (strcmp (p->name, name) == 0);
+}
+
+static int lua_profile_bucket (double t)
+{
+    unsigned long usec = t * 1e6;
+    int i = 0;
+
+    while (usec && i < LUA_PROFILE_BUCKETS - 1) {
+        usec >>= 1;
+        i++;
+    }
+    return (i);
+}
+
+/*
+ *  Add a call to [name] taking [t] seconds to the profile of script [s]
+ */
+static void lua_profile_add (struct lua_script *s, const char *name, double t)
+{
+    struct lua_profile *p;
+
+    if (s->profile == NULL) {
+        if (profile_dest == NULL)
+            return;
+        s->profile = list_create ((ListDelF) lua_profile_destroy);
+    }
+
+    p = list_find_first (s->profile, (ListFindF) lua_profile_find,
+                         (void *) name);
+    if (p == NULL) {
+        if (!(p = calloc (1, sizeof (*p))) || !(p->name = strdup (name))) {
+            free (p);
+            return;
+        }
+        list_append (s->profile, p);
+    }
+
+    p->count++;
+    p->total += t;
+    if (t > p->max)
+        p->max = t;
+    p->hist [lua_profile_bucket (t)]++;
+}
+
+static double monotonic_time (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ *  lua_pcall() into script [s], enforcing its memory and instruction
+ *   budgets and accounting CPU time and peak memory to it.
+ */
+static int lua_script_pcall (struct lua_script *s, int nargs, int nresults)
+{
+    struct lua_script *prev = lua_current;
+    struct timespec t0, t1;
+    int rc;
+
+    lua_current = s;
+    lua_mem_base = lua_mem_peak = lua_mem_inuse;
+    lua_insns = 0;
+    if (s->max_insns)
+        lua_sethook (s->L, lua_count_hook, LUA_MASKCOUNT, LUA_HOOK_INTERVAL);
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &t0);
+    rc = lua_pcall (s->L, nargs, nresults, 0);
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &t1);
+
+    if (s->max_insns)
+        lua_sethook (s->L, NULL, 0, 0);
+
+    s->ncalls++;
+    s->cpu_time += timespec_diff (&t1, &t0);
+    if (lua_mem_peak - lua_mem_base > s->mem_peak)
+        s->mem_peak = lua_mem_peak - lua_mem_base;
+
+    lua_current = prev;
+    return (rc);
+}
+
 /*
  *  Lua scripts pass string versions of spank_item_t to get/set_time.
  *   This table maps the name to item and vice versa.
@@ -592,7 +811,7 @@ static int lua_spank_option_callback (int val, const char *optarg, int remote)
             o->script->path, o->l_function, o->s_opt.name,
             optarg ? optarg : "nil");
 
-    if (lua_pcall (L, 3, 1, 0) != 0) {
+    if (lua_script_pcall (o->script, 3, 1) != 0) {
         slurm_error ("Failed to call lua callback function %s: %s",
                     o->l_function, lua_tostring (L, -1));
         lua_pop (L, 1);
@@ -790,34 +1009,32 @@ static int l_spank_option_getopt (lua_State *L)
 
 
 
-static int l_spank_context (lua_State *L)
+static const char * spank_context_name (void)
 {
     switch (spank_context ()) {
     case S_CTX_LOCAL:
-        lua_pushstring (L, "local");
-        break;
+        return ("local");
     case S_CTX_REMOTE:
-        lua_pushstring (L, "remote");
-        break;
+        return ("remote");
     case S_CTX_ALLOCATOR:
-        lua_pushstring (L, "allocator");
-        break;
+        return ("allocator");
 #if HAVE_S_CTX_SLURMD
     case S_CTX_SLURMD:
-        lua_pushstring (L, "slurmd");
-        break;
+        return ("slurmd");
 #endif
 #if HAVE_S_CTX_JOB_SCRIPT
     case S_CTX_JOB_SCRIPT:
-        lua_pushstring (L, "job_script");
-        break;
+        return ("job_script");
 #endif
     case S_CTX_ERROR:
     default:
-        lua_pushstring (L, "error");
-        break;
+        return ("error");
     }
+}
 
+static int l_spank_context (lua_State *L)
+{
+    lua_pushstring (L, spank_context_name ());
     return (1);
 }
 
@@ -889,10 +1106,30 @@ static int lua_spank_table_create (lua_State *L, spank_t sp, int ac, char **av)
     return (0);
 }
 
+/*
+ *  Push the spank table for script [s] and point its handle at [sp].
+ *   The table is created on first use and then reused for every
+ *   callback, so that calls into the script do not allocate. Each
+ *   script gets its own table so scripts cannot affect each other.
+ */
+static void lua_spank_table_push (struct lua_script *s, spank_t sp,
+        int ac, char **av)
+{
+    if (s->spank_ref == LUA_NOREF) {
+        lua_spank_table_create (s->L, sp, ac, av);
+        s->spank_ref = luaL_ref (s->L, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti (s->L, LUA_REGISTRYINDEX, s->spank_ref);
+    lua_pushlightuserdata (s->L, sp);
+    lua_setfield (s->L, -2, SPANK_REFNAME);
+}
+
 static int lua_spank_call (struct lua_script *s, spank_t sp, const char *fn,
         int ac, char **av)
 {
     struct lua_State *L = s->L;
+    double t0;
+    int rc;
     /*
      * Missing functions are not an error
      */
@@ -903,11 +1140,16 @@ static int lua_spank_call (struct lua_script *s, spank_t sp, const char *fn,
     }
 
     /*
-     * Create spank object to pass to spank functions
+     * Get spank object to pass to spank functions
      */
-    lua_spank_table_create (L, sp, ac, av);
+    lua_spank_table_push (s, sp, ac, av);
 
-    if (lua_pcall (L, 1, 1, 0)) {
+    t0 = profile_dest ? monotonic_time () : 0.;
+    rc = lua_script_pcall (s, 1, 1);
+    if (profile_dest)
+        lua_profile_add (s, fn, monotonic_time () - t0);
+
+    if (rc) {
         slurm_error ("spank/lua: %s: %s", fn, lua_tostring (L, -1));
         return (s->fail_on_error ? -1 : 0);
     }
@@ -972,12 +1214,53 @@ static int l_spank_log_msg (lua_State *L)
     return (0);
 }
 
+/*
+ *  Return the number of allocations (including growing reallocations)
+ *   made by Lua so far in this process.
+ */
+static int l_spank_allocations (lua_State *L)
+{
+    lua_pushnumber (L, (lua_Number) lua_alloc_count);
+    return (1);
+}
+
+/*
+ *  SPANK.profile (name, fn, ...): Call fn (...) and add its wall time
+ *   as span [name] to the current script's profile. Returns the results
+ *   of fn. Errors in fn are propagated, and the span is not recorded.
+ */
+static int l_spank_profile (lua_State *L)
+{
+    struct lua_script *s = lua_current;
+    const char *name = luaL_checkstring (L, 1);
+    double t0;
+    int base;
+
+    if (!lua_isfunction (L, 2))
+        return luaL_error (L, "SPANK.profile: expected function argument");
+
+    /*  Keep the name below the function so it is not collected */
+    base = 2;
+    t0 = profile_dest ? monotonic_time () : 0.;
+    lua_call (L, lua_gettop (L) - base, LUA_MULTRET);
+    if (profile_dest && s)
+        lua_profile_add (s, name, monotonic_time () - t0);
+
+    return (lua_gettop (L) - (base - 1));
+}
+
 static int SPANK_table_create (lua_State *L)
 {
     lua_newtable (L);
     lua_pushcfunction (L, l_spank_log_msg);
     lua_setfield (L, -2, "_log_msg");
 
+    lua_pushcfunction (L, l_spank_allocations);
+    lua_setfield (L, -2, "allocations");
+
+    lua_pushcfunction (L, l_spank_profile);
+    lua_setfield (L, -2, "profile");
+
     /*
      *  Create more user-friendly lua versions of SLURM log functions
      *   with lua.
@@ -1057,6 +1340,18 @@ static struct lua_script * lua_script_create (lua_State *L, const char *path)
     script->path = strdup (path);
     script->L = L; /* copy of global state */
     script->fail_on_error = 0;
+    script->cache_dir = NULL;
+    script->have_stat = (stat (path, &script->st) == 0);
+    script->indexed = 0;
+    script->callbacks = 0;
+    script->spank_ref = LUA_NOREF;
+    script->index_args = NULL;
+    script->max_mem = 0;
+    script->max_insns = 0;
+    script->ncalls = 0;
+    script->cpu_time = 0.;
+    script->mem_peak = 0;
+    script->profile = NULL;
 
     /*  New globals table/_ENV for this chunk */
     lua_newtable (script->L);
@@ -1086,8 +1381,12 @@ static struct lua_script * lua_script_create (lua_State *L, const char *path)
 static void lua_script_destroy (struct lua_script *s)
 {
     free (s->path);
+    free (s->index_args);
+    if (s->profile)
+        list_destroy (s->profile);
     if (s->L) {
         luaL_unref (s->L, LUA_REGISTRYINDEX, s->env_ref);
+        luaL_unref (s->L, LUA_REGISTRYINDEX, s->spank_ref);
         s->L = NULL;
     }
     /* Only call lua_close() on the main lua state  */
@@ -1172,20 +1471,88 @@ static int spank_lua_options_table_register (List script_list, spank_t sp)
 
 struct spank_lua_options {
     unsigned fail_on_error:1;
+    const char *cache_dir;
+    size_t max_mem;
+    unsigned long max_insns;
+    const char *profile;
 };
 
+/*
+ *  Convert [str] with optional K, M or G suffix to bytes.
+ *   Returns -1 on error.
+ */
+static int str2bytes (const char *str, size_t *bytesp)
+{
+    char *p;
+    unsigned long n;
+
+    if (!isdigit (*str))
+        return (-1);
+    errno = 0;
+    if ((n = strtoul (str, &p, 10)) == ULONG_MAX && errno == ERANGE)
+        return (-1);
+
+    switch (*p) {
+        case 'G': case 'g': n *= 1024; /* fall through */
+        case 'M': case 'm': n *= 1024; /* fall through */
+        case 'K': case 'k': n *= 1024; p++; /* fall through */
+        case '\0':
+            break;
+        default:
+            return (-1);
+    }
+    if (p == str || *p != '\0')
+        return (-1);
+    *bytesp = n;
+    return (0);
+}
+
 static int spank_lua_process_args (int *ac, char **argvp[],
         struct spank_lua_options *opt)
 {
+    opt->fail_on_error = 0;
+    opt->cache_dir = LUA_CACHE_DIR;
+    opt->max_mem = 0;
+    opt->max_insns = 0;
+    opt->profile = NULL;
+
     /*
      *  Advance argv past any spank/lua options. The rest of the
      *   args are the script/glob and script arguments.
      *
-     *  For now, the only supported spank/lua arg is 'failonerror'
-     *   so this must appear in argv[0]
+     *  Supported spank/lua args are 'failonerror', 'nocache',
+     *   'cachedir=DIR', 'maxmem=SIZE', 'maxinstructions=N' and
+     *   'profile[=DEST]', which must precede the script/glob.
      */
-    if (strcmp ((*argvp)[0], "failonerror") == 0) {
-        opt->fail_on_error = 1;
+    while (*ac > 0) {
+        const char *arg = (*argvp)[0];
+        if (strcmp (arg, "failonerror") == 0)
+            opt->fail_on_error = 1;
+        else if (strcmp (arg, "nocache") == 0)
+            opt->cache_dir = NULL;
+        else if (strncmp (arg, "cachedir=", 9) == 0)
+            opt->cache_dir = arg + 9;
+        else if (strncmp (arg, "maxmem=", 7) == 0) {
+            if (str2bytes (arg + 7, &opt->max_mem) < 0) {
+                slurm_error ("spank/lua: Invalid %s", arg);
+                return (-1);
+            }
+        }
+        else if (strncmp (arg, "maxinstructions=", 16) == 0) {
+            char *p;
+            errno = 0;
+            opt->max_insns = strtoul (arg + 16, &p, 10);
+            if (!isdigit (arg[16]) || *p != '\0' || errno == ERANGE) {
+                slurm_error ("spank/lua: Invalid %s", arg);
+                return (-1);
+            }
+        }
+        else if (strcmp (arg, "profile") == 0)
+            opt->profile = "";
+        else if (strncmp (arg, "profile=", 8) == 0)
+            opt->profile = arg + 8;
+        else
+            break;
         (*ac)--;
         (*argvp)++;
     }
@@ -1202,39 +1569,436 @@ static void print_lua_script_error (struct lua_script *script)
         slurm_info ("spank/lua: Disabling %s: %s", s, err);
 }
 
+/*
+ *  SPANK callbacks which may be defined by a script, in the order of
+ *   their bits in the callback index (lua_script->callbacks).
+ */
+static const char * spank_callbacks [] = {
+    "slurm_spank_init",
+    "slurm_spank_slurmd_init",
+    "slurm_spank_job_prolog",
+    "slurm_spank_init_post_opt",
+    "slurm_spank_local_user_init",
+    "slurm_spank_user_init",
+    "slurm_spank_task_init_privileged",
+    "slurm_spank_task_init",
+    "slurm_spank_task_post_fork",
+    "slurm_spank_task_exit",
+    "slurm_spank_job_epilog",
+    "slurm_spank_exit",
+    "slurm_spank_slurmd_exit",
+    NULL
+};
+
+/*
+ *  Index bit set for scripts with a global spank_options table, which
+ *   must be loaded in contexts where options are registered.
+ */
+#define LUA_INDEX_OPTIONS (1U << 31)
+
+static unsigned spank_callback_bit (const char *name)
+{
+    int i;
+    for (i = 0; spank_callbacks[i]; i++)
+        if (strcmp (spank_callbacks[i], name) == 0)
+            return (1U << i);
+    return (0);
+}
+
+/*
+ *  Return the callback index bits for the globals defined by the
+ *   loaded script [s].
+ */
+static unsigned lua_script_callbacks (struct lua_script *s)
+{
+    unsigned mask = 0;
+    int i;
+
+    for (i = 0; spank_callbacks[i]; i++) {
+        lua_script_getglobal (s, spank_callbacks[i]);
+        if (!lua_isnil (s->L, -1))
+            mask |= (1U << i);
+        lua_pop (s->L, 1);
+    }
+
+    lua_script_getglobal (s, "spank_options");
+    if (!lua_isnil (s->L, -1))
+        mask |= LUA_INDEX_OPTIONS;
+    lua_pop (s->L, 1);
+
+    return (mask);
+}
+
+static unsigned spank_callback_bits (const char **names)
+{
+    unsigned mask = 0;
+    for (; *names; names++)
+        mask |= spank_callback_bit (*names);
+    return (mask);
+}
+
+/*
+ *  Return the callback index bits for the callbacks which may be
+ *   called in the current context, including LUA_INDEX_OPTIONS where
+ *   options are registered.
+ */
+static unsigned spank_context_callbacks (void)
+{
+    static const char *local [] = {
+        "slurm_spank_init", "slurm_spank_init_post_opt",
+        "slurm_spank_local_user_init", "slurm_spank_exit", NULL
+    };
+    static const char *remote [] = {
+        "slurm_spank_init", "slurm_spank_init_post_opt",
+        "slurm_spank_user_init", "slurm_spank_task_init_privileged",
+        "slurm_spank_task_init", "slurm_spank_task_post_fork",
+        "slurm_spank_task_exit", "slurm_spank_exit", NULL
+    };
+    static const char *allocator [] = {
+        "slurm_spank_init", "slurm_spank_init_post_opt",
+        "slurm_spank_exit", NULL
+    };
+#if HAVE_S_CTX_SLURMD
+    static const char *slurmd [] = {
+        "slurm_spank_slurmd_init", "slurm_spank_slurmd_exit", NULL
+    };
+#endif
+#if HAVE_S_CTX_JOB_SCRIPT
+    static const char *job_script [] = {
+        "slurm_spank_job_prolog", "slurm_spank_job_epilog", NULL
+    };
+#endif
+
+    switch (spank_context ()) {
+    case S_CTX_LOCAL:
+        return (spank_callback_bits (local) | LUA_INDEX_OPTIONS);
+    case S_CTX_REMOTE:
+        return (spank_callback_bits (remote) | LUA_INDEX_OPTIONS);
+    case S_CTX_ALLOCATOR:
+        return (spank_callback_bits (allocator) | LUA_INDEX_OPTIONS);
+#if HAVE_S_CTX_SLURMD
+    case S_CTX_SLURMD:
+        return (spank_callback_bits (slurmd));
+#endif
+#if HAVE_S_CTX_JOB_SCRIPT
+    case S_CTX_JOB_SCRIPT:
+        return (spank_callback_bits (job_script));
+#endif
+    default:
+        return (~0U);
+    }
+}
+
 static int lua_script_valid_in_context (spank_t sp, struct lua_script *script)
 {
     int valid = 1;
 
 #if HAVE_S_CTX_SLURMD
     if (spank_context() == S_CTX_SLURMD) {
-        lua_script_getglobal (script, "slurm_spank_slurmd_init");
-        lua_script_getglobal (script, "slurm_spank_slurmd_exit");
-        if (lua_isnil (script->L, -1) && lua_isnil (script->L, -2))
+        if (!(script->callbacks & (spank_callback_bit ("slurm_spank_slurmd_init")
+                                 | spank_callback_bit ("slurm_spank_slurmd_exit"))))
             valid = 0;
-        lua_pop (script->L, 2);
     }
 #endif
 #if HAVE_S_CTX_JOB_SCRIPT
     if (spank_context() == S_CTX_JOB_SCRIPT) {
-        lua_script_getglobal (script, "slurm_spank_job_prolog");
-        lua_script_getglobal (script, "slurm_spank_job_epilog");
-        if (lua_isnil (script->L, -1) && lua_isnil (script->L, -2))
+        if (!(script->callbacks & (spank_callback_bit ("slurm_spank_job_prolog")
+                                 | spank_callback_bit ("slurm_spank_job_epilog"))))
             valid = 0;
-        lua_pop (script->L, 2);
     }
 #endif
 
     return (valid);
 }
 
+/*
+ *  Bytecode cache and callback index:
+ *
+ *  Compiled chunks are saved with lua_dump() under the cache directory,
+ *   one file per script, named after the script path with '/' replaced
+ *   by '%'. Next to each chunk, a ".<context>.idx" file records which
+ *   SPANK callbacks the script defined when run in that context with
+ *   the recorded script args, so scripts with no callbacks in a
+ *   context need not be loaded there at all. Since scripts may define
+ *   callbacks depending on context or args, an index is only used in
+ *   the context and with the args it was produced with.
+ *
+ *  Each file starts with a header recording the Lua version and the
+ *   size and mtime of the source, followed by the script path and the
+ *   data. A cache file is only used while all of these still match,
+ *   and is otherwise rebuilt from source.
+ *
+ *  Since bytecode is not verified by Lua, the cache directory and its
+ *   files must be owned by root or the current user and must not be
+ *   writable by group or others.
+ */
+#define LUA_CACHE_MAGIC "spank-lua-cache"
+
+struct lua_cache_header {
+    char     magic [16];
+    int32_t  version;        /* LUA_VERSION_NUM                       */
+    int32_t  pathlen;        /* Length of script path following header */
+    int64_t  size;           /* Size of script source                 */
+    int64_t  mtime;          /* Script mtime (seconds)                */
+    int64_t  mtime_nsec;     /* Script mtime (nanoseconds)            */
+};
+
+static void lua_cache_header_init (struct lua_cache_header *h,
+        const char *path, const struct stat *st)
+{
+    memset (h, 0, sizeof (*h));
+    memcpy (h->magic, LUA_CACHE_MAGIC, sizeof (LUA_CACHE_MAGIC));
+    h->version = LUA_VERSION_NUM;
+    h->pathlen = strlen (path);
+    h->size = st->st_size;
+    h->mtime = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ *  Return 1 if [st] describes a file or directory we may trust to
+ *   hold bytecode, i.e. owned by root or us and not writable by others.
+ */
+static int lua_cache_trusted (const struct stat *st)
+{
+    if (st->st_uid != 0 && st->st_uid != getuid ())
+        return (0);
+    return (!(st->st_mode & (S_IWGRP | S_IWOTH)));
+}
+
+static int lua_cache_path (struct lua_script *s, const char *suffix,
+        char *buf, int len)
+{
+    struct stat st;
+    const char *p;
+    int n;
+
+    if (s->cache_dir == NULL || !s->have_stat)
+        return (-1);
+
+    if (stat (s->cache_dir, &st) < 0
+        || !S_ISDIR (st.st_mode) || !lua_cache_trusted (&st))
+        return (-1);
+
+    n = snprintf (buf, len, "%s/", s->cache_dir);
+    for (p = s->path; *p && n < len - 1; p++)
+        buf [n++] = (*p == '/') ? '%' : *p;
+    if (*p || snprintf (buf + n, len - n, "%s", suffix) >= len - n)
+        return (-1);
+    return (0);
+}
+
+/*
+ *  Read cache file [suffix] for script [s]. Returns a buffer which
+ *   the caller must free, with the data following the header at
+ *   offset [*offp] and of length [*lenp], or NULL if there is no
+ *   fresh cache file.
+ */
+static char * lua_cache_read (struct lua_script *s, const char *suffix,
+        size_t *offp, size_t *lenp)
+{
+    struct lua_cache_header h;
+    struct stat cst;
+    char path [4096];
+    char *buf = NULL;
+    size_t off;
+    int fd;
+
+    if (lua_cache_path (s, suffix, path, sizeof (path)) < 0)
+        return (NULL);
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return (NULL);
+
+    if (fstat (fd, &cst) < 0 || !S_ISREG (cst.st_mode)
+        || !lua_cache_trusted (&cst) || cst.st_size < sizeof (h))
+        goto fail;
+
+    if (!(buf = malloc (cst.st_size))
+        || read (fd, buf, cst.st_size) != cst.st_size)
+        goto fail;
+
+    lua_cache_header_init (&h, s->path, &s->st);
+    off = sizeof (h) + h.pathlen;
+
+    if (memcmp (buf, &h, sizeof (h)) != 0 || cst.st_size < off
+        || memcmp (buf + sizeof (h), s->path, h.pathlen) != 0)
+        goto fail;
+
+    close (fd);
+    *offp = off;
+    *lenp = cst.st_size - off;
+    return (buf);
+fail:
+    free (buf);
+    close (fd);
+    return (NULL);
+}
+
+typedef int (*lua_cache_write_f) (struct lua_script *s, FILE *fp);
+
+/*
+ *  Write cache file [suffix] for script [s], with the data written
+ *   by [fn]. The file is written to a temporary name and renamed
+ *   into place so readers never see a partial file. Failure (e.g.
+ *   an unprivileged srun) is not an error.
+ */
+static void lua_cache_write (struct lua_script *s, const char *suffix,
+        lua_cache_write_f fn)
+{
+    struct lua_cache_header h;
+    char path [4096];
+    char tmp [4096];
+    FILE *fp;
+    int fd;
+    int err;
+
+    if (lua_cache_path (s, suffix, path, sizeof (path)) < 0)
+        return;
+
+    if (snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path) >= sizeof (tmp))
+        return;
+
+    if ((fd = mkstemp (tmp)) < 0) {
+        slurm_debug ("spank/lua: cache %s: %s", path, strerror (errno));
+        return;
+    }
+
+    /*
+     *  Don't make the chunk more readable than its source
+     */
+    if (fchmod (fd, s->st.st_mode & 0644) < 0 || !(fp = fdopen (fd, "w"))) {
+        close (fd);
+        unlink (tmp);
+        return;
+    }
+
+    lua_cache_header_init (&h, s->path, &s->st);
+    err = fwrite (&h, sizeof (h), 1, fp) != 1
+       || fwrite (s->path, 1, h.pathlen, fp) != h.pathlen
+       || (*fn) (s, fp) < 0;
+
+    if (fclose (fp) != 0 || err || rename (tmp, path) < 0) {
+        slurm_debug ("spank/lua: cache %s: write failed", path);
+        unlink (tmp);
+    }
+}
+
+/*
+ *  Load the cached chunk for script [s] onto the stack. Returns -1
+ *   with the stack untouched if there is no fresh cached chunk.
+ */
+static int lua_cache_load (struct lua_script *s)
+{
+    char name [4096];
+    char *buf;
+    size_t off, len;
+    int rc = 0;
+
+    if (!(buf = lua_cache_read (s, "", &off, &len)))
+        return (-1);
+
+    snprintf (name, sizeof (name), "@%s", s->path);
+    if (lua_load_chunk (s->L, buf + off, len, name)) {
+        slurm_debug ("spank/lua: %s: cached chunk: %s",
+                     basename (s->path), lua_tostring (s->L, -1));
+        lua_pop (s->L, 1);
+        rc = -1;
+    }
+    free (buf);
+    return (rc);
+}
+
+static int lua_cache_writer (lua_State *L, const void *p, size_t n, void *fp)
+{
+    return (fwrite (p, 1, n, fp) != n);
+}
+
+/*
+ *  Dump the chunk on top of the stack.
+ */
+static int lua_cache_dump (struct lua_script *s, FILE *fp)
+{
+    return (lua_dump_chunk (s->L, lua_cache_writer, fp) == 0 ? 0 : -1);
+}
+
+static void lua_index_suffix (char *buf, int len)
+{
+    snprintf (buf, len, ".%s.idx", spank_context_name ());
+}
+
+/*
+ *  The index holds the callback bits followed by the script args.
+ */
+static int lua_index_dump (struct lua_script *s, FILE *fp)
+{
+    uint32_t mask = s->callbacks;
+    const char *args = s->index_args ? s->index_args : "";
+
+    if (fwrite (&mask, sizeof (mask), 1, fp) != 1
+        || fwrite (args, 1, strlen (args), fp) != strlen (args))
+        return (-1);
+    return (0);
+}
+
+/*
+ *  Set s->callbacks from the callback index for script [s] in the
+ *   current context. Returns -1 if the script is not indexed, or its
+ *   index is stale or was produced with different script args.
+ */
+static int lua_script_index_load (struct lua_script *s)
+{
+    const char *args = s->index_args ? s->index_args : "";
+    uint32_t mask;
+    char suffix [64];
+    char *buf;
+    size_t off, len;
+    int rc = -1;
+
+    lua_index_suffix (suffix, sizeof (suffix));
+    if (!(buf = lua_cache_read (s, suffix, &off, &len)))
+        return (-1);
+
+    if (len == sizeof (mask) + strlen (args)
+        && memcmp (buf + off + sizeof (mask), args, strlen (args)) == 0) {
+        memcpy (&mask, buf + off, sizeof (mask));
+        s->callbacks = mask;
+        rc = 0;
+    }
+    free (buf);
+    return (rc);
+}
+
+/*
+ *  Load script [s] onto the stack, from the bytecode cache if
+ *   possible, otherwise from source (refreshing the cache). Cache
+ *   files get the permissions of the source, at most 0644.
+ */
+static int lua_script_load (struct lua_script *s)
+{
+    /*
+     *  Use the cache only if we could read the source itself, so
+     *   that the cache does not bypass the source's permissions.
+     */
+    if (access (s->path, R_OK) < 0)
+        return (luaL_loadfile (s->L, s->path) ? -1 : 0);
+
+    if (lua_cache_load (s) == 0)
+        return (0);
+
+    if (luaL_loadfile (s->L, s->path))
+        return (-1);
+
+    lua_cache_write (s, "", lua_cache_dump);
+    return (0);
+}
 
 static int lua_script_compile (struct lua_script *s)
 {
     /*
      *  Load script
      */
-    if (luaL_loadfile (s->L, s->path)) {
+    if (lua_script_load (s) < 0) {
         print_lua_script_error (s);
         return -1;
     }
@@ -1253,30 +2017,45 @@ static int lua_script_compile (struct lua_script *s)
 
     /*  Now, compile the loaded script
      */
-    if (lua_pcall (s->L, 0, 0, 0)) {
+    if (lua_script_pcall (s, 0, 0)) {
         print_lua_script_error (s);
         return -1;
     }
 
+    /*
+     *  Refresh the callback index if it was missing or stale
+     */
+    if (!s->indexed) {
+        char suffix [64];
+        lua_index_suffix (suffix, sizeof (suffix));
+        s->callbacks = lua_script_callbacks (s);
+        lua_cache_write (s, suffix, lua_index_dump);
+        s->indexed = 1;
+    }
+
     return 0;
 }
 
-
 int spank_lua_init (spank_t sp, int ac, char *av[])
 {
     struct spank_lua_options opt;
     ListIterator i;
     struct lua_script *script;
+    char *args;
+    size_t n;
+    int j;
     int rc = 0;
 
+    /*
+     *  Check for spank/lua options in argv
+     */
+    if (spank_lua_process_args (&ac, &av, &opt) < 0)
+        return (-1);
+
     if (ac == 0) {
         slurm_error ("spank/lua: Requires at least 1 arg");
         return (-1);
     }
-    /*
-     *  Check for spank/lua options in argv
-     */
-    spank_lua_process_args (&ac, &av, &opt);
 
     /*
      *  dlopen liblua to ensure that symbols from that lib are
@@ -1289,6 +2068,9 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
     }
 
     global_L = luaL_newstate ();
+    profile_dest = opt.profile;
+    lua_alloc_orig = lua_getallocf (global_L, &lua_alloc_orig_ud);
+    lua_setallocf (global_L, lua_alloc_counted, NULL);
     luaL_openlibs (global_L);
 
     /*
@@ -1319,23 +2101,58 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
         return (-1);
     }
 
+    /*
+     *  Script args, which key the callback index along with context
+     */
+    for (n = 0, j = 1; j < ac; j++)
+        n += strlen (av[j]) + 1;
+    if (!(args = calloc (1, n + 1))) {
+        slurm_error ("spank/lua: Out of memory");
+        return (-1);
+    }
+    for (j = 1; j < ac; j++) {
+        strcat (args, av[j]);
+        strcat (args, "\n");
+    }
+
     i = list_iterator_create (lua_script_list);
     while ((script = list_next (i))) {
         script->fail_on_error = opt.fail_on_error;
+        script->cache_dir = opt.cache_dir;
+        script->index_args = strdup (args);
+        script->max_mem = opt.max_mem;
+        script->max_insns = opt.max_insns;
 
         /*
-         *  Load script (luaL_loadfile) and compile it (lua_pcall).
+         *  Scripts found in the callback index with no callbacks in
+         *   this context are dropped without loading them. All other
+         *   scripts are loaded (from cache or source) and compiled
+         *   (lua_pcall) now, before privileges are dropped or tasks
+         *   are forked.
          */
+        if (lua_script_index_load (script) == 0) {
+            script->indexed = 1;
+            if (!(script->callbacks & spank_context_callbacks ())) {
+                slurm_debug ("%s: no callbacks in this context (indexed)",
+                             basename (script->path));
+                list_remove (i);
+                lua_script_destroy (script);
+                continue;
+            }
+        }
+
         if (lua_script_compile (script) < 0) {
-            if (opt.fail_on_error)
+            if (opt.fail_on_error) {
+                free (args);
                 return (-1);
+            }
             list_remove(i);
             lua_script_destroy (script);
             continue;
         }
 
         /*
-         *  Don't keep script loaded if the script doesn't have any
+         *  Don't keep script if the script doesn't have any
          *   callbacks in the current context.
          */
         if (!lua_script_valid_in_context (sp, script)) {
@@ -1346,6 +2163,7 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
         }
     }
     list_iterator_destroy (i);
+    free (args);
     slurm_verbose ("spank/lua: Loaded %d plugins in this context",
                     list_count (lua_script_list));
     return rc;
@@ -1459,10 +2277,114 @@ int slurm_spank_job_epilog (spank_t sp, int ac, char *av[])
             "slurm_spank_job_epilog", ac, av);
 }
 
+/*
+ *  Report CPU time and peak memory of each script at verbose level
+ */
+static void spank_lua_report (List l)
+{
+    struct lua_script *script;
+    ListIterator i;
+
+    if (l == NULL || !(i = list_iterator_create (l)))
+        return;
+
+    while ((script = list_next (i))) {
+        if (script->ncalls == 0)
+            continue;
+        slurm_verbose ("spank/lua: %s: %lu calls, %.3fs CPU, peak %luK",
+                       basename (script->path), script->ncalls,
+                       script->cpu_time,
+                       (unsigned long) (script->mem_peak + 1023) / 1024);
+    }
+    list_iterator_destroy (i);
+}
+
+/*
+ *  Format histogram of profile [p] into [buf] as a list of
+ *   "<LIMIT:COUNT" for non-empty buckets.
+ */
+static void lua_profile_hist (struct lua_profile *p, char *buf, int len)
+{
+    int i, n = 0;
+
+    buf [0] = '\0';
+    for (i = 0; i < LUA_PROFILE_BUCKETS && n < len; i++) {
+        unsigned long limit = 1UL << i;
+        if (p->hist [i] == 0)
+            continue;
+        if (limit < 1000)
+            n += snprintf (buf + n, len - n, " <%luus:%lu", limit, p->hist[i]);
+        else if (limit < 1000000)
+            n += snprintf (buf + n, len - n, " <%lums:%lu",
+                           (limit + 999) / 1000, p->hist[i]);
+        else
+            n += snprintf (buf + n, len - n, " <%lus:%lu",
+                           (limit + 999999) / 1000000, p->hist[i]);
+    }
+}
+
+/*
+ *  Dump latency profiles of all scripts to profile_dest
+ */
+static void spank_lua_profile_dump (List l)
+{
+    struct lua_script *script;
+    struct lua_profile *p;
+    ListIterator i, j;
+    FILE *fp = NULL;
+    char hist [1024];
+
+    if (l == NULL || profile_dest == NULL)
+        return;
+
+    if (strcmp (profile_dest, "syslog") == 0)
+        openlog ("spank-lua", LOG_PID, LOG_USER);
+    else if (*profile_dest && !(fp = fopen (profile_dest, "a"))) {
+        slurm_error ("spank/lua: profile: %s: %m", profile_dest);
+        return;
+    }
+
+    i = list_iterator_create (l);
+    while ((script = list_next (i))) {
+        if (script->profile == NULL)
+            continue;
+        j = list_iterator_create (script->profile);
+        while ((p = list_next (j))) {
+            const char *fmt = "%s %s: n=%lu mean=%.0fus max=%.0fus%s";
+            const char *name = basename (script->path);
+            double mean = p->total / p->count * 1e6;
+
+            lua_profile_hist (p, hist, sizeof (hist));
+            if (fp) {
+                fprintf (fp, "%d ", (int) getpid ());
+                fprintf (fp, fmt, name, p->name, p->count, mean,
+                         p->max * 1e6, hist);
+                fputc ('\n', fp);
+            }
+            else if (*profile_dest)
+                syslog (LOG_INFO, fmt, name, p->name, p->count, mean,
+                        p->max * 1e6, hist);
+            else
+                slurm_info ("spank/lua: profile: %s %s: n=%lu mean=%.0fus "
+                            "max=%.0fus%s", name, p->name, p->count, mean,
+                            p->max * 1e6, hist);
+        }
+        list_iterator_destroy (j);
+    }
+    list_iterator_destroy (i);
+
+    if (fp)
+        fclose (fp);
+    else if (*profile_dest)
+        closelog ();
+}
+
 int slurm_spank_exit (spank_t sp, int ac, char *av[])
 {
     int rc = call_foreach (lua_script_list, sp, "slurm_spank_exit", ac, av);
 
+    spank_lua_report (lua_script_list);
+    spank_lua_profile_dump (lua_script_list);
     if (lua_script_list)
         list_destroy (lua_script_list);
     if (script_option_list)
@@ -1476,6 +2398,8 @@ int slurm_spank_slurmd_exit (spank_t sp, int ac, char *av[])
     int rc = call_foreach (lua_script_list, sp,
             "slurm_spank_slurmd_exit", ac, av);
 
+    spank_lua_report (lua_script_list);
+    spank_lua_profile_dump (lua_script_list);
     if (lua_script_list)
         list_destroy (lua_script_list);
     if (script_option_list)
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <hwloc.h>
 #include <unistd.h>
@@ -36,6 +37,8 @@
 #include <slurm/slurm.h>
 #include <slurm/spank.h>
 
+#include "lib/strbuf.h"
+
 
 SPANK_PLUGIN(mpibind, 1);
 
@@ -45,7 +48,9 @@ mpibind: Automatically assign CPU and GPU affinity using best-guess defaults.\n\
 \n\
 The default behavior attempts to bind MPI tasks to specific processing\n\
 units.  If OMP_NUM_THREADS is set, each thread will be similarly bound\n\
-to a processing unit.\n\
+to a processing unit.  On nodes with more than one InfiniBand HCA,\n\
+UCX_NET_DEVICES and OMPI_MCA_btl_openib_if_include are set to the HCAs\n\
+closest to each task, unless already set by the user.\n\
 \n\
 Option Usage: --mpibind[=args...]\n\
   where args... is a period (.) separated list of one or more of the\n\
@@ -58,6 +63,12 @@ Option Usage: --mpibind[=args...]\n\
   <range>           Restrict the application to specific cores, e.g., 0-7\n\
   off               Disable binding\n\
   on                Enable binding (used when the system default is off)\n\
+  mem=bind          Also bind memory to the NUMA nodes of each task's CPUs\n\
+  mem=interleave    Interleave memory across the NUMA nodes of each task\n\
+  mem=none          Leave memory placement to first-touch (default)\n\
+\n\
+When memory binding is enabled, the policy and NUMA nodes used are\n\
+exported to the task in MPIBIND_MEMBIND, e.g. MPIBIND_MEMBIND=bind:0\n\
 \n\
 The above options can also be specified in the environment variable: MPIBIND\n\
 E.g., MPIBIND=w.0-9\n\
@@ -74,6 +85,7 @@ static hwloc_topology_t topology;
 static int32_t disabled = 0;       /* True if disabled by --mpibind=off       */
 static int32_t enabled = 1;        /* True if enabled by configuration        */
 static int32_t verbose = 0;
+static int32_t membind = 0;        /* hwloc membind policy, 0 for none        */
 static hwloc_bitmap_t cpubits = NULL; /* bitmap of custom-specified cores     */
 static uint32_t level_size = 0;    /* number of processing units available    */
 static uint32_t local_rank = 0;    /* rank relative to this node              */
@@ -83,6 +95,27 @@ static uint32_t num_cores = 0;     /* number of physical cores available      */
 static uint32_t num_threads = 0;
 static uint32_t rank = 0;
 
+/*
+ *  Binding plan: the cpuset and environment of every local rank,
+ *   computed once in slurmstepd (slurm_spank_user_init) and inherited
+ *   by each task across fork(), so that task_init is a table lookup.
+ */
+struct rank_plan {
+    hwloc_cpuset_t cpuset;     /* CPUs to which the rank is bound         */
+    char *gomp_str;            /* GOMP_CPU_AFFINITY value                 */
+    char *gpu_str;             /* CUDA_VISIBLE_DEVICES value, or NULL     */
+    char *ucx_str;             /* UCX_NET_DEVICES value, or NULL          */
+    char *openib_str;          /* OMPI_MCA_btl_openib_if_include value    */
+    int32_t numaobjs;          /* NUMA domains spanned by cpuset          */
+};
+static struct rank_plan *plan = NULL;
+static int32_t set_num_threads = 0; /* True if OMP_NUM_THREADS is a default */
+
+/*
+ *  Node-local topology XML exported by slurmd (NULL if disabled)
+ */
+static const char *topology_xml = "/var/run/slurm-mpibind.topology.xml";
+
 /*****************************************************************************
  *
  *  Forward declarations
@@ -136,6 +169,12 @@ static int parse_option (const char *opt, int32_t remote)
         verbose = 2;
     else if (!strncmp (opt, "w", 2))
         verbose = 1;
+    else if (!strncmp (opt, "mem=bind", 9))
+        membind = HWLOC_MEMBIND_BIND;
+    else if (!strncmp (opt, "mem=interleave", 15))
+        membind = HWLOC_MEMBIND_INTERLEAVE;
+    else if (!strncmp (opt, "mem=none", 9))
+        membind = 0;
     else if (isdigit (opt[0])) {
         /* provide a rough limit to the core value the user can request */
         int32_t coreobjs = sysconf(_SC_NPROCESSORS_ONLN);
@@ -281,7 +320,11 @@ static int get_local_env ()
     return rc;
 }
 
-static int get_remote_env (spank_t sp)
+/*
+ *  Read the environment shared by all tasks in this step. Called
+ *   from slurmstepd before any tasks are created.
+ */
+static int get_step_env (spank_t sp)
 {
     char  val[64];
     int32_t rc = -1;
@@ -289,27 +332,6 @@ static int get_remote_env (spank_t sp)
     if (disabled)
         return 0;
 
-    /* Turn off verbosity for all but rank 0 */
-    if ((spank_get_item (sp, S_TASK_ID, &rank) == ESPANK_SUCCESS)) {
-        if (rank)
-            verbose = 0;
-    } else {
-        slurm_error ("mpibind: Failed to retrieve global rank from environment");
-        goto ret;
-    }
-
-    if ((spank_getenv (sp, "OMPI_COMM_WORLD_LOCAL_RANK", val, sizeof (val)) ==
-         ESPANK_SUCCESS) ||
-        (spank_getenv (sp, "SLURM_LOCALID", val, sizeof (val)) ==
-         ESPANK_SUCCESS)) {
-        local_rank = strtol (val, NULL, 10);
-        if (verbose > 1)
-            slurm_error ("mpibind: retrieved local rank %u", local_rank);
-    } else {
-        slurm_error ("mpibind: Failed to retrieve local rank from environment");
-        goto ret;
-    }
-
     if (spank_get_item (sp, S_JOB_LOCAL_TASK_COUNT, &local_size) ==
         ESPANK_SUCCESS) {
         if (verbose > 1)
@@ -344,6 +366,43 @@ ret:
     return rc;
 }
 
+/*
+ *  Read the environment of a single task.
+ */
+static int get_remote_env (spank_t sp)
+{
+    char  val[64];
+    int32_t rc = -1;
+
+    if (disabled)
+        return 0;
+
+    /* Turn off verbosity for all but rank 0 */
+    if ((spank_get_item (sp, S_TASK_ID, &rank) == ESPANK_SUCCESS)) {
+        if (rank)
+            verbose = 0;
+    } else {
+        slurm_error ("mpibind: Failed to retrieve global rank from environment");
+        goto ret;
+    }
+
+    if ((spank_getenv (sp, "OMPI_COMM_WORLD_LOCAL_RANK", val, sizeof (val)) ==
+         ESPANK_SUCCESS) ||
+        (spank_getenv (sp, "SLURM_LOCALID", val, sizeof (val)) ==
+         ESPANK_SUCCESS)) {
+        local_rank = strtol (val, NULL, 10);
+        if (verbose > 1)
+            slurm_error ("mpibind: retrieved local rank %u", local_rank);
+    } else {
+        slurm_error ("mpibind: Failed to retrieve local rank from environment");
+        goto ret;
+    }
+
+    rc = 0;
+ret:
+    return rc;
+}
+
 /*
  * str2int () is specialized to parse the SLURM_JOB_CPUS_PER_NODE
  * value.  The format of the value can be:
@@ -411,6 +470,43 @@ static int job_step_is_batch (spank_t sp)
     return (0);
 }
 
+/*
+ * Bind the memory of this task to the NUMA nodes covering [cpuset]
+ * using the requested membind policy, and export the policy used.
+ */
+static int bind_memory (spank_t sp, hwloc_const_cpuset_t cpuset)
+{
+    char *nodes = NULL;
+    char *str = NULL;
+    const char *policy;
+    hwloc_nodeset_t nodeset = hwloc_bitmap_alloc ();
+    int rc = -1;
+
+    policy = (membind == HWLOC_MEMBIND_INTERLEAVE) ? "interleave" : "bind";
+
+    hwloc_cpuset_to_nodeset (topology, cpuset, nodeset);
+    hwloc_bitmap_list_asprintf (&nodes, nodeset);
+
+    if (hwloc_set_membind (topology, cpuset, membind, 0) < 0) {
+        if (verbose)
+            slurm_error ("mpibind: could not %s memory to NUMA nodes %s: %s",
+                         policy, nodes, strerror (errno));
+        goto out;
+    }
+
+    if (asprintf (&str, "%s:%s", policy, nodes) > 0) {
+        spank_setenv (sp, "MPIBIND_MEMBIND", str, 1);
+        if (verbose > 1)
+            slurm_error ("mpibind: MPIBIND_MEMBIND=%s", str);
+        free (str);
+    }
+    rc = 0;
+out:
+    free (nodes);
+    hwloc_bitmap_free (nodeset);
+    return rc;
+}
+
 static void display_cpubind (char *message)
 {
     char *str = NULL;
@@ -487,47 +583,111 @@ static int map_to_domains( int32_t rank, int32_t np, int32_t ndoms, int32_t *map
 
 static char *get_gomp_str (hwloc_cpuset_t cpuset)
 {
-    char *str = NULL;
-    int32_t i, j, rc;
+    strbuf_t sb;
+    int32_t i, j;
+
+    if (!(sb = strbuf_create ()))
+        return NULL;
 
     i = hwloc_bitmap_first (cpuset);
     j = num_threads;
 
     while ((i != -1) && (j > 0)) {
-        if (str)
-            rc = asprintf (&str, "%s,%d", str, i);
-        else
-            rc = asprintf (&str, "%d", i);
-        if (rc < 0) {
-            str = NULL;
-            break;
+        if (strbuf_appendf (sb, strbuf_len (sb) ? ",%d" : "%d", i) < 0) {
+            strbuf_destroy (sb);
+            return NULL;
         }
         i = hwloc_bitmap_next (cpuset, i);
         j--;
     }
 
-    return str;
+    if (strbuf_len (sb) == 0) {
+        strbuf_destroy (sb);
+        return NULL;
+    }
+    return strbuf_steal (sb);
 }
 
 /*
- * assign tasks to gpus and vice verso
+ * assign the gpus in [gpus_in_numa] to local rank [rank]
  * follows Edgar Leon Borja's algorithm from 'mpibind8'
  */
-static char *get_gpustring( int32_t gpus, int32_t numas, uint32_t *numagroup )
+static char *rank_gpustring( int32_t rank, int32_t gpus, int32_t numas,
+                             uint32_t (*gpus_in_numa)[gpus],
+                             uint32_t *gpus_per_numa )
 {
-    char *str = NULL;
-    hwloc_obj_t obj;
+    strbuf_t sb;
     int32_t mapped_numa=0, mapped_np_in_numa=0, mapped_id_in_numa=0;
+    uint32_t i=0, j=0;
+
+    /*
+     * map tasks to numas
+     */
+    if( map_to_domains( rank, local_size, numas, &mapped_numa, &mapped_np_in_numa, &mapped_id_in_numa) != 0 ){
+        slurm_error ("mpibind: failed to map tasks to nums\n");
+        return NULL;
+    }
+
+    if (!(sb = strbuf_create ()))
+        return NULL;
+
+    /*
+     * map GPUs and tasks
+     * case 1: More tasks than GPUs
+     * case 2: More GPUs than tasks
+     */
+    if( mapped_np_in_numa >= gpus_per_numa[mapped_numa] ){           // case 1
+        int32_t mapped_gpu=0, mapped_np_in_gpu=0, mapped_id_in_gpu=0;
+        if( map_to_domains( mapped_id_in_numa, mapped_np_in_numa, gpus_per_numa[mapped_numa],
+                            &mapped_gpu, &mapped_np_in_gpu, &mapped_id_in_gpu) != 0 ){
+            slurm_error("mpibind: failed to map tasks to gpus\n");
+            goto fail;
+        }
+        strbuf_appendf(sb, "%d", gpus_in_numa[mapped_numa][mapped_gpu]);
+    }else{                                                          // case 2
+        for( i=0; i<gpus_per_numa[mapped_numa]; i++ ){
+            int32_t mapped_task=0, mapped_gpus_in_task=0, mapped_id_in_task=0;
+            if( map_to_domains( i, gpus_per_numa[mapped_numa], mapped_np_in_numa,
+                               &mapped_task, &mapped_gpus_in_task, &mapped_id_in_task ) != 0 ){
+                slurm_error("mpibind:failed to map gpus to tasks\n");
+                goto fail;
+            }
+            if( mapped_id_in_numa == mapped_task ){
+                for(j=0; j<gpus_per_numa[mapped_numa]; j++){
+                    strbuf_appendf(sb, j ? ",%d" : "%d",
+                                   gpus_in_numa[mapped_numa][j]);
+                }
+                break;
+           }
+        }
+    }
+    if (strbuf_len (sb) == 0)
+        goto fail;
+    return strbuf_steal (sb);
+fail:
+    strbuf_destroy (sb);
+    return NULL;
+}
+
+/*
+ * assign gpus to numas, then fill [strs] with the gpu list of each
+ * of the local_size local ranks.
+ */
+static int get_gpustrings( int32_t gpus, int32_t numas, uint32_t *numagroup,
+                           char **strs )
+{
+    hwloc_obj_t obj;
     uint32_t (*gpus_in_numa)[gpus] = malloc(sizeof(uint32_t[numas][gpus]));
     uint32_t (*gpus_in_group)[gpus] = malloc(sizeof(uint32_t[numas][gpus]));
     uint32_t *gpus_per_numa = calloc (numas, sizeof (uint32_t));
     uint32_t *gpus_per_group = calloc (numas, sizeof (uint32_t));
     uint32_t i=0, j=0;
+    int32_t ngpus = 0;
+    int rc = -1;
 
     /*
      * assign gpus to parent numas by topology
      */
-    gpus = 0;
     for (obj = hwloc_get_next_osdev (topology, NULL); obj;
          obj = hwloc_get_next_osdev (topology, obj)) {
         if ( (obj->attr->osdev.type == HWLOC_OBJ_OSDEV_GPU) &&
@@ -546,14 +706,14 @@ static char *get_gpustring( int32_t gpus, int32_t numas, uint32_t *numagroup )
                 ancestor = hwloc_get_ancestor_obj_by_type (topology,
                                                     HWLOC_OBJ_MACHINE, obj);
             if (ancestor) {
-                gpus_in_numa[ancestor->os_index][gpus_per_numa[ancestor->os_index]]=gpus;
-                gpus_in_group[numagroup[ancestor->os_index]][gpus_per_group[numagroup[ancestor->os_index]]]=gpus;
+                gpus_in_numa[ancestor->os_index][gpus_per_numa[ancestor->os_index]]=ngpus;
+                gpus_in_group[numagroup[ancestor->os_index]][gpus_per_group[numagroup[ancestor->os_index]]]=ngpus;
                 gpus_per_numa[ancestor->os_index]++;
                 gpus_per_group[numagroup[ancestor->os_index]]++;
-                gpus++;
+                ngpus++;
             } else {
                 slurm_error ("mpibind: failed to find ancestor of GPU obj");
-                return NULL;
+                goto out;
             }
         }
     }
@@ -584,181 +744,421 @@ static char *get_gpustring( int32_t gpus, int32_t numas, uint32_t *numagroup )
     }
 
     /*
-     * map tasks to numas
-     */
-    if( map_to_domains( local_rank, local_size, numas, &mapped_numa, &mapped_np_in_numa, &mapped_id_in_numa) != 0 ){
-        slurm_error ("mpibind: failed to map tasks to nums\n");
-        return NULL;
-    }
-
-    /*
-     * map GPUs and tasks
-     * case 1: More tasks than GPUs
-     * case 2: More GPUs than tasks
+     * assign gpus to each local rank
      */
-    if( mapped_np_in_numa >= gpus_per_numa[mapped_numa] ){           // case 1
-        int32_t mapped_gpu=0, mapped_np_in_gpu=0, mapped_id_in_gpu=0;
-        if( map_to_domains( mapped_id_in_numa, mapped_np_in_numa, gpus_per_numa[mapped_numa],
-                            &mapped_gpu, &mapped_np_in_gpu, &mapped_id_in_gpu) != 0 ){
-            slurm_error("mpibind: failed to map tasks to gpus\n");
-            return NULL;
-        }
-        asprintf(&str, "%d", gpus_in_numa[mapped_numa][mapped_gpu]);
-    }else{                                                          // case 2
-        for( i=0; i<gpus_per_numa[mapped_numa]; i++ ){
-            int32_t mapped_task=0, mapped_gpus_in_task=0, mapped_id_in_task=0;
-            if( map_to_domains( i, gpus_per_numa[mapped_numa], mapped_np_in_numa,
-                               &mapped_task, &mapped_gpus_in_task, &mapped_id_in_task ) != 0 ){
-                slurm_error("mpibind:failed to map gpus to tasks\n");
-                return NULL;
-            }
-            if( mapped_id_in_numa == mapped_task ){
-                for(j=0; j<gpus_per_numa[mapped_numa]; j++){
-                    if( j==0 ){
-                        asprintf(&str,"%d",gpus_in_numa[mapped_numa][j]);
-                    }else{
-                        asprintf(&str,"%s,%d",str, gpus_in_numa[mapped_numa][j]);
-                    }
-                }
-           }
-        }
+    for (i = 0; i < local_size; i++) {
+        if (!(strs[i] = rank_gpustring (i, gpus, numas, gpus_in_numa,
+                                        gpus_per_numa)))
+            goto out;
     }
+    rc = 0;
+out:
     free(gpus_in_numa);
     free(gpus_in_group);
     free(gpus_per_numa);
     free(gpus_per_group);
-    return str;
+    return rc;
 }
 
-/*****************************************************************************
- *
- *  SPANK callback functions:
- *
- ****************************************************************************/
+/*
+ *  topology functions
+ */
 
-int slurm_spank_init (spank_t sp, int ac, char **av)
+/*
+ *  Set topology flags and filters for full discovery, including
+ *   the I/O devices needed for GPU affinity.
+ */
+static void topology_set_filters (hwloc_topology_t topo,
+                                  unsigned long flags)
 {
-    int i;
-    uint32_t hwloc_version = hwloc_get_api_version ();
-
-    if (hwloc_version != HWLOC_API_VERSION) {
-        if (verbose)
-            slurm_error ("mpibind plugin written for hwloc API 0x%x but running"
-                         "with hwloc library 0x%x", HWLOC_API_VERSION,
-                         hwloc_version);
-    }
-
-    if (!spank_remote (sp))
-        return (0);
-
-    for (i = 0; i < ac; i++) {
-        if (strncmp ("mpibind=", av[i], 8) == 0) {
-            const char *opt = av[i] + 8;
-            if (strncmp (opt, "off", 4) == 0)
-                disabled = 1;
-            else
-                slurm_error ("mpibind: ignoring invalid option \"%s\"", av[i]);
-            break;
-        } else {
-            slurm_error ("mpibind: ignoring invalid option \"%s\"", av[i]);
-        }
-    }
-
-    return (0);
+#if HWLOC_API_VERSION < 0x20000
+    hwloc_topology_set_flags (topo, HWLOC_TOPOLOGY_FLAG_IO_DEVICES | flags);
+#else
+    hwloc_topology_set_flags (topo, flags);
+    hwloc_topology_set_io_types_filter (topo,
+                                        HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
+    hwloc_topology_set_cache_types_filter (topo,
+                                           HWLOC_TYPE_FILTER_KEEP_STRUCTURE);
+    hwloc_topology_set_icache_types_filter (topo,
+                                            HWLOC_TYPE_FILTER_KEEP_STRUCTURE);
+#endif
 }
 
-int slurm_spank_init_post_opt (spank_t sp, int32_t ac, char **av)
+/*
+ *  Read the kernel boot id into [buf], used to detect a topology XML
+ *   exported before the last reboot (e.g. before a hardware change).
+ */
+static int read_boot_id (char *buf, int len)
 {
-    if (!spank_remote (sp))
-        return (get_local_env ());
+    FILE *fp;
+    int rc = -1;
 
-    return (0);
+    if (!(fp = fopen ("/proc/sys/kernel/random/boot_id", "r")))
+        return (-1);
+    if (fgets (buf, len, fp)) {
+        buf [strcspn (buf, "\n")] = '\0';
+        rc = 0;
+    }
+    fclose (fp);
+    return (rc);
 }
 
 /*
- *  Use the slurm_spank_user_init callback to check for exclusivity
- *   because user options are processed prior to calling here.
- *   Otherwise, we would not be able to use the `verbose' flag.
+ *  Export topology [topo] to the topology XML file, tagged with the
+ *   kernel boot id. The file is written under a temporary name and
+ *   renamed into place so that readers never see a partial file.
  */
-int slurm_spank_user_init (spank_t sp, int32_t ac, char **av)
+static int topology_xml_export (hwloc_topology_t topo)
 {
-    if (!spank_remote (sp))
-        return (0);
-
-    /*  Enable mpibind operation only if we make it through the
-     *   following checks.
-     */
-    enabled = 0;
+    char tmp [4096];
+    char bootid [64];
+    int n;
 
-    /*
-     *  In some versions of SLURM, batch script job steps appear as if
-     *   the user explicitly set --cpus-per-task, and this may cause
-     *   unexpected behavior. It is much safer to just disable mpibind
-     *   behavior for batch scripts.
-     */
-    if (job_step_is_batch (sp))
+    if (!topology_xml)
         return (0);
 
-    if (!job_is_exclusive (sp)) {
-        if (verbose)
-            fprintf (stderr, "mpibind: Disabling. "
-                     "(job doesn't have exclusive access to this node)\n");
-        return (0);
-    }
-    enabled = 1;
+    if (read_boot_id (bootid, sizeof (bootid)) == 0)
+        hwloc_obj_add_info (hwloc_get_root_obj (topo), "MpibindBootID",
+                            bootid);
 
-    /* Allocate and initialize topology object. */
-    hwloc_topology_init (&topology);
+    n = snprintf (tmp, sizeof (tmp), "%s.%d", topology_xml, getpid ());
+    if ((n < 0) || (n >= sizeof (tmp)))
+        return (-1);
 
 #if HWLOC_API_VERSION < 0x20000
-    hwloc_topology_set_flags (topology, HWLOC_TOPOLOGY_FLAG_IO_DEVICES);
+    n = hwloc_topology_export_xml (topo, tmp);
 #else
-    hwloc_topology_set_io_types_filter (topology,
-                                        HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
-    hwloc_topology_set_cache_types_filter (topology,
-                                           HWLOC_TYPE_FILTER_KEEP_STRUCTURE);
-    hwloc_topology_set_icache_types_filter (topology,
-                                            HWLOC_TYPE_FILTER_KEEP_STRUCTURE);
+    n = hwloc_topology_export_xml (topo, tmp, 0);
 #endif
+    if (n < 0) {
+        slurm_error ("mpibind: failed to export topology to %s", tmp);
+        unlink (tmp);
+        return (-1);
+    }
 
-    /* Perform the topology detection. */
-    hwloc_topology_load (topology);
+    if (rename (tmp, topology_xml) < 0) {
+        slurm_error ("mpibind: rename %s: %m", topology_xml);
+        unlink (tmp);
+        return (-1);
+    }
 
     return (0);
 }
 
-int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
+/*
+ *  Restrict topology [topo], loaded from the XML exported by slurmd
+ *   (and so describing the whole node), to the CPUs this process is
+ *   allowed to use, as live discovery would.
+ */
+static int topology_restrict_allowed (hwloc_topology_t topo)
 {
-    char *str;
-    char *gpustr;
-    float num_pus_per_task;
-    hwloc_cpuset_t *cpusets = NULL;
-    hwloc_cpuset_t cpuset;
-    hwloc_obj_t obj;
-    int32_t gpus = 0, numas = 0;
-    int32_t i;
-    int32_t index;
-    int32_t numaobjs;
-    uint32_t *numagroup;
+    hwloc_bitmap_t set = hwloc_bitmap_alloc ();
+    int rc = -1;
 
-    if (!spank_remote (sp))
-        return (0);
+#if HWLOC_API_VERSION >= 0x20100
+    /*  Allowed set was read from this system at load */
+    hwloc_bitmap_copy (set, hwloc_topology_get_allowed_cpuset (topo));
+#else
+    if (hwloc_get_cpubind (topo, set, HWLOC_CPUBIND_PROCESS) < 0)
+        goto out;
+#endif
 
-    get_remote_env (sp);
+    if (hwloc_bitmap_iszero (set))
+        goto out;
 
-    if (!enabled || disabled)
+    rc = 0;
+    if (!hwloc_bitmap_isincluded (hwloc_get_root_obj (topo)->cpuset, set))
+        rc = hwloc_topology_restrict (topo, set, 0);
+out:
+    hwloc_bitmap_free (set);
+    return (rc);
+}
+
+/*
+ *  Load the topology from the node-local XML file. The XML is only
+ *   used if it was exported since the last boot and describes the
+ *   same number of PUs as are online, otherwise the node has likely
+ *   changed since it was exported.
+ */
+static int topology_xml_load (void)
+{
+    struct stat st;
+    const char *xmlid;
+    char bootid [64];
+    int npus;
+
+    if (!topology_xml || (stat (topology_xml, &st) < 0))
+        return (-1);
+
+    hwloc_topology_init (&topology);
+#if HWLOC_API_VERSION >= 0x20100
+    topology_set_filters (topology, HWLOC_TOPOLOGY_FLAG_IS_THISSYSTEM
+                          | HWLOC_TOPOLOGY_FLAG_THISSYSTEM_ALLOWED_RESOURCES);
+#else
+    topology_set_filters (topology, HWLOC_TOPOLOGY_FLAG_IS_THISSYSTEM);
+#endif
+
+    if ((hwloc_topology_set_xml (topology, topology_xml) < 0)
+        || (hwloc_topology_load (topology) < 0)) {
+        slurm_error ("mpibind: failed to load topology from %s",
+                     topology_xml);
+        goto fail;
+    }
+
+    xmlid = hwloc_obj_get_info_by_name (hwloc_get_root_obj (topology),
+                                        "MpibindBootID");
+    if (!xmlid || (read_boot_id (bootid, sizeof (bootid)) < 0)
+        || strcmp (xmlid, bootid)) {
+        if (verbose)
+            slurm_error ("mpibind: %s is from a previous boot, ignoring",
+                         topology_xml);
+        goto fail;
+    }
+
+    npus = hwloc_get_nbobjs_by_type (topology, HWLOC_OBJ_PU);
+    if (npus != sysconf (_SC_NPROCESSORS_ONLN)) {
+        if (verbose)
+            slurm_error ("mpibind: %s is stale (%d PUs), ignoring",
+                         topology_xml, npus);
+        goto fail;
+    }
+
+    if (topology_restrict_allowed (topology) < 0) {
+        slurm_error ("mpibind: failed to restrict topology to allowed CPUs");
+        goto fail;
+    }
+
+    return (0);
+
+fail:
+    hwloc_topology_destroy (topology);
+    return (-1);
+}
+
+/*
+ *  Load the topology for this node, preferring the XML exported by
+ *   slurmd, and falling back to (expensive) live discovery. A stale
+ *   XML file is left for slurmd to refresh at its next start, since
+ *   the live topology here is restricted to the job's CPUs.
+ */
+static int topology_load (void)
+{
+    if (topology_xml_load () == 0)
         return (0);
 
-    if (verbose > 1) {
-        display_cpubind ("starting binding");
+    hwloc_topology_init (&topology);
+    topology_set_filters (topology, 0);
+
+    if (hwloc_topology_load (topology) < 0) {
+        slurm_error ("mpibind: failed to load topology");
+        hwloc_topology_destroy (topology);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * nic affinity functions
+ */
+
+/*
+ * Return the logical index of the one NUMA domain local to I/O object
+ * [obj], or -1 if the object is local to more than one (or no) domain.
+ */
+static int32_t io_numa_index (hwloc_obj_t obj, int32_t numas)
+{
+    hwloc_obj_t ancestor = hwloc_get_non_io_ancestor_obj (topology, obj);
+    int32_t i, index = -1;
+
+    if (!ancestor || !ancestor->cpuset)
+        return -1;
+
+    for (i = 0; i < numas; i++) {
+#if HWLOC_API_VERSION < 0x00010b00
+        hwloc_obj_t numa = hwloc_get_obj_by_type (topology, HWLOC_OBJ_NODE, i);
+#else
+        hwloc_obj_t numa = hwloc_get_obj_by_type (topology,
+                                                  HWLOC_OBJ_NUMANODE, i);
+#endif
+        if (numa && hwloc_bitmap_intersects (numa->cpuset, ancestor->cpuset)) {
+            if (index >= 0)
+                return -1;
+            index = i;
+        }
+    }
+    return index;
+}
+
+/*
+ * Return the logical index of the NUMA domain containing all of
+ * [cpuset], or -1 if the cpuset spans more than one domain.
+ */
+static int32_t cpuset_numa_index (hwloc_const_cpuset_t cpuset, int32_t numas)
+{
+    int32_t i;
+
+    for (i = 0; i < numas; i++) {
+#if HWLOC_API_VERSION < 0x00010b00
+        hwloc_obj_t numa = hwloc_get_obj_by_type (topology, HWLOC_OBJ_NODE, i);
+#else
+        hwloc_obj_t numa = hwloc_get_obj_by_type (topology,
+                                                  HWLOC_OBJ_NUMANODE, i);
+#endif
+        if (numa && hwloc_bitmap_isincluded (cpuset, numa->cpuset))
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Assign InfiniBand HCAs to local ranks by NUMA locality, mirroring the
+ * gpu assignment: ranks bound within a NUMA domain share the HCAs local
+ * to that domain, one HCA per rank when there are more ranks than HCAs,
+ * or a disjoint subset of HCAs per rank otherwise. Ranks in a domain
+ * without a local HCA may use any HCA. Only done on multi-rail nodes.
+ */
+static int assign_nics (void)
+{
+    hwloc_obj_t obj;
+    hwloc_obj_t *nics;
+    int32_t *nic_numa;
+    int32_t *rank_numa;
+    int32_t *ranks_in_numa;
+    int32_t nnics = 0, numas, i, r;
+
+#if HWLOC_API_VERSION < 0x00010b00
+    numas = hwloc_get_nbobjs_by_type (topology, HWLOC_OBJ_NODE);
+#else
+    numas = hwloc_get_nbobjs_by_type (topology, HWLOC_OBJ_NUMANODE);
+#endif
+
+    for (obj = hwloc_get_next_osdev (topology, NULL); obj;
+         obj = hwloc_get_next_osdev (topology, obj)) {
+        if (obj->attr->osdev.type == HWLOC_OBJ_OSDEV_OPENFABRICS)
+            nnics++;
+    }
+    if (nnics < 2)
+        return 0;
+
+    nics = calloc (nnics, sizeof (hwloc_obj_t));
+    nic_numa = calloc (nnics, sizeof (int32_t));
+    rank_numa = calloc (local_size, sizeof (int32_t));
+    ranks_in_numa = calloc (numas + 1, sizeof (int32_t));
+
+    nnics = 0;
+    for (obj = hwloc_get_next_osdev (topology, NULL); obj;
+         obj = hwloc_get_next_osdev (topology, obj)) {
+        if (obj->attr->osdev.type == HWLOC_OBJ_OSDEV_OPENFABRICS) {
+            nic_numa[nnics] = io_numa_index (obj, numas);
+            nics[nnics++] = obj;
+        }
+    }
+
+    for (r = 0; r < local_size; r++) {
+        rank_numa[r] = cpuset_numa_index (plan[r].cpuset, numas);
+        ranks_in_numa[rank_numa[r] + 1]++;
     }
 
+    for (r = 0; r < local_size; r++) {
+        int32_t local[nnics];
+        int32_t nlocal = 0, id_in_numa = 0, np_in_numa;
+        int32_t mapped = 0, np_in_dom = 0, id_in_dom = 0;
+        strbuf_t ucx = strbuf_create ();
+        strbuf_t openib = strbuf_create ();
+
+        if (!ucx || !openib) {
+            strbuf_destroy (ucx);
+            strbuf_destroy (openib);
+            break;
+        }
+
+        for (i = 0; i < nnics; i++) {
+            if ((rank_numa[r] >= 0) && (nic_numa[i] == rank_numa[r]))
+                local[nlocal++] = i;
+        }
+        if (nlocal == 0) {
+            for (i = 0; i < nnics; i++)
+                local[nlocal++] = i;
+        }
+
+        for (i = 0; i < r; i++) {
+            if (rank_numa[i] == rank_numa[r])
+                id_in_numa++;
+        }
+        np_in_numa = ranks_in_numa[rank_numa[r] + 1];
+
+        if (np_in_numa >= nlocal) {
+            map_to_domains (id_in_numa, np_in_numa, nlocal,
+                            &mapped, &np_in_dom, &id_in_dom);
+            strbuf_appendf (ucx, "%s:1", nics[local[mapped]]->name);
+            strbuf_append (openib, nics[local[mapped]]->name);
+        } else {
+            for (i = 0; i < nlocal; i++) {
+                map_to_domains (i, nlocal, np_in_numa,
+                                &mapped, &np_in_dom, &id_in_dom);
+                if (mapped != id_in_numa)
+                    continue;
+                strbuf_appendf (ucx, "%s%s:1", strbuf_len (ucx) ? "," : "",
+                                nics[local[i]]->name);
+                strbuf_appendf (openib, "%s%s", strbuf_len (openib) ? "," : "",
+                                nics[local[i]]->name);
+            }
+        }
+        plan[r].ucx_str = strbuf_steal (ucx);
+        plan[r].openib_str = strbuf_steal (openib);
+    }
+
+    free (nics);
+    free (nic_numa);
+    free (rank_numa);
+    free (ranks_in_numa);
+    return 0;
+}
+
+/*
+ * binding plan functions
+ */
+
+static void plan_destroy (void)
+{
+    int32_t i;
+
+    if (!plan)
+        return;
+
+    for (i = 0; i < local_size; i++) {
+        if (plan[i].cpuset)
+            hwloc_bitmap_free (plan[i].cpuset);
+        free (plan[i].gomp_str);
+        free (plan[i].gpu_str);
+        free (plan[i].ucx_str);
+        free (plan[i].openib_str);
+    }
+    free (plan);
+    plan = NULL;
+}
+
+/*
+ * Compute the cpuset, GOMP_CPU_AFFINITY and CUDA_VISIBLE_DEVICES
+ * values of all local ranks at once.
+ */
+static int plan_create (void)
+{
+    char **gpustrs = NULL;
+    float num_pus_per_task;
+    hwloc_cpuset_t *cpusets = NULL;
+    hwloc_obj_t obj;
+    int32_t gpus = 0, numas = 0;
+    int32_t i, r;
+    int32_t index, npus;
+    uint32_t *numagroup;
+    int rc = -1;
+
     local_threads = local_size;
     if (num_threads)
         local_threads *= num_threads;
 
-    cpuset = hwloc_bitmap_alloc();
-
     /*
      * The following creates an array of cpusets, one for each
      * processing unit required.
@@ -787,7 +1187,7 @@ int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
                     cpusets[num_cores] = hwloc_bitmap_dup (obj->cpuset);
                 } else {
                     slurm_error ("mpibind: failed to get core %d", i);
-                    return (ESPANK_ERROR);
+                    goto out;
                 }
                 num_cores++;
             }
@@ -816,18 +1216,11 @@ int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
             } else {
                 slurm_error ("mpibind: failed to get object %d at depth %d", i,
                              depth);
-                return (ESPANK_ERROR);
+                goto out;
             }
         }
     }
 
-    for (obj = hwloc_get_next_osdev (topology, NULL); obj;
-         obj = hwloc_get_next_osdev (topology, obj)) {
-        if (!strncmp (obj->name, "ib0", 3)) {
-            /* NIC Affinity support goes here */
-        }
-    }
-
     /* count the GPUS and then assign them to numas*/
     /* HWLOC_OBJ_OSDEV_GPU ids multiple objects per gpu,
      * as well as the controller, thus the need to only count 'render' objs
@@ -869,13 +1262,14 @@ int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
 
     /*
      * assign tasks to gpus or gpus to tasks as appropriate
-     * put it in a string
+     * put it in a string for each local rank
      */
     if (gpus) {
-        gpustr = get_gpustring(gpus, numas, numagroup);
-        if( gpustr == NULL ){
+        gpustrs = calloc (local_size, sizeof (char *));
+        if (get_gpustrings (gpus, numas, numagroup, gpustrs) < 0) {
             slurm_error ("mpibind: failed to assign %d gpus", gpus);
-            return (ESPANK_ERROR);
+            free (numagroup);
+            goto out;
         }
     }
     free(numagroup);
@@ -885,31 +1279,25 @@ int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
      */
     num_pus_per_task = (float) level_size / local_size;
 
-    if (!local_rank && verbose > 2)
+    if (verbose > 2)
         slurm_error ("mpibind: level size: %u, local size: %u, pus per task %f",
                      level_size, local_size, num_pus_per_task);
 
     /*
-     * If the user did not set it, set the OMP_NUM_THREADS environment
-     * variable to the number of cores this task will have.
+     * If the user did not set it, OMP_NUM_THREADS will be set to the
+     * number of cores each task will have.
      */
     if (!num_threads) {
-        int rc;
         num_threads = num_cores / local_size;
         if (!num_threads)
             num_threads = 1;
-        rc = asprintf (&str, "%u", num_threads);
-        if (rc > 0) {
-            spank_setenv (sp, "OMP_NUM_THREADS", str, 0);
-            if (verbose > 2)
-                slurm_error ("mpibind: setting OMP_NUM_THREADS to %s", str);
-            free (str);
-        } else if (verbose)
-	  slurm_error ("mpibind: failed to set OMP_NUM_THREADS");
+        set_num_threads = 1;
     }
 
+    plan = calloc (local_size, sizeof (struct rank_plan));
+
     /*
-     * Create the cpuset to which this task will be bound.  The
+     * Create the cpuset to which each rank will be bound.  The
      * resulting cpuset will be the union of cpusets[] elements.
      *
      * Note: num_pus_per_task is a float value.  It allows us to
@@ -917,39 +1305,256 @@ int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
      * cpusets[].  Otherwise there could be an uneven distribution of
      * tasks to NUMA nodes for example.
      */
-    index = (int32_t) (local_rank * num_pus_per_task);
-    if (num_pus_per_task < 1.0)
-        num_pus_per_task = 1.0;
+    npus = (num_pus_per_task < 1.0) ? 1 : (int32_t) num_pus_per_task;
 
-    for (i = index; i < index + (int32_t) num_pus_per_task; i++) {
-        hwloc_bitmap_or (cpuset, cpuset, cpusets[i]);
-    }
+    for (r = 0; r < local_size; r++) {
+        struct rank_plan *p = &plan[r];
+
+        p->cpuset = hwloc_bitmap_alloc ();
+        index = (int32_t) (r * num_pus_per_task);
+        for (i = index; (i < index + npus) && (i < level_size); i++)
+            hwloc_bitmap_or (p->cpuset, p->cpuset, cpusets[i]);
 
-    if (verbose) {
-        /* An MPI task with threads should not span more than one NUMA domain */
 #if HWLOC_API_VERSION < 0x00010b00
-        numaobjs = hwloc_get_nbobjs_inside_cpuset_by_type (topology, cpuset,
-                                                           HWLOC_OBJ_NODE);
+        p->numaobjs = hwloc_get_nbobjs_inside_cpuset_by_type (topology,
+                                                  p->cpuset, HWLOC_OBJ_NODE);
 #else
-        numaobjs = hwloc_get_nbobjs_inside_cpuset_by_type (topology, cpuset,
-                                                           HWLOC_OBJ_NUMANODE);
+        p->numaobjs = hwloc_get_nbobjs_inside_cpuset_by_type (topology,
+                                                  p->cpuset, HWLOC_OBJ_NUMANODE);
 #endif
-        if ((local_size < numaobjs) && (num_threads > 1)) {
-            slurm_error ("mpibind: rank %d spans %d NUMA domains",
-                         local_rank, numaobjs);
+
+        if (num_threads == 1)
+            hwloc_bitmap_singlify (p->cpuset);
+        else
+            decimate_cpuset (p->cpuset);
+
+        /*
+         * Construct the list of cpus to which each thread will be bound
+         * for the GOMP_CPU_AFFINITY environment variable.
+         */
+        p->gomp_str = get_gomp_str (p->cpuset);
+
+        if (gpustrs)
+            p->gpu_str = gpustrs[r];
+    }
+
+    /*
+     * Assign network adapters by the NUMA locality of each rank.
+     */
+    assign_nics ();
+
+    rc = 0;
+
+out:
+    if (cpusets) {
+        for (i = 0; i < level_size; i++)
+            if (cpusets[i])
+                hwloc_bitmap_free (cpusets[i]);
+        free (cpusets);
+    }
+    if (rc < 0 && gpustrs) {
+        for (r = 0; r < local_size; r++)
+            free (gpustrs[r]);
+    }
+    free (gpustrs);
+    return rc;
+}
+
+static void parse_argv (int ac, char **av)
+{
+    int i;
+
+    for (i = 0; i < ac; i++) {
+        if (strncmp ("mpibind=", av[i], 8) == 0) {
+            const char *opt = av[i] + 8;
+            if (strncmp (opt, "off", 4) == 0)
+                disabled = 1;
+            else
+                slurm_error ("mpibind: ignoring invalid option \"%s\"", av[i]);
+        } else if (strcmp ("topology_xml=none", av[i]) == 0) {
+            topology_xml = NULL;
+        } else if (strncmp ("topology_xml=", av[i], 13) == 0) {
+            topology_xml = av[i] + 13;
+        } else {
+            slurm_error ("mpibind: ignoring invalid option \"%s\"", av[i]);
         }
     }
+}
 
-    if (num_threads == 1)
-        hwloc_bitmap_singlify (cpuset);
-    else
-        decimate_cpuset (cpuset);
+/*****************************************************************************
+ *
+ *  SPANK callback functions:
+ *
+ ****************************************************************************/
+
+int slurm_spank_init (spank_t sp, int ac, char **av)
+{
+    uint32_t hwloc_version = hwloc_get_api_version ();
 
-    hwloc_bitmap_asprintf (&str, cpuset);
+    if (hwloc_version != HWLOC_API_VERSION) {
+        if (verbose)
+            slurm_error ("mpibind plugin written for hwloc API 0x%x but running"
+                         "with hwloc library 0x%x", HWLOC_API_VERSION,
+                         hwloc_version);
+    }
+
+    if (!spank_remote (sp))
+        return (0);
+
+    parse_argv (ac, av);
+
+    return (0);
+}
+
+/*
+ *  Export the full node topology once at slurmd startup, so that
+ *   job steps can load it from XML instead of repeating discovery.
+ */
+int slurm_spank_slurmd_init (spank_t sp, int ac, char **av)
+{
+    hwloc_topology_t topo;
+
+    parse_argv (ac, av);
+
+    if (!topology_xml)
+        return (0);
+
+    hwloc_topology_init (&topo);
+    topology_set_filters (topo, 0);
+
+    if (hwloc_topology_load (topo) < 0) {
+        slurm_error ("mpibind: failed to load topology");
+        hwloc_topology_destroy (topo);
+        return (0);
+    }
+
+    /*
+     *  The XML file only saves time in job steps, so failing to
+     *   write it must not keep slurmd from starting.
+     */
+    if (topology_xml_export (topo) < 0)
+        slurm_error ("mpibind: failed to write %s, ignoring", topology_xml);
+    hwloc_topology_destroy (topo);
+
+    return (0);
+}
+
+int slurm_spank_init_post_opt (spank_t sp, int32_t ac, char **av)
+{
+    if (!spank_remote (sp))
+        return (get_local_env ());
+
+    return (0);
+}
+
+/*
+ *  Use the slurm_spank_user_init callback to check for exclusivity
+ *   because user options are processed prior to calling here.
+ *   Otherwise, we would not be able to use the `verbose' flag.
+ */
+int slurm_spank_user_init (spank_t sp, int32_t ac, char **av)
+{
+    if (!spank_remote (sp))
+        return (0);
+
+    /*  Enable mpibind operation only if we make it through the
+     *   following checks.
+     */
+    enabled = 0;
+
+    if (disabled)
+        return (0);
+
+    /*
+     *  In some versions of SLURM, batch script job steps appear as if
+     *   the user explicitly set --cpus-per-task, and this may cause
+     *   unexpected behavior. It is much safer to just disable mpibind
+     *   behavior for batch scripts.
+     */
+    if (job_step_is_batch (sp))
+        return (0);
+
+    if (!job_is_exclusive (sp)) {
+        if (verbose)
+            fprintf (stderr, "mpibind: Disabling. "
+                     "(job doesn't have exclusive access to this node)\n");
+        return (0);
+    }
+
+    if (get_step_env (sp) < 0)
+        return (0);
+
+    if (disabled)
+        return (0);
+
+    /* Load the topology from XML if possible, else by detection. */
+    if (topology_load () < 0)
+        return (0);
+
+    /* Compute the binding of every local rank up front. */
+    if (plan_create () < 0) {
+        plan_destroy ();
+        hwloc_topology_destroy (topology);
+        return (ESPANK_ERROR);
+    }
+
+    enabled = 1;
+
+    return (0);
+}
+
+int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
+{
+    char *str;
+    struct rank_plan *p;
+
+    if (!spank_remote (sp))
+        return (0);
+
+    if (!enabled || disabled)
+        return (0);
+
+    if (get_remote_env (sp) < 0)
+        return (ESPANK_ERROR);
+
+    if (local_rank >= local_size) {
+        slurm_error ("mpibind: local rank %u out of range (local size %u)",
+                     local_rank, local_size);
+        return (ESPANK_ERROR);
+    }
+    p = &plan[local_rank];
+
+    if (verbose > 1) {
+        display_cpubind ("starting binding");
+    }
+
+    /*
+     * If the user did not set it, set the OMP_NUM_THREADS environment
+     * variable to the number of cores this task will have.
+     */
+    if (set_num_threads) {
+        int rc;
+        rc = asprintf (&str, "%u", num_threads);
+        if (rc > 0) {
+            spank_setenv (sp, "OMP_NUM_THREADS", str, 0);
+            if (verbose > 2)
+                slurm_error ("mpibind: setting OMP_NUM_THREADS to %s", str);
+            free (str);
+        } else if (verbose)
+	  slurm_error ("mpibind: failed to set OMP_NUM_THREADS");
+    }
+
+    /* An MPI task with threads should not span more than one NUMA domain */
+    if (verbose && (local_size < p->numaobjs) && (num_threads > 1)) {
+        slurm_error ("mpibind: rank %d spans %d NUMA domains",
+                     local_rank, p->numaobjs);
+    }
+
+    hwloc_bitmap_asprintf (&str, p->cpuset);
     if (verbose > 2)
         slurm_error ("mpibind: resulting cpuset %s", str);
 
-    if (hwloc_set_cpubind (topology, cpuset, 0)) {
+    if (hwloc_set_cpubind (topology, p->cpuset, 0)) {
         if (verbose)
             slurm_error ("mpibind: could not bind to cpuset %s: %s", str,
                          strerror (errno));
@@ -958,42 +1563,58 @@ int slurm_spank_task_init (spank_t sp, int32_t ac, char **av)
     }
     free (str);
 
-    /*
-     * Construct the list of cpus to which each thread will be bound
-     * and assign it to the GOMP_CPU_AFFINITY environment variable.
-     */
-    if ((str = get_gomp_str (cpuset))) {
-        spank_setenv (sp, "GOMP_CPU_AFFINITY", str, 1);
+    if (membind)
+        bind_memory (sp, p->cpuset);
+
+    if (p->gomp_str) {
+        spank_setenv (sp, "GOMP_CPU_AFFINITY", p->gomp_str, 1);
         if (verbose > 1)
-            slurm_error ("mpibind: GOMP_CPU_AFFINITY=%s", str);
-        free (str);
+            slurm_error ("mpibind: GOMP_CPU_AFFINITY=%s", p->gomp_str);
     }
 
     /*
      * Perform an analogous population of the CUDA_VISIBLE_DEVICES
      * environment variable that we did for GOMP_CPU_AFFINITY above.
      */
-    if (gpus) {
-        spank_setenv (sp, "CUDA_VISIBLE_DEVICES", gpustr, 1);
+    if (p->gpu_str) {
+        spank_setenv (sp, "CUDA_VISIBLE_DEVICES", p->gpu_str, 1);
         if (verbose > 1)
-            slurm_error ("mpibind: CUDA_VISIBLE_DEVICES=%s", gpustr);
-        free (gpustr);
+            slurm_error ("mpibind: CUDA_VISIBLE_DEVICES=%s", p->gpu_str);
+    }
+
+    /*
+     * Use the HCAs closest to this task, unless the user chose already.
+     */
+    if (p->ucx_str) {
+        spank_setenv (sp, "UCX_NET_DEVICES", p->ucx_str, 0);
+        spank_setenv (sp, "OMPI_MCA_btl_openib_if_include", p->openib_str, 0);
+        if (verbose > 1)
+            slurm_error ("mpibind: UCX_NET_DEVICES=%s", p->ucx_str);
     }
 
     if (verbose > 1) {
         display_cpubind ("resulting binding");
     }
 
-    /* Free our cpusets */
-    for (i = 0; i < level_size; i++) {
-        hwloc_bitmap_free (cpusets[i]);
-    }
-    free (cpusets);
-    hwloc_bitmap_free (cpuset);
+    /* Free the plan and topology inherited from slurmstepd. */
+    plan_destroy ();
     hwloc_bitmap_free (cpubits);
+    hwloc_topology_destroy (topology);
+
+    return (0);
+}
+
+/*
+ *  Release the plan in slurmstepd once all tasks have exited.
+ */
+int slurm_spank_exit (spank_t sp, int32_t ac, char **av)
+{
+    if (!spank_remote (sp) || !enabled)
+        return (0);
 
-    /* Destroy topology object. */
+    plan_destroy ();
     hwloc_topology_destroy (topology);
+    enabled = 0;
 
     return (0);
 }
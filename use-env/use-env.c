@@ -35,6 +35,7 @@
 #include "use-env.h"
 #include "list.h"
 #include "split.h"
+#include "strbuf.h"
 #include "log_msg.h"
 
 #define NO_SEARCH_SYSTEM 1<<0
@@ -366,8 +367,7 @@ define_use_env_keyword (spank_t sp, char *name, spank_item_t item)
 
 static int set_argv_keywords (spank_t sp)
 {
-    char *cmdline;
-    size_t cmdlen;
+    strbuf_t cmdline;
     char buf [64];
     const char **av;
     int ac;
@@ -388,34 +388,31 @@ static int set_argv_keywords (spank_t sp)
 
     keyword_define ("SLURM_ARGC", buf);
 
-    cmdlen = 0;
     for (i = 0; i < ac; i++) {
-
         snprintf (buf, sizeof (buf), "SLURM_ARGV%d", i);
         keyword_define (buf, av[i]);
-
-        cmdlen += strlen (av[i]) + 1;
     }
 
-    if ((cmdline = malloc (cmdlen + 1)) == NULL) {
+    if ((cmdline = strbuf_create ()) == NULL) {
         slurm_error ("use-env: Out of memory setting SLURM_CMDLINE!");
         return (-1);
     }
-    cmdline[0] = '\0';
-
 
     /*
      *  Build SLURM_CMDLINE string:
      */
-    strcat (cmdline, av[0]);
-    for (i = 1; i < ac; i++) {
-        strcat (cmdline, " ");
-        strcat (cmdline, av[i]);
+    for (i = 0; i < ac; i++) {
+        if ((i > 0 && strbuf_append (cmdline, " ") < 0)
+            || strbuf_append (cmdline, av[i]) < 0) {
+            slurm_error ("use-env: Out of memory setting SLURM_CMDLINE!");
+            strbuf_destroy (cmdline);
+            return (-1);
+        }
     }
 
-    keyword_define ("SLURM_CMDLINE", cmdline);
+    keyword_define ("SLURM_CMDLINE", strbuf_str (cmdline));
 
-    free (cmdline);
+    strbuf_destroy (cmdline);
 
     return (0);
 }